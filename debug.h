@@ -1,12 +1,15 @@
 #ifndef _DEBUG_H
 #define _DEBUG_H
 
+#include <stdio.h>
 #include <stdint.h>
 
 extern uint8_t debug_level;
-#define DEBUG(...) if(debug_level >= 3) printf(__VA_ARGS__) 
-#define PRINT(...) if(debug_level >= 2) printf(__VA_ARGS__) 
-#define ERROR(...) if(debug_level >= 1) printf(__VA_ARGS__) 
+extern uint8_t debug_stderr;  // set when standard output carries image data
+#define DEBUG_STREAM (debug_stderr ? stderr : stdout)
+#define DEBUG(...) if(debug_level >= 3) fprintf(DEBUG_STREAM, __VA_ARGS__) 
+#define PRINT(...) if(debug_level >= 2) fprintf(DEBUG_STREAM, __VA_ARGS__) 
+#define ERROR(...) if(debug_level >= 1) fprintf(DEBUG_STREAM, __VA_ARGS__) 
 
 #endif /* _DEBUG_H */
 
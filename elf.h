@@ -43,6 +43,26 @@ enum {
    EI_NIDENT     = 16          // Number of bytes in e_ident.
 };
 
+// File types.
+enum {
+   ET_NONE = 0,                // No file type
+   ET_REL  = 1,                // Relocatable file
+   ET_EXEC = 2                 // Executable file
+};
+
+// Versioning and data encoding.
+enum {
+   EV_CURRENT  = 1,            // Current ELF version
+   ELFDATA2LSB = 1             // Little-endian object file
+};
+
+// Object file classes.
+enum {
+   ELFCLASSNONE = 0,
+   ELFCLASS32   = 1,           // 32-bit object file
+   ELFCLASS64   = 2            // 64-bit object file
+};
+
 typedef struct {
 	unsigned char e_ident[EI_NIDENT]; // ELF Identification bytes
 	Elf32_Half    e_type;      // Type of file (see ET_* below)
@@ -73,4 +93,56 @@ typedef struct {
 	Elf32_Word sh_entsize;   // Size of records contained within the section
 } Elf32_Shdr;
 
+// Section types.
+enum {
+   SHT_NULL     = 0,           // No associated section (inactive entry).
+   SHT_PROGBITS = 1,           // Program-defined contents.
+   SHT_SYMTAB   = 2,           // Symbol table.
+   SHT_STRTAB   = 3,           // String table.
+   SHT_NOBITS   = 8            // Occupies no space in the file.
+};
+
+// Section flags.
+enum {
+   SHF_WRITE     = 0x1,        // Section data should be writable during execution.
+   SHF_ALLOC     = 0x2,        // Section occupies memory during program execution.
+   SHF_EXECINSTR = 0x4         // Section contains executable machine instructions.
+};
+
+// Symbol table entries for ELF32.
+typedef struct {
+	Elf32_Word    st_name;     // Symbol name (index into string table)
+	Elf32_Addr    st_value;    // Value or address associated with the symbol
+	Elf32_Word    st_size;     // Size of the symbol
+	unsigned char st_info;     // Symbol's type and binding attributes
+	unsigned char st_other;    // Must be zero; reserved
+	Elf32_Half    st_shndx;    // Which section (header table index) it's defined in
+} Elf32_Sym;
+
+#define ELF32_ST_BIND(i) ((i) >> 4)
+#define ELF32_ST_TYPE(i) ((i) & 0x0f)
+#define ELF32_ST_INFO(b, t) (((b) << 4) + ((t) & 0x0f))
+
+// Symbol bindings.
+enum {
+   STB_LOCAL  = 0,             // Local symbol, not visible outside obj file
+   STB_GLOBAL = 1,             // Global symbol, visible to all object files
+   STB_WEAK   = 2              // Weak symbol, like global but lower-precedence
+};
+
+// Symbol types.
+enum {
+   STT_NOTYPE  = 0,            // Symbol's type is not specified
+   STT_OBJECT  = 1,            // Symbol is a data object (variable, array, etc.)
+   STT_FUNC    = 2,            // Symbol is executable code (function, etc.)
+   STT_SECTION = 3,            // Symbol refers to a section
+   STT_FILE    = 4             // Local, absolute symbol that refers to a file
+};
+
+// Special section indices.
+enum {
+   SHN_UNDEF  = 0,             // Undefined, missing, irrelevant, or meaningless
+   SHN_LORESERVE = 0xff00      // Lowest reserved index
+};
+
 #endif
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Build an ESP32 image (-x) with a section list naming a section the ELF
+# file doesn't have. It must be left out of the image, which --scan then
+# reports as a valid esp32 image.
+set -e
+ZTOOL=${ZTOOL:-./ztool}
+OBJCOPY=${OBJCOPY:-objcopy}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf 'ztool esp32 missing section test data\n' > "$dir/data.bin"
+$OBJCOPY -I binary -O elf32-i386 --rename-section .data=.data,alloc,load,contents,data \
+   --change-section-address .data=0x3ffb0000 --set-start 0x40080000 "$dir/data.bin" "$dir/app.elf"
+
+$ZTOOL -x -e "$dir/app.elf" -o "$dir/app.bin" -c 4M -s .nosuch,.data > /dev/null 2>&1
+$ZTOOL --scan "$dir/app.bin" -o "$dir/scan" > /dev/null 2>&1
+if ! grep -q '"format":"esp32".*"segments":1,' "$dir/scan"; then
+   echo "FAIL: image with a missing section is not a valid esp32 image"
+   cat "$dir/scan"
+   exit 1
+fi
+echo "PASS: esp32 image with a missing section"
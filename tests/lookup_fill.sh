@@ -0,0 +1,28 @@
+#!/bin/sh
+# Look up a zboot image with fill records (--fill-runs) in a provenance
+# index. The records must be joined back into the section to match it.
+set -e
+ZTOOL=${ZTOOL:-./ztool}
+OBJCOPY=${OBJCOPY:-objcopy}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# A .data section with a long zero run between two stretches of text
+{
+   printf 'ztool fill record test, leading data..\n'
+   head -c 400 /dev/zero
+   printf 'ztool fill record test, trailing data.\n'
+} > "$dir/data.bin"
+$OBJCOPY -I binary -O elf32-i386 --rename-section .data=.data,alloc,load,contents,data \
+   --change-section-address .data=0x3ffe8000 "$dir/data.bin" "$dir/app.elf"
+
+$ZTOOL -z -e "$dir/app.elf" -o "$dir/app.z" -s .data --fill-runs 32 > "$dir/build.log" 2>&1
+grep -q "1 fill record" "$dir/build.log" || { echo "FAIL: no fill record in the image"; exit 1; }
+$ZTOOL --index "$dir/index" "$dir/app.elf" > /dev/null 2>&1
+$ZTOOL --lookup "$dir/index" -e "$dir/app.z" -o "$dir/lookup" > /dev/null 2>&1 || true
+if ! grep -qx "match $dir/app.elf" "$dir/lookup"; then
+   echo "FAIL: fill records image not matched by --lookup"
+   cat "$dir/lookup"
+   exit 1
+fi
+echo "PASS: lookup of a fill records image"
@@ -22,6 +22,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -29,53 +30,46 @@
 
 #include "debug.h"
 #include "ztool.h"
+#include "ztool_depend.h"
+#include "ztool_duplicate.h"
 #include "ztool_elf.h"
+#include "ztool_hex.h"
+#include "ztool_image.h"
+#include "ztool_index.h"
+#include "ztool_iram.h"
+#include "ztool_layout.h"
+#include "ztool_object.h"
+#include "ztool_personalize.h"
+#include "ztool_restamp.h"
+#include "ztool_scan.h"
+#include "ztool_size.h"
+#include "ztool_stable.h"
+#include "ztool_store.h"
+#include "ztool_sha256.h"
+#include "ztool_trace.h"
+#include "ztool_write.h"
 
-#define IMAGE_PADDING   16
-#define SECTION_PADDING 4
-#define CHECKSUM_INIT   0xEF
-#define BIN_MAGIC_FLASH 0xE9
 #define SEPARATOR_LIST  " ,;"
+#define FLASH_SIZE_UNSUPPORTED 0xff
 
 #define ZBOOT_DEFAULT_BUILD_VERSION 0x00000001
 #define ZBOOT_DEFAULT_BUILD_DESCRIPTION "zboot application"
 
+// A flash configuration to build an ESP8266 image for
 typedef struct
 {
-    uint32_t addr;
-    uint32_t size;
-} Section_Header;
+   uint8_t  flashMode;
+   uint8_t  flashSize;
+   uint8_t  flashClock;
+   char    *name;        // "<mode>-<size>-<speed>", used in the output file name
+} tFlashVariant;
 
-#define ZBOOT_MAGIC 0x279bfbf1
-
-typedef struct
-{
-    uint32_t magic;
-    uint32_t count;
-    uint32_t entry;
-    uint32_t version; 
-    uint32_t date;
-    uint32_t reserved[3];
-    char     description[88];
-} tzImageHeader;
-
-typedef struct
-{
-    uint8_t  magic;
-    uint8_t  count;
-    uint8_t  flags1;
-    uint8_t  flags2;
-    uint32_t entry;
-} tImageHeader;
-
-static const char PADDING[IMAGE_PADDING] = {0};
 uint8_t debug_level = 2;
+uint8_t debug_stderr = false;
 
 // --------------------------------------------------------------------------------
 // Helper Functions 
 
-#define SECONDS_BETWEEN_1970_AND_2000 946684800L
-
 uint32_t GetZbootTimestamp()
 {
     uint32_t current = time(NULL);
@@ -85,6 +79,65 @@ uint32_t GetZbootTimestamp()
        return (current - SECONDS_BETWEEN_1970_AND_2000);
 }
 
+// Name of a variant's output file: the variant name is inserted before the
+// extension of the output file name ("app.bin" becomes "app-dio-4M-40.bin")
+static char* VariantFileName(const char *outFile, const char *name, tArena *arena)
+{
+   const char *slash = strrchr(outFile, '/');
+   const char *dot = strrchr(outFile, '.');
+   size_t stem;
+   char *path;
+
+   if(NULL == dot || (NULL != slash && dot < slash) || dot == outFile)
+      dot = outFile + strlen(outFile);
+   stem = dot - outFile;
+   path = (char *) ArenaAlloc(arena, strlen(outFile) + strlen(name) + 2);
+   if(NULL != path)
+      sprintf(path, "%.*s-%s%s", (int) stem, outFile, name, dot);
+   return path;
+}
+
+// Write a copy of an ESP8266 image with other flash settings. The settings
+// are in the image header, outside the checksum, so only the header is
+// written; the rest of the image is copied with WriterCopyFile, which lets
+// the kernel copy (or reflink) it without passing it through ztool.
+// Produces error message on failure (so caller doesn't need to).
+static bool CopyBinVariant(const char *imageFile, const char *outFile, tFlashVariant *variant)
+{
+   tImageHeader header;
+   tWriter writer;
+   uint32_t length = 0;
+   bool success = true; // optimism
+   FILE *in;
+
+   in = fopen(imageFile, "rb");
+   if(NULL == in)
+   {
+      ERROR("Failed to open image '%s'\n", imageFile);
+      return false;
+   }
+   if(0 == fseek(in, 0, SEEK_END))
+      length = (uint32_t) ftell(in);
+   if(length < sizeof(header) || 0 != fseek(in, 0, SEEK_SET) || 1 != fread(&header, sizeof(header), 1, in))
+   {
+      ERROR("Failed to read image '%s'\n", imageFile);
+      fclose(in);
+      return false;
+   }
+
+   header.flags1 = variant->flashMode;
+   header.flags2 = (variant->flashSize << 4) | (variant->flashClock & 0xf);
+   success = WriterOpen(&writer, outFile, true);
+   if(success)
+   {
+      success = WriterWrite(&writer, &header, sizeof(header))
+             && WriterCopyFile(&writer, in, length - sizeof(header));
+      success = WriterClose(&writer) && success;
+   }
+   fclose(in);
+   return success;
+}
+
 // Write an elf section (by name) to an existing file.
 // Parameters:
 //   headed - add a header to the output
@@ -92,108 +145,31 @@ uint32_t GetZbootTimestamp()
 //   padded - output will be padded to multiple of SECTION_PADDING bytes
 //   chksum - pointer to existing checksum to add this data to (zero if not needed)
 // Produces error message on failure (so caller doesn't need to).
-static bool WriteElfSection(MyElf_File *elf, FILE *fd, char* sectionNameList[], uint32_t sectionCount,
+static bool WriteElfSection(MyElf_File *elf, tWriter *writer, char* sectionNameList[], uint32_t sectionCount,
    bool addHeader, bool zeroAddress, uint32_t padto, void *chksum, uint32_t checksumSize)
 {
-   MyElf_Section **sections = NULL;
+   tSectionData sectionData;
    bool success = true;
-   uint8_t *data = NULL;
-   uint32_t pad = 0;
-   uint32_t totalSize = 0;
-   uint32_t address = 0;
    uint32_t i;
 
    if(sectionCount <= 0)
       return true;  // Nothing to do?
 
-   sections = (MyElf_Section **) malloc(sectionCount * sizeof(MyElf_Section *));
-   if(NULL == sections)
-   {
-      ERROR("Failed to allocate memory for section list\n");
-      return false;
-   }
-
-   // Get the information for all sections
-   for(i = 0; success && i < sectionCount; ++i)
-   {
-      char *sectionName = sectionNameList[i];
-
-      DEBUG("%s: Reading section '%s'\n", __func__, sectionName);
-      sections[i] = GetElfSection(elf, sectionName);
-      if(NULL == sections[i]) 
-      {
-         ERROR("Warning: Section '%s' not found in elf file.\n", sectionName);
-      }
-      else
-      {
-         uint32_t sectionSize = sections[i]->size;
-         uint32_t offset = totalSize;
-
-         if(0 == sectionSize)
-         {
-            DEBUG("Section '%s' is empty; skipping\n", sectionName);
-            continue;
-         }
-
-         if(!zeroAddress && 0 == address)
-            address = sections[i]->address;
-
-         totalSize += sectionSize; 
-         data = realloc(data, totalSize + padto); // Reserve enough space for max padding 
-         if(NULL == data)
-         {
-             ERROR("%s: Failed to allocate buffer (%u bytes)\n", __func__, totalSize + padto);
-             success = false;
-         }
-         else
-         {
-            uint8_t *buffer = GetElfSectionData(elf, sections[i], 0);
-            if(NULL == buffer)
-            {
-               ERROR("%s: Failed to read data from ELF section '%s'\n", __func__, sectionName);
-               success = false;
-            }
-            else
-            {
-               DEBUG("%s: Total size %u after %u section(s) (%s is %u bytes)\n",
-                  __func__, totalSize, i+1, sectionName, sectionSize);
-               memcpy(&data[offset], buffer, sectionSize);
-               free(buffer);
-            }
-         }
-      }
-   }
-
-   // Determine padding (if any)
-   if(success && padto > 0)
-   {
-      pad = totalSize % padto;
-      if(pad > 0)
-      {
-         pad = padto - pad;
-         DEBUG("%s: Total length is %u bytes, padto %u bytes, padding is %u bytes\n",
-            __func__, totalSize, padto, pad);
-         memset(&data[totalSize], 0xa5, pad);  // pad bytes
-         totalSize += pad;
-      }
-      else
-      {
-         DEBUG("%s: Total length is %u bytes, no padding needed (padto is %u)\n", __func__, totalSize, padto);
-      }
-   }
+   success = ReadElfSections(elf, sectionNameList, sectionCount, zeroAddress, padto, &sectionData);
 
    // Calculate checksum of data
    if(success && NULL != chksum)
    {
       if(sizeof(uint32_t) == checksumSize)
       {
-         for(uint32_t i = 0; i < totalSize; i += sizeof(uint32_t))
-            *((uint32_t *) chksum) += *((uint32_t *) (data + i));
+         *((uint32_t *) chksum) += SectionDataChecksum(&sectionData);
       }
       else if(sizeof(uint8_t) == checksumSize)
       {
-         for(uint32_t i = 0; i < totalSize; ++i)
-            *((uint8_t *) chksum) ^= data[i];
+         TRACE_BEGIN("checksum");
+         for(i = 0; i < sectionData.size; ++i)
+            *((uint8_t *) chksum) ^= sectionData.data[i];
+         TRACE_END("checksum");
       }
       else
       {
@@ -205,11 +181,11 @@ static bool WriteElfSection(MyElf_File *elf, FILE *fd, char* sectionNameList[],
    if(success && addHeader)
    {
       Section_Header sechead;
-      sechead.addr = address;
-      sechead.size = totalSize;
+      sechead.addr = sectionData.address;
+      sechead.size = sectionData.size;
       DEBUG("Adding section header: address %08x, size %08x\n", sechead.addr,
          sechead.size);
-      if(fwrite(&sechead, 1, sizeof(sechead), fd) != sizeof(sechead))
+      if(!WriterWrite(writer, &sechead, sizeof(sechead)))
       {
          ERROR("Failed to write header\n");
          success = false;
@@ -223,83 +199,100 @@ static bool WriteElfSection(MyElf_File *elf, FILE *fd, char* sectionNameList[],
       }
    }
 	
-   if(success && totalSize > 0)
-   {
-      if(fwrite(data, 1, totalSize, fd) != totalSize) 
-      {
-         ERROR("Failed to write data (%u bytes)\n", totalSize); 
-         success = false;
-      }
-   }
-
-   if(NULL != sections)
-      free(sections);
-   if(NULL != data)
-      free(data);
+   if(success)
+      success = WriteSectionData(writer, &sectionData);
 
    return success; 
 }
 
 
+// Number of padding bytes (in a padding segment, after its header) needed so
+// that the data of a segment for 'address' starting at image 'offset' lands
+// on a flash offset the cache can map to that address.
+static uint32_t Esp32AlignmentPadding(uint32_t offset, uint32_t address)
+{
+   uint32_t dataOffset = offset + sizeof(Section_Header);
+   uint32_t pad;
+
+   if((dataOffset % ESP32_IROM_ALIGN) == (address % ESP32_IROM_ALIGN))
+      return 0;
+   pad = (address - (dataOffset + sizeof(Section_Header))) % ESP32_IROM_ALIGN;
+   return (0 == pad) ? ESP32_IROM_ALIGN : pad;  // an empty padding segment is not enough
+}
+
 // --------------------------------------------------------------------------------
 // Operations
 
 // Load an elf file and export a section of it to a new file, without
-// header, padding or checksum. For exporting the .irom0.text library.
+// header, padding or checksum. For exporting the .irom0.text library. With
+// hex output, the section is placed at its own address.
 // Produces error message on failure (so caller doesn't need to).
-bool ExportElfSection(char *inFile, char *outFile, char *sectionName)
+bool ExportElfSection(char *inFile, char *outFile, char *sectionName, const tHexOutput *hexOutput)
 {
+   tArena *arena = NULL;
    MyElf_File *elf = NULL;
-   FILE *fd = NULL;
+   tWriter writer;
    bool result = false;
 
-   elf = LoadElf(inFile);
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return false;
+
+   elf = LoadElf(inFile, arena);
    if(NULL == elf)
    {
       ERROR("Error: Failed to open ELF file '%s'\n", inFile);
+      ArenaRelease(arena);
       return false;
    }
 
-   fd = fopen(outFile, "wb");
-   if(NULL == fd)
-   { 
-      ERROR("Error: Failed to open ELF file '%s'\n", inFile);
-   }
-   else
+   if(WriterOpen(&writer, outFile, true))
    {
-      result = WriteElfSection(elf, fd, &sectionName, 1, false, false, 0, NULL, 0);
-      fclose(fd);
+      result = true;
+      if(NULL != hexOutput)
+      {
+         MyElf_Section *section = GetElfSection(elf, sectionName);
+         result = WriterStartHex(&writer, hexOutput);
+         if(NULL != section)
+            WriterSetAddress(&writer, section->address);
+      }
+      if(result)
+         result = WriteElfSection(elf, &writer, &sectionName, 1, false, false, 0, NULL, 0);
+      result = WriterClose(&writer) && result;
    }        
 
    UnloadElf(elf);
+   ArenaRelease(arena);
    return result;
 }
 
-// Create the main binary firmware image, from specified elf sections.
-// Can produce for standard standalone app (separate .irom0.text)
-// or sdk bootloaded apps (integrated .irom0.text).
-// Choice of type requires appropriately linked elf file.
-// Produces error message on failure (so caller doesn't need to).
 bool CreateHeaderFile(char *inFile, char *outFile, char *sections[], int numsec)
 {
+   tArena *arena = NULL;
    MyElf_File *elf = NULL;
+   tWriter writer;
    FILE *fd = NULL;
    bool success = true;  // optimism
 
-   elf = LoadElf(inFile);
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return false;
+
+   elf = LoadElf(inFile, arena);
    if(NULL == elf)
    {
       ERROR("Failed to open ELF file '%s'\n", inFile);
+      ArenaRelease(arena);
       return false;
    }
     
-   fd = fopen(outFile, "wb");
-   if(NULL == fd)
+   if(!WriterOpen(&writer, outFile, true))
    {
-      ERROR("Error: Failed to open output file '%s' for writing.\n", outFile);
       UnloadElf(elf);
+      ArenaRelease(arena);
       return false;
    }
+   fd = writer.fd;
 
    fprintf(fd, "#include <stdint.h>\n");
    fprintf(fd, "const uint32_t entry_addr = 0x%08x;\n", elf->header.e_entry);
@@ -339,6 +332,7 @@ bool CreateHeaderFile(char *inFile, char *outFile, char *sections[], int numsec)
          }
          else
          {
+            TRACE_BEGIN_ARG("format", sectionName);
             for (j = 0; j < sect->size; j++)
             {
                if (j % 16 == 0)
@@ -347,217 +341,338 @@ bool CreateHeaderFile(char *inFile, char *outFile, char *sections[], int numsec)
                   fprintf(fd, " 0x%02x,", bindata[j]);
             }
             fprintf(fd, "\r\n};\r\n");
-            free(bindata);
+            TRACE_END("format");
 	 }
       }
    }
  
-   fclose(fd);
+   success = WriterClose(&writer) && success;
    UnloadElf(elf);
+   ArenaRelease(arena);
    return success;	
 }
 
-bool CreateBinFile(char *inFile, char *outFile, uint8_t flashMode, uint8_t flashClock,
-   uint8_t flashSize, char *romSectionList[], uint32_t romSectionCount,
-   char *otherSectionList[], uint32_t otherSectionCount)
+// Create an image as a layout spec describes it: one of the built-in layouts
+// (bin, zboot or zboot2) or a spec file (see ztool_layout.h). If storeDir is
+// specified, the section contents go to that content-addressed store and
+// outFile receives a recipe to rebuild the image (see MaterializeRecipe).
+// If stableFile is specified, sections keep the image offsets recorded there
+// by the previous build, with 'slack' bytes of room after each new section,
+// and the offsets of this build are written back (see ztool_stable.h).
+// Produces error message on failure (so caller doesn't need to).
+bool CreateLayoutFile(char *inFile, char *outFile, char *layoutName, const tLayoutValues *values,
+   char *romSectionList[], uint32_t romSectionCount, char *otherSectionList[], uint32_t otherSectionCount,
+   char *storeDir, const tHexOutput *hexOutput, const char *stableFile, uint32_t slack)
 {
+   tArena *arena = NULL;
    MyElf_File *elf = NULL;
-   FILE *fd = NULL;
-   uint8_t chksum = CHECKSUM_INIT;
+   tLayout *layout = NULL;
+   tStableLayout *stable = NULL;
+   tWriter writer;
    bool success = true; // optimism
-   uint32_t i;
 
-   DEBUG("%s: Flash mode %u, size %u, clock %u, ROM sections %u, other sections %u\n", __func__,
-      flashMode, flashSize, flashClock, romSectionCount, otherSectionCount);
+   WriterInit(&writer, NULL);
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return false;
 
-   elf = LoadElf(inFile);
-   if(NULL == elf)
+   layout = LayoutLoad(layoutName, arena);
+   success = (NULL != layout);
+   if(success && NULL != stableFile)
    {
-      ERROR("Failed to open ELF file '%s'\n", inFile);
-      success = false;
-   }
-    
-   if(success)
-   {
-      fd = fopen(outFile, "wb");
-      if(NULL == fd)
+      if(0 == strcmp(layoutName, "bin"))
       {
-         ERROR("Failed to open output file '%s'\n", outFile);
+         // The boot ROM loads every section, so there can be no filler sections
+         ERROR("The bin layout can't be stable\n");
          success = false;
       }
-   }
-
-   if(success)
-   {
-      tImageHeader imageHeader;
-      imageHeader.magic = BIN_MAGIC_FLASH;
-      imageHeader.count = otherSectionCount + ((romSectionCount > 0) ? 1 : 0); 
-      imageHeader.flags1 = flashMode;
-      imageHeader.flags2 = (flashSize << 4) | (flashClock & 0xf);
-      imageHeader.entry = elf->header.e_entry;
-      DEBUG("Image header: magic 0x%02x, section count %u, flags1 0x%02x, flags2 0x%02x, entry 0x%08x\n",
-         imageHeader.magic, imageHeader.count, imageHeader.flags1, imageHeader.flags2,
-         imageHeader.entry); 
-      if(fwrite(&imageHeader, 1, sizeof(imageHeader), fd) != sizeof(imageHeader))
+      else
       {
-         ERROR("Failed to write image header\n");
-         success = false;
+         stable = StableLoad(stableFile, layoutName, slack, arena);
+         success = (NULL != stable);
       }
    }
-      
-   // Write all of the ROM sections first, with just one header for all
-   if(success && romSectionCount > 0 && NULL != romSectionList)
+   if(success)
    {
-      if(!WriteElfSection(elf, fd, romSectionList, romSectionCount, true, true, SECTION_PADDING,
-         &chksum, sizeof(uint8_t)))
+      elf = LoadElf(inFile, arena);
+      if(NULL == elf)
       {
-         ERROR("Failed to write ROM section(s)\n");
+         ERROR("Failed to open ELF file '%s'\n", inFile);
          success = false;
       }
    }
 
-   for(i = 0; success && i < otherSectionCount; ++i)
+   if(success)
    {
-      char *sectionName = otherSectionList[i];
-      if(!WriteElfSection(elf, fd, &sectionName, 1, true, false, SECTION_PADDING, &chksum, sizeof(uint8_t)))
-      {
-         ERROR("Failed to write section '%s'\n", sectionName);
-         success = false;
-      }
+      success = WriterOpen(&writer, outFile, true);
+      if(success && NULL != storeDir)
+         success = WriterStartRecipe(&writer, storeDir);
+      if(success && NULL != hexOutput)
+         success = WriterStartHex(&writer, hexOutput);
    }
- 
+
    if(success)
+      success = LayoutWriteImage(layout, elf, &writer, values, romSectionList, romSectionCount,
+         otherSectionList, otherSectionCount, stable);
+
+   success = WriterClose(&writer) && success;
+   if(success && NULL != stable)
    {
-      size_t len = ftell(fd) + sizeof(uint8_t);  // Total size, plus checksum
-      uint32_t pad = len % IMAGE_PADDING;
-      if (pad > 0)
-      { 
-         pad = IMAGE_PADDING - pad;
-         DEBUG("%s: Padding image with %d byte(s).\n", __func__, pad);
-         if(fwrite(PADDING, 1, pad, fd) != pad) 
-         {
-            ERROR("Error: Failed to write padding to image file.\n");
-            success = false;
-         }
-      }
-      else
-      {
-         DEBUG("%s: No image padding needed (size %lu, padto %u)\n", __func__, len, IMAGE_PADDING);
-      }
+      PRINT("Stable layout: %u section(s) kept their image offset, %u moved\n",
+         stable->kept, stable->moved);
+      success = StableSave(stable, stableFile);
    }
+   if(NULL != elf)
+      UnloadElf(elf);
+   ArenaRelease(arena);
+
+   return success;
+}
+
+// Create an image for the ESP8266 boot ROM, with the built-in "bin" layout.
+// If storeDir is specified, the section contents go to that content-
+// addressed store and outFile receives a recipe to rebuild the image (see
+// MaterializeRecipe).
+// Produces error message on failure (so caller doesn't need to).
+bool CreateBinFile(char *inFile, char *outFile, uint8_t flashMode, uint8_t flashClock,
+   uint8_t flashSize, char *romSectionList[], uint32_t romSectionCount,
+   char *otherSectionList[], uint32_t otherSectionCount, char *storeDir, const tHexOutput *hexOutput)
+{
+   tLayoutValues values;
+
+   DEBUG("%s: Flash mode %u, size %u, clock %u, ROM sections %u, other sections %u\n", __func__,
+      flashMode, flashSize, flashClock, romSectionCount, otherSectionCount);
+
+   memset(&values, 0, sizeof(values));
+   values.flashMode = flashMode;
+   values.flashConfig = (flashSize << 4) | (flashClock & 0xf);
+   return CreateLayoutFile(inFile, outFile, "bin", &values, romSectionList, romSectionCount,
+      otherSectionList, otherSectionCount, storeDir, hexOutput, NULL, 0);
+}
+
+// Create ESP8266 images for several flash configurations, which differ
+// only in the flash settings in the image header. The first image is built
+// from the ELF file; the others are copies of it with the header patched
+// (see CopyBinVariant), so N variants cost about as much as one image.
+// Produces error message on failure (so caller doesn't need to).
+bool CreateBinVariants(char *inFile, char *outFile, tFlashVariant *variants, uint32_t variantCount,
+   char *romSectionList[], uint32_t romSectionCount, char *otherSectionList[], uint32_t otherSectionCount)
+{
+   tArena *arena = NULL;
+   char *firstFile = NULL;
+   bool success = true; // optimism
+   uint32_t i;
+
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return false;
 
+   firstFile = VariantFileName(outFile, variants[0].name, arena);
+   success = (NULL != firstFile) && CreateBinFile(inFile, firstFile, variants[0].flashMode,
+      variants[0].flashClock, variants[0].flashSize, romSectionList, romSectionCount,
+      otherSectionList, otherSectionCount, NULL, NULL);
    if(success)
+      PRINT("Created '%s'\n", firstFile);
+
+   for(i = 1; success && i < variantCount; ++i)
    {
-      DEBUG("%s: Writing checksum 0x%02x\n", __func__, chksum);
-      if(fwrite(&chksum, 1, sizeof(chksum), fd) != sizeof(chksum))
-      {
-         ERROR("Error: Failed to write checksum to image file.\n");
-         success = false;
-      }
+      char *variantFile = VariantFileName(outFile, variants[i].name, arena);
+      TRACE_BEGIN_ARG("variant", variants[i].name);
+      success = (NULL != variantFile) && CopyBinVariant(firstFile, variantFile, &variants[i]);
+      TRACE_END("variant");
+      if(success)
+         PRINT("Created '%s'\n", variantFile);
    }
 
-   if(NULL != fd)
-      fclose(fd);
-   if(NULL != elf)
-      UnloadElf(elf);
-	
+   ArenaRelease(arena);
    return success;
 }
 
-bool CreateZbootFile(char *inFile, char *outFile, uint32_t buildVersion, uint32_t buildDate, 
-   char *buildDescription, char *romSectionList[], uint32_t romSectionCount,
-   char *otherSectionList[], uint32_t otherSectionCount)
+// Create an ESP32 application image. Sections in romSectionList are mapped
+// through the flash cache, so each one gets its own segment whose data is
+// placed at an image offset congruent to its load address modulo
+// ESP32_IROM_ALIGN; padding segments are inserted where needed. The XOR
+// checksum and the appended SHA-256 are computed while the image is written.
+// Produces error message on failure (so caller doesn't need to).
+bool CreateEsp32File(char *inFile, char *outFile, uint8_t flashMode, uint8_t flashClock,
+   uint8_t flashSize, char *romSectionList[], uint32_t romSectionCount,
+   char *otherSectionList[], uint32_t otherSectionCount, const tHexOutput *hexOutput)
 {
+   tArena *arena = NULL;
    MyElf_File *elf = NULL;
-   FILE *fd = NULL;
-   uint32_t chksum = 0; 
+   tWriter writer;
+   tSha256 sha;
+   uint8_t chksum = CHECKSUM_INIT;
+   uint32_t segmentCount = 0;
+   uint32_t offset;
    bool success = true; // optimism
    uint32_t i;
 
-   elf = LoadElf(inFile);
+   DEBUG("%s: Flash mode %u, size %u, clock %u, ROM sections %u, other sections %u\n", __func__,
+      flashMode, flashSize, flashClock, romSectionCount, otherSectionCount);
+
+   WriterInit(&writer, NULL);
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return false;
+
+   elf = LoadElf(inFile, arena);
    if(NULL == elf)
    {
       ERROR("Failed to open ELF file '%s'\n", inFile);
       success = false;
    }
-    
-   if(success)
+
+   // Lay out the image first; the header needs the final segment count,
+   // including padding segments
+   offset = sizeof(tImageHeader) + sizeof(tEsp32ExtendedHeader);
+   for(i = 0; success && i < otherSectionCount + romSectionCount; ++i)
    {
-      fd = fopen(outFile, "wb");
-      if(NULL == fd)
+      bool isRom = (i >= otherSectionCount);
+      char *sectionName = isRom ? romSectionList[i - otherSectionCount] : otherSectionList[i];
+      MyElf_Section *section = GetElfSection(elf, sectionName);
+      if(NULL == section || 0 == section->size)
+         continue;
+      if(isRom && 0 != Esp32AlignmentPadding(offset, section->address))
       {
-         ERROR("Failed to open output file '%s'\n", outFile);
-         success = false;
+         offset += sizeof(Section_Header) + Esp32AlignmentPadding(offset, section->address);
+         ++segmentCount;
       }
+      offset += sizeof(Section_Header) + section->size + (SECTION_PADDING - 1);
+      offset &= ~(SECTION_PADDING - 1);
+      ++segmentCount;
+   }
+
+   if(success)
+   {
+      success = WriterOpen(&writer, outFile, true);
+      if(success && NULL != hexOutput)
+         success = WriterStartHex(&writer, hexOutput);
+      Sha256Init(&sha);
+      writer.sha = &sha;
    }
 
    if(success)
    {
-      tzImageHeader imageHeader;
-      memset(&imageHeader, 0, sizeof(imageHeader));
-      imageHeader.magic = ZBOOT_MAGIC; 
-      imageHeader.count = otherSectionCount + ((romSectionCount > 0) ? 1 : 0); 
+      tImageHeader imageHeader;
+      tEsp32ExtendedHeader extendedHeader;
+
+      imageHeader.magic = BIN_MAGIC_FLASH;
+      imageHeader.count = segmentCount;
+      imageHeader.flags1 = flashMode;
+      imageHeader.flags2 = (flashSize << 4) | (flashClock & 0xf);
       imageHeader.entry = elf->header.e_entry;
-      imageHeader.version = buildVersion;
-      imageHeader.date = buildDate;
-      if(NULL != buildDescription)
-         strncpy(imageHeader.description, buildDescription, sizeof(imageHeader.description));
-      else
-         strcpy(imageHeader.description, ZBOOT_DEFAULT_BUILD_DESCRIPTION); 
-      DEBUG("Image header: magic 0x%08x, count %u, entry 0x%08x, version 0x%08x, date 0x%08x, description '%s'\n",
-         imageHeader.magic, imageHeader.count, imageHeader.entry, imageHeader.version, imageHeader.date,
-         imageHeader.description);
-      if(fwrite(&imageHeader, 1, sizeof(imageHeader), fd) != sizeof(imageHeader))
+      memset(&extendedHeader, 0, sizeof(extendedHeader));
+      extendedHeader.wpPin = ESP32_WP_PIN_DISABLED;
+      extendedHeader.hashAppended = 1;
+      DEBUG("Image header: magic 0x%02x, segment count %u, flags1 0x%02x, flags2 0x%02x, entry 0x%08x\n",
+         imageHeader.magic, imageHeader.count, imageHeader.flags1, imageHeader.flags2,
+         imageHeader.entry);
+      if(!WriterWrite(&writer, &imageHeader, sizeof(imageHeader))
+      || !WriterWrite(&writer, &extendedHeader, sizeof(extendedHeader)))
       {
          ERROR("Failed to write image header\n");
          success = false;
       }
-
-      for(i = 0; i < sizeof(imageHeader); i += sizeof(uint32_t))
-         chksum += *((uint32_t *)(((uint8_t *) &imageHeader) + i));
    }
-   DEBUG("%s: Image header checksum = %08x\n", __func__, chksum);
-      
-   // Write all of the ROM sections first, with just one header for all
-   if(success && romSectionCount > 0 && NULL != romSectionList)
+
+   // RAM segments first, then the flash-mapped segments
+   for(i = 0; success && i < otherSectionCount + romSectionCount; ++i)
    {
-      if(!WriteElfSection(elf, fd, romSectionList, romSectionCount, true, true,
-         SECTION_PADDING, &chksum, sizeof(chksum)))
+      bool isRom = (i >= otherSectionCount);
+      char *sectionName = isRom ? romSectionList[i - otherSectionCount] : otherSectionList[i];
+      MyElf_Section *section = GetElfSection(elf, sectionName);
+      if(NULL == section || 0 == section->size)
+         continue;  // not counted in the layout pass either
+
+      if(isRom)
       {
-         ERROR("Failed to write ROM section(s)\n");
-         success = false;
+         uint32_t pad = Esp32AlignmentPadding(writer.offset, section->address);
+         if(pad > 0)
+         {
+            Section_Header sechead;
+            sechead.addr = 0;
+            sechead.size = pad;
+            DEBUG("%s: Padding segment of %u bytes before '%s'\n", __func__, pad, sectionName);
+            if(!WriterWrite(&writer, &sechead, sizeof(sechead)) || !WriterFill(&writer, 0, pad))
+               success = false;
+         }
       }
-   }
 
-   for(i = 0; success && i < otherSectionCount; ++i)
-   {
-      char *sectionName = otherSectionList[i];
-      if(!WriteElfSection(elf, fd, &sectionName, 1, true, false,
-         SECTION_PADDING, &chksum, sizeof(chksum)))
+      if(success && !WriteElfSection(elf, &writer, &sectionName, 1, true, false, SECTION_PADDING,
+         &chksum, sizeof(uint8_t)))
       {
          ERROR("Failed to write section '%s'\n", sectionName);
          success = false;
       }
    }
- 
+
+   // Checksum goes in the last byte of a 16-byte aligned image, followed by the hash
    if(success)
    {
-      DEBUG("%s: Writing checksum 0x%08x\n", __func__, chksum);
-      if(fwrite(&chksum, 1, sizeof(chksum), fd) != sizeof(chksum))
+      uint32_t pad = (IMAGE_PADDING - ((writer.offset + sizeof(uint8_t)) % IMAGE_PADDING)) % IMAGE_PADDING;
+      uint8_t digest[SHA256_DIGEST_SIZE];
+
+      DEBUG("%s: Padding image with %u byte(s), checksum 0x%02x\n", __func__, pad, chksum);
+      if(!WriterFill(&writer, 0, pad) || !WriterWrite(&writer, &chksum, sizeof(chksum)))
       {
          ERROR("Error: Failed to write checksum to image file.\n");
          success = false;
       }
+      else
+      {
+         writer.sha = NULL;
+         Sha256Final(&sha, digest);
+         if(!WriterWrite(&writer, digest, sizeof(digest)))
+         {
+            ERROR("Error: Failed to write SHA-256 to image file.\n");
+            success = false;
+         }
+      }
    }
 
-   if(NULL != fd)
-      fclose(fd);
+   success = WriterClose(&writer) && success;
    if(NULL != elf)
       UnloadElf(elf);
-	
+   ArenaRelease(arena);
+
    return success;
 }
 
+// Create an image for the zboot bootloader, with the built-in "zboot" or
+// "zboot2" layout. If storeDir is specified, the section contents go to that
+// content-addressed store and outFile receives a recipe to rebuild the image
+// (see MaterializeRecipe). If romAlign is non-zero, the ROM section data
+// starts at an image offset that is a multiple of romAlign, suitable for
+// mapping through the flash cache: in v1, after a filler section (address
+// zero, so zboot doesn't copy it), in v2 after a gap. 'layout' selects the
+// image format: ZBOOT_LAYOUT_V1, with a header before each section, or
+// ZBOOT_LAYOUT_V2, with a section table after the image header. With
+// stableFile, sections keep their image offsets from the previous build (see
+// CreateLayoutFile). If fillRuns is non-zero (v1 only), runs of at least
+// that many bytes of one value in loaded sections become fill records,
+// which zboot fills in memory instead of copying from flash.
+// Produces error message on failure (so caller doesn't need to).
+bool CreateZbootFile(char *inFile, char *outFile, uint32_t buildVersion, uint32_t buildDate, 
+   char *buildDescription, uint32_t romAlign, uint32_t fillRuns, char *romSectionList[],
+   uint32_t romSectionCount, char *otherSectionList[], uint32_t otherSectionCount, char *storeDir,
+   const tHexOutput *hexOutput, uint32_t layout, const char *stableFile, uint32_t slack)
+{
+   tLayoutValues values;
+
+   memset(&values, 0, sizeof(values));
+   values.version = buildVersion;
+   values.date = buildDate;
+   values.description = (NULL != buildDescription) ? buildDescription : ZBOOT_DEFAULT_BUILD_DESCRIPTION;
+   values.romAlign = romAlign;
+   values.fillRuns = fillRuns;
+   DEBUG("%s: Version 0x%08x, date 0x%08x, description '%s'\n", __func__, values.version, values.date,
+      values.description);
+   return CreateLayoutFile(inFile, outFile, (ZBOOT_LAYOUT_V2 == layout) ? "zboot2" : "zboot", &values,
+      romSectionList, romSectionCount, otherSectionList, otherSectionCount, storeDir, hexOutput,
+      stableFile, slack);
+}
+
 // ----------------------------------------------------------------------------------------
 // Main
 
@@ -570,23 +685,93 @@ static const char *programInfo =
 static const char *programUsage =
    "Usage:\n"
    "   [-h|-?]       Display program help\n"
-   "   [-b|-l|-i|-z] Select output file type\n"
+   "   [-b|-x|-l|-i|-z|-u|-a] Select output file type\n"
    "   -b            Create file suitable for ESP8266 boot ROM\n"
+   "   -x            Create file suitable for ESP32 boot ROM; -r sections are\n"
+   "                 mapped through the flash cache and aligned accordingly\n"
    "   -l            Create library file; a binary dump of one or more ELF sections\n"
    "   -i            Create a c/c++ header file from one or more ELF sections\n"
+   "   -t <type>     Output type for -i. Valid values are: c (default), obj (ELF\n"
+   "                 object), asm (.incbin assembler file). obj and asm also write\n"
+   "                 a header with extern declarations, named after the output\n"
    "   -z            Create a file suitable for the zboot bootloader\n"
-   "   -e <file>     Input (ELF) filename\n"
-   "   -o <file>     Output filename\n"
+   "   --zboot2      As -z, in the v2 (indexed) format: a table after the image\n"
+   "                 header gives each section's offset and checksum. Also applies\n"
+   "                 to the images created by --personalize\n"
+   "   --layout <spec> Create an image as described by a layout spec file (see\n"
+   "                 ztool_layout.h), or by a built-in layout: bin (as -b), zboot\n"
+   "                 (as -z) or zboot2 (as --zboot2). All -b and -z options apply\n"
+   "   --stable <file> With -z, --zboot2, --layout and --personalize, keep each\n"
+   "                 section at the image offset recorded in <file> by the previous\n"
+   "                 build, so unchanged sections stay in the same flash sectors.\n"
+   "                 New sections get room to grow; <file> is then updated\n"
+   "   --slack <bytes> Room left after each new section with --stable (default 256)\n"
+   "   --fill-runs <bytes> With -z (and --layout specs with fill records), write runs\n"
+   "                 of at least <bytes> (min. 24) of one byte value in loaded\n"
+   "                 sections as fill records, which zboot fills in memory instead\n"
+   "                 of copying from flash\n"
+   "   -u            Materialize an image from a recipe (-e) and the store (-k)\n"
+   "   -a            Create a size report, attributing the bytes of each ELF section\n"
+   "                 listed with -r/-s to symbols (output file is optional)\n"
+   "   -e <file>     Input (ELF) filename, or - for standard input. gzip and zstd\n"
+   "                 compressed ELF files are read directly (when ztool is built\n"
+   "                 with zlib and libzstd)\n"
+   "   -o <file>     Output filename, or - for standard output\n"
+   "   -p <file>     Previous (ELF) filename; size report shows symbol size changes\n"
    "   -s <sect.>    List of ELF sections to process. Allowed separators include\n"
    "                 space, comma, and semicolon\n" 
    "   -r <sect.>    List of ELF sections to include in zboot file. These sections\n"
    "                 are treated as ROM; not copied during the boot process.\n"
    "   -n <string>   Description of the application to include in zboot header\n"
+   "   -k <dir>      Content-addressed store: with -b/-z, section contents are\n"
+   "                 stored once in <dir> and the output file is a small recipe\n"
+   "   -A <bytes>    Align the ROM section data in a zboot file to this flash\n"
+   "                 boundary (e.g. 4096); the resulting image offset is reported\n"
+   "   -V <list>     With -b, create an image for each flash configuration in the\n"
+   "                 list, given as <mode>:<size>:<speed> (e.g. dio:4M:40,qio:1M:80).\n"
+   "                 Output files are named after -o, as <name>-<mode>-<size>-<speed>.<ext>\n"
+   "   -O <format>   Output format for -b, -x, -z and -l. Valid values are: bin\n"
+   "                 (default), ihex (Intel HEX), srec (S-records). Erased (0xff)\n"
+   "                 data is left out of ihex and srec files\n"
+   "   -B <address>  Flash address of the image, for ihex and srec output of\n"
+   "                 -b, -x and -z (the -l section is placed at its own address)\n"
    "   -v <hex>      Version (32-bit hext number) of application, included in zboot header\n"
    "   -c <size>     Flash capacity. Valid values are: 256k, 512K, 1M, 2M, 4M\n"
+   "                 (ESP32: 1M, 2M, 4M, 8M, 16M)\n"
    "   -m <mode>     Flash more. Valid values are: dio, dout, qio, qout\n"
    "   -f <speed>    Flash frequency. Valid values are: 20, 26, 40, 80\n"
    "   -d <level>    Set the debug level (0 is least debug, 3 is most)\n"
+   "   --index <file> Add the ELF files (and directories of ELF files) named after\n"
+   "                 the options to index <file>; unchanged files aren't re-read\n"
+   "   --lookup <file> List the ELF files in index <file> that produced image -e\n"
+   "   --scan        Scan the raw flash dumps named after the options (or -e) for\n"
+   "                 valid images; reports one JSON object per image, per line\n"
+   "   --restamp     Change the version (-v), description (-n) and date of the zboot\n"
+   "                 images named after the options, in place\n"
+   "   --date <when> Date for --restamp: now (default), keep, or a Unix time\n"
+   "   --personalize <records> Create a zboot image per device record (CSV or binary,\n"
+   "                 see ztool_personalize.h) from one template image, replacing the\n"
+   "                 contents of section --section <name>. -o names the images and\n"
+   "                 must contain %s for the device name\n"
+   "   --iram <file> Rank the functions of -e by the program counter samples in\n"
+   "                 <file> (hex, one per line, optional count) and write a linker\n"
+   "                 script fragment moving the hottest -r (ROM) functions that fit\n"
+   "                 into the IRAM left by the -s sections, counting their literal\n"
+   "                 pools (output file is optional)\n"
+   "   --iram-size <bytes> IRAM size for --iram (default 32768)\n"
+   "   --duplicates <bytes> Report data of at least <bytes> that appears more than\n"
+   "                 once in the -r/-s sections, with the owning symbols and the\n"
+   "                 bytes that could be reclaimed (output file is optional)\n"
+   "   -j <count>    Worker threads for --index and --personalize (default: one per\n"
+   "                 processor)\n"
+   "   -MD           Write a make/ninja dependency file listing the files read\n"
+   "                 (ELF files, templates, records, recipes, ...) as prerequisites\n"
+   "                 of the files written; named after the first output plus .d\n"
+   "   -MF <file>    As -MD, written to <file>\n"
+   "                 Output files whose contents don't change are never rewritten,\n"
+   "                 so their modification time is kept\n"
+   "   --trace <file> Write a timeline of the run to <file>, in Chrome trace-event\n"
+   "                 format (load in chrome://tracing or Perfetto)\n"
 
    "Returns:\n"
    "   0 on success\n"
@@ -598,22 +783,87 @@ typedef enum
    MODE_LIBRARY,
    MODE_HEADER,
    MODE_BINARY,
-   MODE_ZBOOT
+   MODE_ESP32,
+   MODE_ZBOOT,
+   MODE_MATERIALIZE,
+   MODE_SIZE,
+   MODE_INDEX,
+   MODE_LOOKUP,
+   MODE_SCAN,
+   MODE_RESTAMP,
+   MODE_PERSONALIZE,
+   MODE_IRAM,
+   MODE_DUPLICATES,
+   MODE_LAYOUT
 } eOperation;
 
-char **StringToList(char *string, char *separators, uint32_t *count)
+// Options with no short form
+enum
+{
+   OPTION_TRACE = 0x100,
+   OPTION_INDEX,
+   OPTION_LOOKUP,
+   OPTION_SCAN,
+   OPTION_RESTAMP,
+   OPTION_DATE,
+   OPTION_PERSONALIZE,
+   OPTION_SECTION,
+   OPTION_IRAM,
+   OPTION_IRAM_SIZE,
+   OPTION_DUPLICATES,
+   OPTION_ZBOOT2,
+   OPTION_LAYOUT,
+   OPTION_STABLE,
+   OPTION_SLACK,
+   OPTION_FILL_RUNS
+};
+
+static const struct option programOptions[] =
+{
+   { "trace",  required_argument, NULL, OPTION_TRACE },
+   { "index",  required_argument, NULL, OPTION_INDEX },
+   { "lookup", required_argument, NULL, OPTION_LOOKUP },
+   { "scan",   no_argument,       NULL, OPTION_SCAN },
+   { "restamp", no_argument,      NULL, OPTION_RESTAMP },
+   { "date",   required_argument, NULL, OPTION_DATE },
+   { "personalize", required_argument, NULL, OPTION_PERSONALIZE },
+   { "section", required_argument, NULL, OPTION_SECTION },
+   { "iram",   required_argument, NULL, OPTION_IRAM },
+   { "iram-size", required_argument, NULL, OPTION_IRAM_SIZE },
+   { "duplicates", required_argument, NULL, OPTION_DUPLICATES },
+   { "zboot2", no_argument,      NULL, OPTION_ZBOOT2 },
+   { "layout", required_argument, NULL, OPTION_LAYOUT },
+   { "stable", required_argument, NULL, OPTION_STABLE },
+   { "slack",  required_argument, NULL, OPTION_SLACK },
+   { "fill-runs", required_argument, NULL, OPTION_FILL_RUNS },
+   { NULL,     0,                 NULL, 0 }
+};
+
+typedef enum
+{
+   HEADER_TYPE_C,
+   HEADER_TYPE_OBJECT,
+   HEADER_TYPE_ASM
+} eHeaderType;
+
+char **StringToList(char *string, char *separators, uint32_t *count, tArena *arena)
 {
    char **result = NULL;
    char *current = string;
-   uint32_t c = 0;
+   uint32_t c = 1;
+
+   // There can be no more tokens than separators plus one
+   for(current = string; *current != '\0'; ++current)
+      if(NULL != strchr(separators, *current))
+         ++c;
+   result = (char **) ArenaAlloc(arena, c * sizeof(char *));
+   if(NULL == result)
+      return NULL;
 
+   c = 0;
    current = strtok(string, separators);
    while(NULL != current) 
    {
-      result = (char **) realloc(result, (c+1) * sizeof(char *));
-      if(NULL == result)
-         return NULL;
-
       result[c++] = current; 
       current = strtok(NULL, separators); 
    }
@@ -623,26 +873,206 @@ char **StringToList(char *string, char *separators, uint32_t *count)
    return result;
 }
 
+// Parse a flash size (-c); sizes the ESP8266 (or ESP32) doesn't support
+// are returned as FLASH_SIZE_UNSUPPORTED.
+// Produces error message on failure (so caller doesn't need to).
+static bool ParseFlashSize(const char *text, uint8_t *flashSize, uint8_t *esp32FlashSize)
+{
+   if(strcmp(text, "256") == 0
+   || strcmp(text, "256K") == 0) 
+      *flashSize = 1, *esp32FlashSize = FLASH_SIZE_UNSUPPORTED;
+   else if(strcmp(text, "512") == 0
+   || strcmp(text, "512K") == 0)
+      *flashSize = 0, *esp32FlashSize = FLASH_SIZE_UNSUPPORTED;
+   else if(strcmp(text, "1024") == 0
+   || strcmp(text, "1M") == 0)
+      *flashSize = 2, *esp32FlashSize = 0;
+   else if(strcmp(text, "2048") == 0
+   || strcmp(text, "2M") == 0)
+      *flashSize = 3, *esp32FlashSize = 1;
+   else if(strcmp(text, "4096") == 0
+   || strcmp(text, "4M") == 0)
+      *flashSize = 4, *esp32FlashSize = 2;
+   else if(strcmp(text, "8192") == 0
+   || strcmp(text, "8M") == 0)
+      *flashSize = FLASH_SIZE_UNSUPPORTED, *esp32FlashSize = 3;
+   else if(strcmp(text, "16384") == 0
+   || strcmp(text, "16M") == 0)
+      *flashSize = FLASH_SIZE_UNSUPPORTED, *esp32FlashSize = 4;
+   else
+   {
+      ERROR("Usupported flash size (%s)\n", text);
+      return false;
+   }
+   return true;
+}
+
+// Parse a flash mode (-m).
+// Produces error message on failure (so caller doesn't need to).
+static bool ParseFlashMode(const char *text, uint8_t *flashMode)
+{
+   if(strcmp(text, "qio") == 0)
+      *flashMode = 0;
+   else if(strcmp(text, "qout") == 0)
+      *flashMode = 1;
+   else if(strcmp(text, "dio") == 0)
+      *flashMode = 2;
+   else if(strcmp(text, "dout") == 0)
+      *flashMode = 3;
+   else
+   {
+      ERROR("Usupported flash mode (%s)\n", text);
+      return false;
+   }
+   return true;
+}
+
+// Parse a flash frequency (-f).
+// Produces error message on failure (so caller doesn't need to).
+static bool ParseFlashClock(const char *text, uint8_t *flashClock)
+{
+   if(strcmp(text, "20") == 0)
+      *flashClock = 2;
+   else if(strcmp(text, "26.7") == 0
+   || strcmp(text, "26") == 0)
+      *flashClock = 1;
+   else if(strcmp(text, "40") == 0)
+      *flashClock = 0;
+   else if(strcmp(text, "80") == 0)
+      *flashClock = 15;
+   else
+   {
+      ERROR("Usupported flash speed (%s)\n", text);
+      return false;
+   }
+   return true;
+}
+
+// Parse a --restamp date: now, keep, or a Unix time from 2000 on.
+// Produces error message on failure (so caller doesn't need to).
+static bool ParseRestampDate(const char *text, tRestamp *restamp)
+{
+   unsigned long date;
+   char *end;
+
+   restamp->setDate = true;
+   if(strcmp(text, "keep") == 0)
+   {
+      restamp->setDate = false;
+      return true;
+   }
+   if(strcmp(text, "now") == 0)
+   {
+      restamp->date = GetZbootTimestamp();
+      return true;
+   }
+
+   date = strtoul(text, &end, 0);
+   if(!isdigit((unsigned char) text[0]) || '\0' != *end || date < SECONDS_BETWEEN_1970_AND_2000
+      || date - SECONDS_BETWEEN_1970_AND_2000 > 0xffffffffUL)
+   {
+      ERROR("Invalid date (%s); use now, keep, or a Unix time from 2000 on\n", text);
+      return false;
+   }
+   restamp->date = (uint32_t) (date - SECONDS_BETWEEN_1970_AND_2000);
+   return true;
+}
+
+// Parse a list of flash configurations, "<mode>:<size>:<speed>,...".
+// Produces error message on failure (so caller doesn't need to).
+static tFlashVariant* ParseFlashVariants(char *text, uint32_t *count, tArena *arena)
+{
+   tFlashVariant *variants;
+   char **list;
+   uint32_t i;
+
+   list = StringToList(text, SEPARATOR_LIST, count, arena);
+   variants = (tFlashVariant *) ArenaAlloc(arena, (*count + 1) * sizeof(tFlashVariant));
+   if(NULL == list || NULL == variants || 0 == *count)
+      return NULL;
+
+   for(i = 0; i < *count; ++i)
+   {
+      char *mode = list[i];
+      char *size = strchr(mode, ':');
+      char *clock = (NULL != size) ? strchr(size + 1, ':') : NULL;
+      uint8_t esp32FlashSize;
+
+      if(NULL == clock)
+      {
+         ERROR("Flash configuration must be <mode>:<size>:<speed> (%s)\n", list[i]);
+         return NULL;
+      }
+      *size++ = '\0';
+      *clock++ = '\0';
+      if(!ParseFlashMode(mode, &variants[i].flashMode)
+      || !ParseFlashSize(size, &variants[i].flashSize, &esp32FlashSize)
+      || !ParseFlashClock(clock, &variants[i].flashClock))
+         return NULL;
+      if(FLASH_SIZE_UNSUPPORTED == variants[i].flashSize)
+      {
+         ERROR("Flash size not supported by the ESP8266 (%s)\n", size);
+         return NULL;
+      }
+      variants[i].name = (char *) ArenaAlloc(arena, strlen(mode) + strlen(size) + strlen(clock) + 3);
+      if(NULL == variants[i].name)
+         return NULL;
+      sprintf(variants[i].name, "%s-%s-%s", mode, size, clock);
+   }
+   return variants;
+}
+
 int main(int argc, char *argv[])
 {
+   tArena *arena = NULL;
    char *inFile = NULL;
    char *outFile = NULL;
+   char *prevFile = NULL;
+   char *storeDir = NULL;
+   char *indexFile = NULL;
+   tRestamp restamp = { false, 0, true, 0, NULL };
+   char *recordFile = NULL;
+   char *deviceSection = NULL;
+   char *sampleFile = NULL;
+   uint32_t iramSize = IRAM_SIZE_DEFAULT;
+   uint32_t minDuplicate = 0;
+   bool depend = false;
+   char *dependFile = NULL;
+   tFlashVariant *variants = NULL;
+   uint32_t variantCount = 0;
+   tHexOutput hexFormat = { HEX_FORMAT_NONE, 0 };
+   tHexOutput *hexOutput = NULL;
+   uint32_t threads = 0;
    char **romSections = NULL;
    uint32_t romSectionCount = 0;
    char **otherSections = NULL;
    uint32_t otherSectionCount = 0;
    uint32_t buildVersion = ZBOOT_DEFAULT_BUILD_VERSION;
+   uint32_t romAlign = 0;
+   uint32_t fillRuns = 0;
+   uint32_t zbootLayout = ZBOOT_LAYOUT_V1;
+   char *layoutName = NULL;
+   char *stableFile = NULL;
+   uint32_t slack = STABLE_SLACK_DEFAULT;
    char *buildDescription = NULL;
    eOperation operation = MODE_INVALID; 
+   eHeaderType headerType = HEADER_TYPE_C;
    bool paramError = false;
    bool displayHelp = false;
    uint8_t flashMode = 0;
    uint8_t flashSize = 0;
+   uint8_t esp32FlashSize = 0;
    uint8_t flashClock = 0;
    int result = -1;
    int opt;
 
-   while ((opt = getopt(argc, argv, "blihz?d:f:c:v:n:m:e:o:r:s:")) != -1)
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return -1;
+   restamp.date = GetZbootTimestamp();  // --date now
+
+   while ((opt = getopt_long(argc, argv, "bxlihzua?d:f:c:v:n:m:e:o:p:r:s:t:A:k:j:O:B:V:M:",
+      programOptions, NULL)) != -1)
    {
       switch (opt)
       {
@@ -655,10 +1085,18 @@ int main(int argc, char *argv[])
             break;
          case 'o':   // Output file
             outFile = optarg;
+            if(0 == strcmp(outFile, "-"))
+               debug_stderr = true;  // keep messages out of the output data
+            break;
+         case 'p':   // Previous (ELF) file
+            prevFile = optarg;
             break;
          case 'b':   // binary file
             operation = MODE_BINARY; 
             break;
+         case 'x':   // ESP32 binary file
+            operation = MODE_ESP32; 
+            break;
          case 'i':   // header (include) file
             operation = MODE_HEADER; 
             break;
@@ -668,82 +1106,196 @@ int main(int argc, char *argv[])
          case 'z':   // zboot file
             operation = MODE_ZBOOT; 
             break;
+         case OPTION_ZBOOT2:   // indexed zboot file
+            zbootLayout = ZBOOT_LAYOUT_V2;
+            if(MODE_INVALID == operation)
+               operation = MODE_ZBOOT;
+            break;
+         case OPTION_LAYOUT:   // image described by a layout spec
+            operation = MODE_LAYOUT;
+            layoutName = optarg;
+            break;
+         case OPTION_STABLE:   // keep section offsets from the previous build
+            stableFile = optarg;
+            break;
+         case OPTION_SLACK:   // room to grow, for stable layouts
+            slack = strtoul(optarg, NULL, 0);
+            break;
+         case OPTION_FILL_RUNS:   // fill records for runs of one byte value
+            fillRuns = strtoul(optarg, NULL, 0);
+            if(fillRuns < ZBOOT_FILL_MIN)
+            {
+               ERROR("Fill runs must be at least %u bytes (%s)\n", ZBOOT_FILL_MIN, optarg);
+               paramError = true;
+            }
+            break;
+         case 'u':   // materialize recipe
+            operation = MODE_MATERIALIZE; 
+            break;
+         case 'k':   // content-addressed store
+            storeDir = optarg;
+            break;
+         case 'a':   // size report
+            operation = MODE_SIZE; 
+            break;
          case 'd':   // debug level 
             debug_level = atoi(optarg); 
             break;
+         case OPTION_INDEX:   // provenance index
+            operation = MODE_INDEX;
+            indexFile = optarg;
+            break;
+         case OPTION_LOOKUP:   // provenance lookup
+            operation = MODE_LOOKUP;
+            indexFile = optarg;
+            break;
+         case OPTION_RESTAMP:   // restamp zboot images
+            operation = MODE_RESTAMP;
+            break;
+         case OPTION_DATE:   // restamp date
+            if(!ParseRestampDate(optarg, &restamp))
+               paramError = true;
+            break;
+         case OPTION_PERSONALIZE:   // per-device images
+            operation = MODE_PERSONALIZE;
+            recordFile = optarg;
+            break;
+         case OPTION_SECTION:   // per-device section
+            deviceSection = optarg;
+            break;
+         case OPTION_IRAM:   // IRAM placement advice
+            operation = MODE_IRAM;
+            sampleFile = optarg;
+            break;
+         case OPTION_IRAM_SIZE:   // IRAM budget
+            iramSize = strtoul(optarg, NULL, 0);
+            break;
+         case OPTION_DUPLICATES:   // duplicate data report
+            operation = MODE_DUPLICATES;
+            minDuplicate = strtoul(optarg, NULL, 0);
+            break;
+         case OPTION_SCAN:   // flash dump scan
+            operation = MODE_SCAN;
+            break;
+         case 'O':   // output format
+            if(strcmp(optarg, "bin") == 0)
+               hexFormat.format = HEX_FORMAT_NONE;
+            else if(strcmp(optarg, "ihex") == 0 || strcmp(optarg, "hex") == 0)
+               hexFormat.format = HEX_FORMAT_IHEX;
+            else if(strcmp(optarg, "srec") == 0)
+               hexFormat.format = HEX_FORMAT_SREC;
+            else
+            {
+               ERROR("Usupported output format (%s)\n", optarg);
+               paramError = true;
+            }
+            break;
+         case 'B':   // flash base address for hex output
+            hexFormat.base = strtoul(optarg, NULL, 0);
+            break;
+         case 'j':   // worker threads
+            threads = strtoul(optarg, NULL, 0);
+            break;
+         case 'M':   // dependency file: -MD, -MF <file> (or -MF<file>)
+            depend = true;
+            if('F' == optarg[0] && '\0' != optarg[1])
+               dependFile = optarg + 1;
+            else if('F' == optarg[0] && optind < argc)
+               dependFile = argv[optind++];
+            else if(0 != strcmp(optarg, "D"))
+               paramError = true;
+            break;
+         case OPTION_TRACE:   // timeline trace
+            if(!TraceStart(optarg))
+               paramError = true;
+            break;
          case 'r':   // ROM section list
-            romSections = StringToList(optarg, SEPARATOR_LIST, &romSectionCount);
+            romSections = StringToList(optarg, SEPARATOR_LIST, &romSectionCount, arena);
             break;
          case 's':   // non-ROM section list
-            otherSections = StringToList(optarg, SEPARATOR_LIST, &otherSectionCount);
+            otherSections = StringToList(optarg, SEPARATOR_LIST, &otherSectionCount, arena);
             break;
          case 'v':   // build version 
             buildVersion = strtoul(optarg, NULL, 16);
+            restamp.setVersion = true;
+            break;
+         case 'A':   // ROM alignment
+            romAlign = strtoul(optarg, NULL, 0);
+            if(0 != romAlign % SECTION_PADDING)
+            {
+               ERROR("ROM alignment must be a multiple of %u (%s)\n", SECTION_PADDING, optarg);
+               paramError = true;
+            }
             break;
          case 'n':   // build description 
             buildDescription = optarg; 
             break;
          case 'c':   // flash (capacity) size
-            if(strcmp(optarg, "256") == 0
-            || strcmp(optarg, "256K") == 0) 
-               flashSize = 1;
-            else if(strcmp(optarg, "512") == 0
-            || strcmp(optarg, "512K") == 0)
-               flashSize = 0;
-            else if(strcmp(optarg, "1024") == 0
-            || strcmp(optarg, "1M") == 0)
-               flashSize = 2;
-            else if(strcmp(optarg, "2048") == 0
-            || strcmp(optarg, "2M") == 0)
-               flashSize = 3;
-            else if(strcmp(optarg, "4096") == 0
-            || strcmp(optarg, "4M") == 0)
-               flashSize = 4;
+            if(!ParseFlashSize(optarg, &flashSize, &esp32FlashSize))
+               paramError = true;
+            break;
+         case 't':   // header output type
+            if(strcmp(optarg, "c") == 0)
+               headerType = HEADER_TYPE_C;
+            else if(strcmp(optarg, "obj") == 0)
+               headerType = HEADER_TYPE_OBJECT;
+            else if(strcmp(optarg, "asm") == 0)
+               headerType = HEADER_TYPE_ASM;
             else
             {
-               error("Usupported flash size (%s)\n", optarg);
+               ERROR("Usupported header type (%s)\n", optarg);
                paramError = true;
             }
             break;
          case 'm':   // flash mode
-            if(strcmp(optarg, "qio") == 0)
-               flashMode = 0;
-            else if(strcmp(optarg, "qout") == 0)
-               flashMode = 1;
-            else if(strcmp(optarg, "dio") == 0)
-               flashMode = 2;
-            else if(strcmp(optarg, "dout") == 0)
-               flashMode = 3;
-            else
-            {
-               error("Usupported flash mode (%s)\n", optarg);
+            if(!ParseFlashMode(optarg, &flashMode))
                paramError = true;
-            }
             break;
          case 'f':   // flash frequency (speed) 
-            if(strcmp(optarg, "20") == 0)
-               flashClock = 2;
-            else if(strcmp(optarg, "26.7") == 0
-            || strcmp(optarg, "26") == 0)
-               flashClock = 1;
-            else if(strcmp(optarg, "40") == 0)
-               flashClock = 0;
-            else if(strcmp(optarg, "80") == 0)
-               flashClock = 15;
-            else
-            {
-               error("Usupported flash speed (%s)\n", optarg);
+            if(!ParseFlashClock(optarg, &flashClock))
+               paramError = true;
+            break;
+         case 'V':   // flash configuration variants
+            variants = ParseFlashVariants(optarg, &variantCount, arena);
+            if(NULL == variants)
                paramError = true;
-            }
             break;
          default:
-            error("Usupported option (%c)\n", opt);
+            ERROR("Usupported option (%c)\n", opt);
             paramError = true;
             break;
       }
    }
 
+   if(HEX_FORMAT_NONE != hexFormat.format)
+   {
+      hexOutput = &hexFormat;
+      if(NULL != storeDir && MODE_MATERIALIZE != operation)
+      {
+         ERROR("Hex output can't be combined with a store (-k)\n");
+         paramError = true;
+      }
+   }
+
+   if(NULL != stableFile && MODE_ZBOOT != operation && MODE_LAYOUT != operation
+      && MODE_PERSONALIZE != operation)
+   {
+      ERROR("A stable layout (--stable) applies to -z, --zboot2, --layout and --personalize\n");
+      paramError = true;
+   }
+   if(0 != fillRuns && MODE_ZBOOT != operation && MODE_LAYOUT != operation)
+   {
+      ERROR("Fill records (--fill-runs) apply to -z and --layout\n");
+      paramError = true;
+   }
+
+   if(NULL == outFile && (MODE_SCAN == operation || MODE_LOOKUP == operation
+      || MODE_SIZE == operation || MODE_IRAM == operation || MODE_DUPLICATES == operation))
+      debug_stderr = true;  // the report goes to standard output
+
    PRINT("%s\n", programInfo);
+   if(!paramError && depend && !DependStart(dependFile))
+      paramError = true;
    if(paramError)
    {
       ERROR("Parameter error\n");
@@ -753,9 +1305,11 @@ int main(int argc, char *argv[])
    if(displayHelp)
    {
       PRINT("%s\n", programUsage);
+      ArenaRelease(arena);
       return -1;
    }
 
+   TRACE_BEGIN("run");
    switch(operation)
    {
       case MODE_LIBRARY:
@@ -763,7 +1317,7 @@ int main(int argc, char *argv[])
          {
             ERROR("Must specify input and output files\n");
          }
-         else if (!ExportElfSection(inFile, outFile, ".irom0.text"))
+         else if (!ExportElfSection(inFile, outFile, ".irom0.text", hexOutput))
          {
             ERROR("Failed to create library file\n");
          }
@@ -778,7 +1332,18 @@ int main(int argc, char *argv[])
          {
             ERROR("Must specify input and output files\n");
          }
-         else if (!CreateHeaderFile(inFile, outFile, otherSections, otherSectionCount))
+         else if (HEADER_TYPE_OBJECT == headerType
+            && !CreateObjectFile(inFile, outFile, otherSections, otherSectionCount))
+         {
+            ERROR("Failed to create object file\n");
+         }
+         else if (HEADER_TYPE_ASM == headerType
+            && !CreateAsmFile(inFile, outFile, otherSections, otherSectionCount))
+         {
+            ERROR("Failed to create assembler file\n");
+         }
+         else if (HEADER_TYPE_C == headerType
+            && !CreateHeaderFile(inFile, outFile, otherSections, otherSectionCount))
          {
             ERROR("Failed to create header file\n");
          }
@@ -793,8 +1358,48 @@ int main(int argc, char *argv[])
          {
             ERROR("Must specify input and output files\n");
          }
+         else if(NULL != variants)
+         {
+            if(NULL != storeDir || NULL != hexOutput || 0 == strcmp(outFile, "-"))
+            {
+               ERROR("Flash variants (-V) are written to files, in binary\n");
+            }
+            else if (!CreateBinVariants(inFile, outFile, variants, variantCount,
+               romSections, romSectionCount, otherSections, otherSectionCount))
+            {
+               ERROR("Failed to create binary files\n");
+            }
+            else
+            {
+               result = 0;
+            }
+         }
+         else if(FLASH_SIZE_UNSUPPORTED == flashSize)
+         {
+            ERROR("Flash size not supported by the ESP8266\n");
+         }
          else if (!CreateBinFile(inFile, outFile, flashMode, flashClock, flashSize,
-            romSections, romSectionCount, otherSections, otherSectionCount))
+            romSections, romSectionCount, otherSections, otherSectionCount, storeDir, hexOutput))
+         {
+            ERROR("Failed to create binary file\n");
+         }
+         else
+         {
+            PRINT("Successfully created binary file '%s'\r\n", outFile);
+            result = 0;
+         }
+         break;
+      case MODE_ESP32:
+         if(NULL == inFile || NULL == outFile)
+         {
+            ERROR("Must specify input and output files\n");
+         }
+         else if(FLASH_SIZE_UNSUPPORTED == esp32FlashSize)
+         {
+            ERROR("Flash size not supported by the ESP32\n");
+         }
+         else if (!CreateEsp32File(inFile, outFile, flashMode, flashClock, esp32FlashSize,
+            romSections, romSectionCount, otherSections, otherSectionCount, hexOutput))
          {
             ERROR("Failed to create binary file\n");
          }
@@ -810,7 +1415,8 @@ int main(int argc, char *argv[])
             ERROR("Must specify input and output files\n");
          }
          else if (!CreateZbootFile(inFile, outFile, buildVersion, GetZbootTimestamp(),
-            buildDescription, romSections, romSectionCount, otherSections, otherSectionCount))
+            buildDescription, romAlign, fillRuns, romSections, romSectionCount, otherSections,
+            otherSectionCount, storeDir, hexOutput, zbootLayout, stableFile, slack))
          {
             ERROR("Failed to create binary file\n");
          }
@@ -820,10 +1426,185 @@ int main(int argc, char *argv[])
             result = 0;
          }
          break;
+      case MODE_LAYOUT:
+         if(NULL == inFile || NULL == outFile)
+         {
+            ERROR("Must specify input and output files\n");
+         }
+         else
+         {
+            tLayoutValues values;
+            memset(&values, 0, sizeof(values));
+            values.flashMode = flashMode;
+            values.flashConfig = (flashSize << 4) | (flashClock & 0xf);
+            values.version = buildVersion;
+            values.date = GetZbootTimestamp();
+            values.description = (NULL != buildDescription) ? buildDescription : ZBOOT_DEFAULT_BUILD_DESCRIPTION;
+            values.romAlign = romAlign;
+            values.fillRuns = fillRuns;
+            if(!CreateLayoutFile(inFile, outFile, layoutName, &values, romSections, romSectionCount,
+               otherSections, otherSectionCount, storeDir, hexOutput, stableFile, slack))
+            {
+               ERROR("Failed to create binary file\n");
+            }
+            else
+            {
+               PRINT("Successfully created binary file '%s'\r\n", outFile);
+               result = 0;
+            }
+         }
+         break;
+      case MODE_MATERIALIZE:
+         if(NULL == inFile || NULL == outFile || NULL == storeDir)
+         {
+            ERROR("Must specify recipe, store and output\n");
+         }
+         else if (!MaterializeRecipe(inFile, storeDir, outFile))
+         {
+            ERROR("Failed to materialize image\n");
+         }
+         else
+         {
+            PRINT("Successfully created binary file '%s'\r\n", outFile);
+            result = 0;
+         }
+         break;
+      case MODE_SIZE:
+         if(NULL == inFile)
+         {
+            ERROR("Must specify input file\n");
+         }
+         else if (!CreateSizeReport(inFile, prevFile, outFile, romSections, romSectionCount,
+            otherSections, otherSectionCount))
+         {
+            ERROR("Failed to create size report\n");
+         }
+         else
+         {
+            result = 0;
+         }
+         break;
+      case MODE_IRAM:
+         if(NULL == inFile)
+         {
+            ERROR("Must specify input file\n");
+         }
+         else if (!CreateIramAdvice(inFile, sampleFile, outFile, iramSize, romSections, romSectionCount,
+            otherSections, otherSectionCount))
+         {
+            ERROR("Failed to create IRAM placement\n");
+         }
+         else
+         {
+            result = 0;
+         }
+         break;
+      case MODE_DUPLICATES:
+         if(NULL == inFile)
+         {
+            ERROR("Must specify input file\n");
+         }
+         else if (!CreateDuplicateReport(inFile, outFile, minDuplicate, romSections, romSectionCount,
+            otherSections, otherSectionCount))
+         {
+            ERROR("Failed to create duplicate data report\n");
+         }
+         else
+         {
+            result = 0;
+         }
+         break;
+      case MODE_INDEX:
+         if(optind >= argc)
+         {
+            ERROR("Must specify ELF files or directories to index\n");
+         }
+         else if (!IndexElfFiles(indexFile, &argv[optind], argc - optind, threads))
+         {
+            ERROR("Failed to update index\n");
+         }
+         else
+         {
+            result = 0;
+         }
+         break;
+      case MODE_LOOKUP:
+         if(NULL == inFile)
+         {
+            ERROR("Must specify image file\n");
+         }
+         else if (LookupImage(indexFile, inFile, outFile))
+         {
+            result = 0;
+         }
+         break;
+      case MODE_SCAN:
+         if(NULL == inFile && optind >= argc)
+         {
+            ERROR("Must specify flash dump files\n");
+         }
+         else
+         {
+            uint32_t dumpCount = argc - optind;
+            char **dumpFiles = &argv[optind];
+            if(NULL != inFile)
+            {
+               dumpFiles = (char **) ArenaAlloc(arena, (dumpCount + 1) * sizeof(char *));
+               if(NULL != dumpFiles)
+               {
+                  memcpy(&dumpFiles[1], &argv[optind], dumpCount * sizeof(char *));
+                  dumpFiles[0] = inFile;
+                  ++dumpCount;
+               }
+            }
+            if(NULL != dumpFiles && ScanFlashDumps(dumpFiles, dumpCount, outFile))
+               result = 0;
+         }
+         break;
+      case MODE_PERSONALIZE:
+      {
+         char templateFile[1024];
+         if(NULL == inFile || NULL == outFile || NULL == deviceSection)
+         {
+            ERROR("Must specify input file, output name and per-device section\n");
+         }
+         else if(!DeviceFileName(templateFile, sizeof(templateFile), outFile, "template"))
+         {
+            ERROR("Output name '%s' must contain %s for the device name\n", outFile, PERSONALIZE_NAME_TOKEN);
+         }
+         else if (!CreateZbootFile(inFile, templateFile, buildVersion, GetZbootTimestamp(),
+            buildDescription, romAlign, 0, romSections, romSectionCount, otherSections,
+            otherSectionCount, NULL, NULL, zbootLayout, stableFile, slack))
+         {
+            ERROR("Failed to create template image\n");
+         }
+         else if (PersonalizeZbootImages(inFile, deviceSection, templateFile, recordFile, outFile, threads))
+         {
+            result = 0;
+         }
+         break;
+      }
+      case MODE_RESTAMP:
+         restamp.version = buildVersion;
+         restamp.description = buildDescription;
+         if(optind >= argc)
+         {
+            ERROR("Must specify zboot images to restamp\n");
+         }
+         else if (RestampZbootFiles(&argv[optind], argc - optind, &restamp))
+         {
+            result = 0;
+         }
+         break;
       default:
          ERROR("Unknown operation (%d)\n", operation);
-         return -1;
+         break;
    }
+   TRACE_END("run");
+
+   if(0 == result && !DependWrite())
+      result = -1;
 
+   ArenaRelease(arena);
    return result;
 }
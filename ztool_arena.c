@@ -0,0 +1,175 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_arena.h"
+
+static tArenaBlock* ArenaNewBlock(size_t size)
+{
+   tArenaBlock *block = (tArenaBlock *) malloc(sizeof(tArenaBlock) + size);
+   if(NULL == block)
+   {
+      ERROR("Error: Out of memory (%lu bytes)!\n", (unsigned long) size);
+      return NULL;
+   }
+   block->next = NULL;
+   block->size = size;
+   block->used = 0;
+   return block;
+}
+
+// Create an arena. blockSize of zero selects ARENA_DEFAULT_BLOCK_SIZE.
+// Returns NULL on failure; release with ArenaRelease.
+tArena* ArenaCreate(size_t blockSize)
+{
+   tArena *arena = (tArena *) malloc(sizeof(tArena));
+   if(NULL == arena)
+   {
+      ERROR("Error: Out of memory!\n");
+      return NULL;
+   }
+   arena->blockSize = (0 == blockSize) ? ARENA_DEFAULT_BLOCK_SIZE : blockSize;
+   arena->head = ArenaNewBlock(arena->blockSize);
+   if(NULL == arena->head)
+   {
+      free(arena);
+      return NULL;
+   }
+   return arena;
+}
+
+// Allocate memory (aligned to ARENA_ALIGNMENT) that lives until the arena is
+// released. Requests larger than half a block get a block of their own, which
+// is linked behind the current one so the current block keeps filling up.
+// Produces error message on failure (so caller doesn't need to).
+void* ArenaAlloc(tArena *arena, size_t size)
+{
+   tArenaBlock *block = arena->head;
+   size_t aligned = (size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+   void *result;
+
+   if(0 == aligned)
+      aligned = ARENA_ALIGNMENT;
+
+   if(aligned > arena->blockSize / 2)
+   {
+      block = ArenaNewBlock(aligned);
+      if(NULL == block)
+         return NULL;
+      block->used = aligned;
+      block->next = arena->head->next;
+      arena->head->next = block;
+      return block->data;
+   }
+
+   if(block->size - block->used < aligned)
+   {
+      block = ArenaNewBlock(arena->blockSize);
+      if(NULL == block)
+         return NULL;
+      block->next = arena->head;
+      arena->head = block;
+   }
+
+   result = &block->data[block->used];
+   block->used += aligned;
+   return result;
+}
+
+// As ArenaAlloc, with the memory cleared to zero
+void* ArenaCalloc(tArena *arena, size_t size)
+{
+   void *result = ArenaAlloc(arena, size);
+   if(NULL != result)
+      memset(result, 0, size);
+   return result;
+}
+
+// Free every allocation made from the arena, keeping the arena (and its
+// current block) for reuse. For scratch memory in loops.
+void ArenaReset(tArena *arena)
+{
+   tArenaBlock *block = arena->head->next;
+   while(NULL != block)
+   {
+      tArenaBlock *next = block->next;
+      free(block);
+      block = next;
+   }
+   arena->head->next = NULL;
+   arena->head->used = 0;
+}
+
+// Free every allocation made from the arena, and the arena itself
+void ArenaRelease(tArena *arena)
+{
+   if(NULL != arena)
+   {
+      tArenaBlock *block = arena->head;
+      while(NULL != block)
+      {
+         tArenaBlock *next = block->next;
+         free(block);
+         block = next;
+      }
+      free(arena);
+   }
+}
+
+// Read a whole (possibly non-seekable) stream into arena memory. The buffer
+// doubles as it fills, and is always larger than the data read, so callers
+// can terminate it. Returns NULL if the stream can't be read, or is too
+// large for a 32-bit size.
+// Does not produce any messages (other than running out of memory).
+uint8_t* ArenaReadStream(tArena *arena, FILE *stream, uint32_t *size)
+{
+   uint32_t capacity = ARENA_READ_CHUNK;
+   uint32_t length = 0;
+   uint8_t *buffer;
+   size_t count;
+
+   buffer = (uint8_t *) ArenaAlloc(arena, capacity);
+   while(NULL != buffer && (count = fread(buffer + length, 1, capacity - length, stream)) > 0)
+   {
+      length += (uint32_t) count;
+      if(length == capacity)
+      {
+         uint8_t *larger = NULL;
+         if(capacity <= 0xffffffffu / 2)  // the size must fit in 32 bits
+            larger = (uint8_t *) ArenaAlloc(arena, (size_t) capacity * 2);
+         if(NULL != larger)
+            memcpy(larger, buffer, length);
+         buffer = larger;
+         capacity *= 2;
+      }
+   }
+   if(NULL == buffer || ferror(stream))
+      return NULL;
+
+   *size = length;
+   return buffer;
+}
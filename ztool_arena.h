@@ -0,0 +1,59 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_ARENA_H
+#define ZTOOL_ARENA_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include "ztool.h"
+
+// A simple bump allocator. Every allocation made for a job (ELF metadata,
+// section data, symbol tables, lists) comes from one arena, and is released
+// with a single call to ArenaRelease.
+
+#define ARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT          8
+#define ARENA_READ_CHUNK         (1024 * 1024)  // first buffer size for ArenaReadStream
+
+typedef struct tArenaBlock
+{
+   struct tArenaBlock *next;
+   size_t              size;
+   size_t              used;
+   uint8_t             data[];
+} tArenaBlock;
+
+typedef struct
+{
+   tArenaBlock *head;       // current block; allocations bump from here
+   size_t       blockSize;
+} tArena;
+
+tArena* ArenaCreate(size_t blockSize);
+void* ArenaAlloc(tArena *arena, size_t size);
+void* ArenaCalloc(tArena *arena, size_t size);
+void ArenaReset(tArena *arena);
+void ArenaRelease(tArena *arena);
+uint8_t* ArenaReadStream(tArena *arena, FILE *stream, uint32_t *size);
+
+#endif /* ZTOOL_ARENA_H */
@@ -0,0 +1,226 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_arena.h"
+#include "ztool_depend.h"
+#include "ztool_hash.h"
+#include "ztool_write.h"
+
+#define DEPEND_BUCKETS   4096
+#define DEPEND_PATH_SIZE 1024
+
+#ifdef WIN32
+static CRITICAL_SECTION dependLock;
+#define DEPEND_LOCK()   EnterCriticalSection(&dependLock)
+#define DEPEND_UNLOCK() LeaveCriticalSection(&dependLock)
+#else
+static pthread_mutex_t dependLock = PTHREAD_MUTEX_INITIALIZER;
+#define DEPEND_LOCK()   pthread_mutex_lock(&dependLock)
+#define DEPEND_UNLOCK() pthread_mutex_unlock(&dependLock)
+#endif
+
+typedef struct tDependFile
+{
+   struct tDependFile *chain;    // next in hash bucket
+   struct tDependFile *next;     // next in the order recorded
+   bool                output;
+   char                path[1];  // allocated to length
+} tDependFile;
+
+volatile uint8_t depend_enabled = false;
+static const char *dependPath = NULL;
+static tArena *dependArena = NULL;
+static tDependFile *dependBuckets[DEPEND_BUCKETS];
+static tDependFile *dependFirst = NULL;
+static tDependFile *dependLast = NULL;
+
+// --------------------------------------------------------------------------------
+// Helper Functions
+
+// Write a path escaped for make: spaces and '#' with a backslash, '$' doubled
+static void WriteDependPath(FILE *fd, const char *path)
+{
+   for(; '\0' != *path; ++path)
+   {
+      if(' ' == *path || '#' == *path)
+         fputc('\\', fd);
+      else if('$' == *path)
+         fputc('$', fd);
+      fputc(*path, fd);
+   }
+}
+
+// --------------------------------------------------------------------------------
+// Operations
+
+// Enable dependency recording. The dependency file is 'depFile', or if NULL,
+// the first output with ".d" appended.
+// Produces error message on failure (so caller doesn't need to).
+bool DependStart(const char *depFile)
+{
+#ifdef WIN32
+   InitializeCriticalSection(&dependLock);
+#endif
+   dependArena = ArenaCreate(0);
+   if(NULL == dependArena)
+      return false;
+   dependPath = depFile;
+   depend_enabled = true;
+   return true;
+}
+
+// Record a file read or written. Standard input and output ("-") aren't
+// files and are skipped; a file recorded more than once is kept once, as an
+// output if it was ever written. May be called from several threads.
+void DependAdd(const char *path, bool output)
+{
+   uint32_t bucket;
+   size_t length;
+   tDependFile *file;
+
+   if(0 == strcmp(path, "-"))
+      return;
+   length = strlen(path);
+   bucket = (uint32_t) Hash64(path, length, 0) % DEPEND_BUCKETS;
+
+   DEPEND_LOCK();
+   for(file = dependBuckets[bucket]; NULL != file; file = file->chain)
+   {
+      if(0 == strcmp(file->path, path))
+         break;
+   }
+   if(NULL == file)
+   {
+      file = (tDependFile *) ArenaAlloc(dependArena, sizeof(tDependFile) + length);
+      if(NULL != file)
+      {
+         memcpy(file->path, path, length + 1);
+         file->output = false;
+         file->next = NULL;
+         file->chain = dependBuckets[bucket];
+         dependBuckets[bucket] = file;
+         if(NULL == dependLast)
+            dependFirst = file;
+         else
+            dependLast->next = file;
+         dependLast = file;
+      }
+   }
+   if(NULL != file)
+      file->output |= output;
+   DEPEND_UNLOCK();
+}
+
+// Write the dependency file: all outputs as targets of one rule depending on
+// all inputs, plus an empty rule per input so that a deleted input doesn't
+// stop the build (as with gcc -MP). A file that is both read and written
+// (an index, a template image) is only listed as an output. The file is only
+// rewritten when its contents change; a dependency file that isn't a
+// regular file (/dev/null) is written directly.
+// Produces error message on failure (so caller doesn't need to).
+bool DependWrite(void)
+{
+   char path[DEPEND_PATH_SIZE];
+   char temp[DEPEND_PATH_SIZE + 32];
+   struct stat info;
+   tDependFile *file;
+   bool direct;
+   bool targets = false;
+   bool success;
+   FILE *fd;
+
+   if(!depend_enabled)
+      return true;
+   for(file = dependFirst; NULL != file && !file->output; file = file->next)
+      ;
+   if(NULL == file)
+   {
+      ERROR("No output files to list in the dependency file\n");
+      return false;
+   }
+   if(NULL != dependPath)
+      snprintf(path, sizeof(path), "%s", dependPath);
+   else
+      snprintf(path, sizeof(path), "%s.d", file->path);
+
+   snprintf(temp, sizeof(temp), "%s.%lu.tmp", path, (unsigned long) getpid());
+   direct = (0 == stat(path, &info) && !S_ISREG(info.st_mode));
+   fd = fopen(direct ? path : temp, "w");
+   if(NULL == fd)
+   {
+      ERROR("Failed to create dependency file '%s'\n", temp);
+      return false;
+   }
+   for(file = dependFirst; NULL != file; file = file->next)
+   {
+      if(!file->output)
+         continue;
+      if(targets)
+         fputs(" \\\n ", fd);
+      WriteDependPath(fd, file->path);
+      targets = true;
+   }
+   fputc(':', fd);
+   for(file = dependFirst; NULL != file; file = file->next)
+   {
+      if(file->output || 0 == strcmp(file->path, path))
+         continue;  // the dependency file itself may be in an indexed directory
+      fputs(" \\\n ", fd);
+      WriteDependPath(fd, file->path);
+   }
+   fputc('\n', fd);
+   for(file = dependFirst; NULL != file; file = file->next)
+   {
+      if(file->output || 0 == strcmp(file->path, path))
+         continue;
+      fputc('\n', fd);
+      WriteDependPath(fd, file->path);
+      fputs(":\n", fd);
+   }
+
+   success = !ferror(fd);
+   success = (0 == fclose(fd)) && success;
+   if(success && !direct)
+      success = ReplaceIfChanged(temp, path);
+   if(!success)
+   {
+      ERROR("Failed to write dependency file '%s'\n", path);
+      if(!direct)
+         remove(temp);
+   }
+   ArenaRelease(dependArena);
+   dependArena = NULL;
+   depend_enabled = false;
+   return success;
+}
@@ -0,0 +1,43 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_DEPEND_H
+#define ZTOOL_DEPEND_H
+
+#include "ztool.h"
+
+// Dependency file output, in the make format that ninja also reads. Files
+// are recorded as they are read (inputs) and written (outputs); at the end
+// of a successful run the outputs are written as targets depending on the
+// inputs. When no dependency file was requested, recording a file costs one
+// test of depend_enabled.
+
+extern volatile uint8_t depend_enabled;
+
+#define DEPEND_INPUT(path)  if(depend_enabled) DependAdd(path, false)
+#define DEPEND_OUTPUT(path) if(depend_enabled) DependAdd(path, true)
+
+bool DependStart(const char *depFile);
+void DependAdd(const char *path, bool output);
+bool DependWrite(void);
+
+#endif /* ZTOOL_DEPEND_H */
@@ -0,0 +1,461 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_arena.h"
+#include "ztool_duplicate.h"
+#include "ztool_elf.h"
+#include "ztool_hash.h"
+#include "ztool_trace.h"
+#include "ztool_write.h"
+
+// Content-defined chunking: a gear hash is rolled over the data and a chunk
+// ends where the hash bits selected by the mask are zero. Each byte shifts
+// the hash left by one, so bit n depends on the last n + 1 bytes only and
+// chunk boundaries resynchronize within DUPLICATE_WINDOW_BITS + mask bits
+// bytes of the start of a copy. Chunks average a quarter of the minimum
+// reported length, so every duplicate region of that length contains whole,
+// identical chunks in both copies.
+#define DUPLICATE_WINDOW_BITS 4
+#define DUPLICATE_MIN_CHUNK   4
+
+typedef struct
+{
+   MyElf_Section  *section;
+   uint8_t        *data;
+   uint32_t        index;    // ELF section index, for symbol lookup
+} tDupSection;
+
+typedef struct
+{
+   uint64_t  hash;
+   uint32_t  section;        // index into the section table, plus one (zero is empty)
+   uint32_t  offset;
+   uint32_t  length;
+} tDupChunk;
+
+typedef struct
+{
+   uint32_t  length;
+   uint32_t  section;        // copy (later in the image)
+   uint32_t  offset;
+   uint32_t  firstSection;   // first occurrence
+   uint32_t  firstOffset;
+} tDupRegion;
+
+typedef struct
+{
+   tDupSection    *sections;
+   uint32_t        sectionCount;
+   tDupChunk      *table;
+   uint32_t        tableMask;
+   tDupRegion     *regions;
+   uint32_t        regionCount;
+   uint32_t        regionCapacity;
+   uint64_t        gear[256];
+   uint64_t        boundaryMask;
+   uint32_t        minChunk;
+   uint32_t        maxChunk;
+   uint32_t        minLength;
+   tArena         *arena;
+} tDupAnalysis;
+
+// --------------------------------------------------------------------------------
+// Helper Functions
+
+// Fill the gear table with fixed pseudo-random values (splitmix64), so
+// chunking, and with it the report, is the same on every run
+static void InitGear(uint64_t gear[256])
+{
+   uint64_t state = 0x9e3779b97f4a7c15ULL;
+   uint32_t i;
+
+   for(i = 0; i < 256; ++i)
+   {
+      uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      gear[i] = z ^ (z >> 31);
+   }
+}
+
+// Length of the next chunk starting at 'data'
+static uint32_t NextChunk(tDupAnalysis *dup, const uint8_t *data, uint32_t size)
+{
+   uint32_t limit = (size < dup->maxChunk) ? size : dup->maxChunk;
+   uint64_t hash = 0;
+   uint32_t i;
+
+   if(limit <= dup->minChunk)
+      return limit;
+   // the hash has to cover a full window before the boundary test means anything
+   for(i = 0; i < dup->minChunk; ++i)
+      hash = (hash << 1) + dup->gear[data[i]];
+   for(; i < limit; ++i)
+   {
+      hash = (hash << 1) + dup->gear[data[i]];
+      if(0 == (hash & dup->boundaryMask))
+         return i + 1;
+   }
+   return limit;
+}
+
+// Find a chunk in the table, or the empty slot where it belongs
+static tDupChunk* FindChunk(tDupAnalysis *dup, uint64_t hash)
+{
+   uint32_t slot = (uint32_t) hash & dup->tableMask;
+
+   while(0 != dup->table[slot].section && dup->table[slot].hash != hash)
+      slot = (slot + 1) & dup->tableMask;
+   return &dup->table[slot];
+}
+
+static bool AddRegion(tDupAnalysis *dup, tDupRegion *region)
+{
+   if(dup->regionCount == dup->regionCapacity)
+   {
+      uint32_t capacity = dup->regionCapacity ? dup->regionCapacity * 2 : 256;
+      tDupRegion *regions = (tDupRegion *) ArenaAlloc(dup->arena, capacity * sizeof(tDupRegion));
+      if(NULL == regions)
+         return false;
+      if(dup->regionCount > 0)
+         memcpy(regions, dup->regions, dup->regionCount * sizeof(tDupRegion));
+      dup->regions = regions;
+      dup->regionCapacity = capacity;
+   }
+   dup->regions[dup->regionCount++] = *region;
+   return true;
+}
+
+// Grow a verified chunk match into the largest matching region. The copy
+// can't reach back before 'covered' (the end of the previous region in its
+// section) and, in the same section, the two copies must not overlap.
+static void ExtendMatch(tDupAnalysis *dup, tDupRegion *region, uint32_t covered)
+{
+   tDupSection *first = &dup->sections[region->firstSection];
+   tDupSection *copy = &dup->sections[region->section];
+   bool same = (first == copy);
+
+   while(region->firstOffset > 0 && region->offset > covered
+      && first->data[region->firstOffset - 1] == copy->data[region->offset - 1])
+   {
+      region->firstOffset--;
+      region->offset--;
+      region->length++;
+   }
+   while(region->firstOffset + region->length < first->section->size
+      && region->offset + region->length < copy->section->size
+      && (!same || region->firstOffset + region->length < region->offset)
+      && first->data[region->firstOffset + region->length] == copy->data[region->offset + region->length])
+   {
+      region->length++;
+   }
+}
+
+// A region whose copy overlaps its first occurrence (the same section data
+// read twice) is not a duplicate
+static bool RegionOverlaps(tDupAnalysis *dup, tDupRegion *region)
+{
+   if(dup->sections[region->firstSection].section != dup->sections[region->section].section)
+      return false;
+   return region->firstOffset < region->offset + region->length
+      && region->offset < region->firstOffset + region->length;
+}
+
+// Chunk one section, matching each chunk against the chunks seen so far.
+// Chunks of a single byte value (padding, zeroed tables) are left out; they
+// would report every run of zeros as a copy of the first.
+static bool ScanSection(tDupAnalysis *dup, uint32_t index)
+{
+   tDupSection *section = &dup->sections[index];
+   uint32_t size = section->section->size;
+   uint32_t covered = 0;
+   uint32_t offset = 0;
+
+   while(offset < size)
+   {
+      uint32_t length = NextChunk(dup, section->data + offset, size - offset);
+      uint64_t hash;
+      tDupChunk *chunk;
+
+      if(0 == memcmp(section->data + offset, section->data + offset + 1, length - 1))
+      {
+         offset += length;
+         continue;
+      }
+      hash = Hash64(section->data + offset, length, length);
+      chunk = FindChunk(dup, hash);
+      if(0 == chunk->section)
+      {
+         chunk->hash = hash;
+         chunk->section = index + 1;
+         chunk->offset = offset;
+         chunk->length = length;
+      }
+      else if(offset >= covered && chunk->length == length
+         && (chunk->section - 1 != index || chunk->offset + length <= offset)
+         && 0 == memcmp(dup->sections[chunk->section - 1].data + chunk->offset, section->data + offset, length))
+      {
+         tDupRegion region;
+         region.length = length;
+         region.section = index;
+         region.offset = offset;
+         region.firstSection = chunk->section - 1;
+         region.firstOffset = chunk->offset;
+         ExtendMatch(dup, &region, covered);
+         if(region.length >= dup->minLength && !RegionOverlaps(dup, &region))
+         {
+            if(!AddRegion(dup, &region))
+               return false;
+            covered = region.offset + region.length;
+         }
+      }
+      offset += length;
+   }
+   return true;
+}
+
+static int CompareRegionBySize(const void *a, const void *b)
+{
+   const tDupRegion *ra = (const tDupRegion *) a;
+   const tDupRegion *rb = (const tDupRegion *) b;
+   if(ra->length != rb->length)
+      return (ra->length > rb->length) ? -1 : 1;
+   if(ra->section != rb->section)
+      return (ra->section < rb->section) ? -1 : 1;
+   return (ra->offset < rb->offset) ? -1 : (ra->offset > rb->offset);
+}
+
+// Sort by section index, then by address, largest symbol first for aliases
+static int CompareSymbolByAddress(const void *a, const void *b)
+{
+   const MyElf_Symbol *sa = *(const MyElf_Symbol **) a;
+   const MyElf_Symbol *sb = *(const MyElf_Symbol **) b;
+   if(sa->shndx != sb->shndx)
+      return (sa->shndx < sb->shndx) ? -1 : 1;
+   if(sa->value != sb->value)
+      return (sa->value < sb->value) ? -1 : 1;
+   if(sa->size != sb->size)
+      return (sa->size > sb->size) ? -1 : 1;
+   return 0;
+}
+
+// Print the symbol owning an address, as symbol+offset
+static void PrintOwner(FILE *out, MyElf_Symbol **sorted, uint32_t count, tDupSection *section, uint32_t offset)
+{
+   uint32_t address = section->section->address + offset;
+   uint32_t lo = 0, hi = count;
+
+   while(lo < hi)
+   {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if(sorted[mid]->shndx < section->index
+      || (sorted[mid]->shndx == section->index && sorted[mid]->value <= address))
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   // the last symbol starting at or before the address, or an alias of it
+   while(lo > 0 && sorted[lo - 1]->shndx == section->index)
+   {
+      MyElf_Symbol *sym = sorted[--lo];
+      if(address - sym->value < sym->size)
+      {
+         if(address == sym->value)
+            fprintf(out, "%s", sym->name);
+         else
+            fprintf(out, "%s+0x%x", sym->name, address - sym->value);
+         return;
+      }
+      if(lo > 0 && sorted[lo - 1]->value + sorted[lo - 1]->size <= sym->value)
+         break;
+   }
+   fprintf(out, "(%s+0x%x)", section->section->name, offset);
+}
+
+// --------------------------------------------------------------------------------
+// Operations
+
+// Report data that appears more than once in the selected sections of an ELF
+// file: regions of at least minLength bytes, largest first, with the symbols
+// that own both copies, and the bytes that removing the copies would save.
+// Sections are content-defined chunked and the chunks matched by hash, so
+// the time taken is linear in the size of the sections.
+// Report goes to outFile, or stdout if NULL.
+// Produces error message on failure (so caller doesn't need to).
+bool CreateDuplicateReport(char *inFile, char *outFile, uint32_t minLength,
+   char *romSectionList[], uint32_t romSectionCount,
+   char *otherSectionList[], uint32_t otherSectionCount)
+{
+   tDupAnalysis dup;
+   MyElf_File *elf = NULL;
+   MyElf_Symbol **sorted = NULL;
+   uint32_t sortedCount = 0;
+   uint32_t total = romSectionCount + otherSectionCount;
+   uint64_t dataSize = 0;
+   uint64_t reclaimable = 0;
+   uint32_t tableSize = 1024;
+   uint32_t average = 1;
+   tWriter writer;
+   FILE *out = stdout;
+   uint32_t i;
+   bool success = true; // optimism
+
+   if(minLength < 2 * DUPLICATE_MIN_CHUNK)
+   {
+      ERROR("Minimum duplicate length must be at least %u bytes\n", 2 * DUPLICATE_MIN_CHUNK);
+      return false;
+   }
+
+   memset(&dup, 0, sizeof(dup));
+   dup.minLength = minLength;
+   while(average * 2 <= minLength / 4)
+      average *= 2;
+   dup.boundaryMask = (uint64_t) (average - 1) << DUPLICATE_WINDOW_BITS;
+   dup.minChunk = (average / 2 > DUPLICATE_MIN_CHUNK) ? average / 2 : DUPLICATE_MIN_CHUNK;
+   dup.maxChunk = minLength / 2;
+   InitGear(dup.gear);
+
+   dup.arena = ArenaCreate(0);
+   if(NULL == dup.arena)
+      return false;
+
+   elf = LoadElf(inFile, dup.arena);
+   if(NULL == elf)
+   {
+      ERROR("Failed to open ELF file '%s'\n", inFile);
+      success = false;
+   }
+   else
+   {
+      dup.sections = (tDupSection *) ArenaCalloc(dup.arena, (total + 1) * sizeof(tDupSection));
+      success = (NULL != dup.sections);
+   }
+
+   // Read the sections (symbols are optional, they only name the copies)
+   for(i = 0; success && i < total; ++i)
+   {
+      char *name = (i < romSectionCount) ? romSectionList[i] : otherSectionList[i - romSectionCount];
+      MyElf_Section *section = GetElfSection(elf, name);
+      tDupSection *entry = &dup.sections[dup.sectionCount];
+      uint32_t j;
+
+      if(NULL == section)
+      {
+         ERROR("Warning: Section '%s' not found in elf file.\n", name);
+         continue;
+      }
+      if(SHT_NOBITS == section->type || 0 == section->size)
+         continue;
+      for(j = 0; j < dup.sectionCount && dup.sections[j].section != section; ++j)
+         ;
+      if(j < dup.sectionCount)
+      {
+         ERROR("Warning: Section '%s' is listed more than once; scanned once\n", name);
+         continue;
+      }
+      entry->section = section;
+      entry->index = (uint32_t) (section - elf->sections) + 1;
+      entry->data = GetElfSectionData(elf, section, 0);
+      success = (NULL != entry->data);
+      dataSize += section->size;
+      dup.sectionCount++;
+   }
+
+   if(success)
+   {
+      // at most one chunk per minChunk bytes; keep the table at most half full
+      while(tableSize < 2 * (dataSize / dup.minChunk + dup.sectionCount))
+         tableSize *= 2;
+      dup.tableMask = tableSize - 1;
+      dup.table = (tDupChunk *) ArenaCalloc(dup.arena, tableSize * sizeof(tDupChunk));
+      if(NULL == dup.table)
+      {
+         ERROR("Failed to allocate memory for chunk table\n");
+         success = false;
+      }
+   }
+
+   TRACE_BEGIN("chunk");
+   for(i = 0; success && i < dup.sectionCount; ++i)
+   {
+      success = ScanSection(&dup, i);
+      if(!success)
+         ERROR("Failed to allocate memory for duplicate regions\n");
+   }
+   TRACE_END("chunk");
+
+   if(success && dup.regionCount > 0 && LoadElfSymbols(elf))
+   {
+      sorted = (MyElf_Symbol **) ArenaAlloc(dup.arena, (elf->symbolCount + 1) * sizeof(MyElf_Symbol *));
+      for(i = 0; NULL != sorted && i < elf->symbolCount; ++i)
+      {
+         MyElf_Symbol *sym = &elf->symbols[i];
+         if(sym->size > 0 && sym->shndx != SHN_UNDEF && sym->shndx < SHN_LORESERVE
+         && sym->type != STT_SECTION && sym->type != STT_FILE)
+            sorted[sortedCount++] = sym;
+      }
+      if(NULL != sorted)
+         qsort(sorted, sortedCount, sizeof(MyElf_Symbol *), CompareSymbolByAddress);
+   }
+
+   if(success)
+   {
+      WriterInit(&writer, NULL);
+      if(NULL != outFile)
+      {
+         success = WriterOpen(&writer, outFile, false);
+         out = writer.fd;
+      }
+   }
+
+   if(success)
+   {
+      qsort(dup.regions, dup.regionCount, sizeof(tDupRegion), CompareRegionBySize);
+      fprintf(out, "Duplicate data of at least %u bytes in %llu bytes of %u section(s):\n",
+         minLength, (unsigned long long) dataSize, dup.sectionCount);
+      for(i = 0; i < dup.regionCount; ++i)
+      {
+         tDupRegion *region = &dup.regions[i];
+         tDupSection *copy = &dup.sections[region->section];
+         tDupSection *first = &dup.sections[region->firstSection];
+
+         fprintf(out, "  %10u  0x%08x ", region->length, copy->section->address + region->offset);
+         PrintOwner(out, sorted, sortedCount, copy, region->offset);
+         fprintf(out, " duplicates 0x%08x ", first->section->address + region->firstOffset);
+         PrintOwner(out, sorted, sortedCount, first, region->firstOffset);
+         fprintf(out, "\n");
+         reclaimable += region->length;
+      }
+      fprintf(out, "Reclaimable: %llu bytes in %u region(s)\n", (unsigned long long) reclaimable,
+         dup.regionCount);
+      success = WriterClose(&writer);
+   }
+
+   UnloadElf(elf);
+   ArenaRelease(dup.arena);
+   return success;
+}
@@ -0,0 +1,32 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_DUPLICATE_H
+#define ZTOOL_DUPLICATE_H
+
+#include "ztool.h"
+
+bool CreateDuplicateReport(char *inFile, char *outFile, uint32_t minLength,
+   char *romSectionList[], uint32_t romSectionCount,
+   char *otherSectionList[], uint32_t otherSectionCount);
+
+#endif /* ZTOOL_DUPLICATE_H */
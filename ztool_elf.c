@@ -22,10 +22,258 @@
 
 #include <stdlib.h>
 #include <string.h>
+#ifdef WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 #include "debug.h"
 #include "ztool.h"
+#include "ztool_depend.h"
 #include "ztool_elf.h"
+#include "ztool_trace.h"
+#ifdef ZTOOL_ZLIB
+#include <zlib.h>
+#endif
+#ifdef ZTOOL_ZSTD
+#include <zstd.h>
+#endif
+
+#define GZIP_MAGIC "\x1f\x8b"
+#define ZSTD_MAGIC "\x28\xb5\x2f\xfd"
+#define DECOMPRESS_GUESS 4            // times the compressed size, when the size isn't recorded
+#define DECOMPRESS_LIMIT 0x7fffffffu  // 32-bit elf files are smaller than this
+
+// Read 'size' bytes at 'offset' of the elf file, either from the open file
+// or from the in-memory copy of a streamed elf file.
+// Does not produce any messages.
+static bool ElfRead(MyElf_File *elf, uint32_t offset, void *buffer, uint32_t size) {
+
+	if(elf->image) {
+		if(offset > elf->imageSize || size > elf->imageSize - offset)
+			return false;
+		memcpy(buffer, elf->image + offset, size);
+		return true;
+	}
+	return !fseek(elf->fd, offset, SEEK_SET) && fread(buffer, 1, size, elf->fd) == size;
+}
+
+// Read a whole (possibly non-seekable) stream into arena memory.
+// Does not produce any messages.
+static bool ReadElfStream(MyElf_File *elf, FILE *stream) {
+
+	uint8_t *buffer;
+	uint32_t length;
+
+#ifdef WIN32
+	_setmode(_fileno(stream), _O_BINARY);
+#endif
+	buffer = ArenaReadStream(elf->arena, stream, &length);
+	if(!buffer)
+		return false;
+
+	DEBUG("Read %u bytes of elf file from stream.\r\n", length);
+	elf->image = buffer;
+	elf->imageSize = length;
+	return true;
+}
+
+#if defined(ZTOOL_ZLIB) || defined(ZTOOL_ZSTD)
+// Double the size of a decompression buffer, keeping its first 'length' bytes.
+// Does not produce any messages.
+static uint8_t* GrowBuffer(MyElf_File *elf, uint8_t *buffer, uint32_t length, uint32_t *capacity) {
+
+	uint8_t *larger;
+
+	if(*capacity > DECOMPRESS_LIMIT / 2)
+		return 0;
+	larger = (uint8_t*)ArenaAlloc(elf->arena, *capacity * 2);
+	if(larger)
+		memcpy(larger, buffer, length);
+	*capacity *= 2;
+	return larger;
+}
+#endif
+
+#ifdef ZTOOL_ZLIB
+// Decompress a gzip file (of one or more members) in elf->image, replacing
+// it. The buffer is sized from the uncompressed size in the last member's
+// trailer, and grown if needed.
+// Produces error message on failure (so caller doesn't need to).
+static bool InflateElf(MyElf_File *elf) {
+
+	const uint8_t *data = elf->image;
+	uint32_t size = elf->imageSize;
+	z_stream stream;
+	uint32_t capacity;
+	uint32_t length = 0;
+	uint8_t *buffer;
+	int status;
+
+	memcpy(&capacity, data + size - sizeof(capacity), sizeof(capacity));  // little endian, as is the host
+	if(capacity < size || capacity > DECOMPRESS_LIMIT)
+		capacity = (size < DECOMPRESS_LIMIT / DECOMPRESS_GUESS) ? size * DECOMPRESS_GUESS : DECOMPRESS_LIMIT;
+	buffer = (uint8_t*)ArenaAlloc(elf->arena, capacity);
+	memset(&stream, 0, sizeof(stream));
+	if(!buffer || Z_OK != inflateInit2(&stream, 16 + MAX_WBITS)) {
+		ERROR("Error: Can't start decompressing elf file.\r\n");
+		return false;
+	}
+
+	stream.next_in = (Bytef*)data;
+	stream.avail_in = size;
+	for(;;) {
+		stream.next_out = buffer + length;
+		stream.avail_out = capacity - length;
+		status = inflate(&stream, Z_NO_FLUSH);
+		length = stream.next_out - buffer;
+		if(Z_STREAM_END == status) {
+			if(!stream.avail_in)
+				break;
+			status = inflateReset(&stream);  // the next member
+		} else if(!stream.avail_out) {
+			buffer = GrowBuffer(elf, buffer, length, &capacity);
+			status = buffer ? Z_OK : Z_MEM_ERROR;
+		} else if(Z_OK == status && !stream.avail_in) {
+			status = Z_DATA_ERROR;  // truncated
+		}
+		if(Z_OK != status) {
+			ERROR("Error: Can't decompress elf file (zlib error %d).\r\n", status);
+			inflateEnd(&stream);
+			return false;
+		}
+	}
+	inflateEnd(&stream);
+
+	elf->image = buffer;
+	elf->imageSize = length;
+	return true;
+}
+#endif
+
+#ifdef ZTOOL_ZSTD
+// Decompress a zstd file (of one or more frames) in elf->image, replacing
+// it. The buffer is sized from the first frame's content size, when
+// recorded, and grown if needed.
+// Produces error message on failure (so caller doesn't need to).
+static bool ZstdDecompressElf(MyElf_File *elf) {
+
+	unsigned long long content = ZSTD_getFrameContentSize(elf->image, elf->imageSize);
+	ZSTD_inBuffer in = { elf->image, elf->imageSize, 0 };
+	uint32_t size = elf->imageSize;
+	ZSTD_outBuffer out;
+	ZSTD_DCtx *context;
+	uint32_t capacity;
+	uint8_t *buffer;
+	size_t result;
+
+	if(ZSTD_CONTENTSIZE_UNKNOWN == content || ZSTD_CONTENTSIZE_ERROR == content || content > DECOMPRESS_LIMIT)
+		capacity = (size < DECOMPRESS_LIMIT / DECOMPRESS_GUESS) ? size * DECOMPRESS_GUESS : DECOMPRESS_LIMIT;
+	else
+		capacity = (uint32_t)content;
+	buffer = (uint8_t*)ArenaAlloc(elf->arena, capacity);
+	context = ZSTD_createDCtx();
+	if(!buffer || !context) {
+		ERROR("Error: Can't start decompressing elf file.\r\n");
+		ZSTD_freeDCtx(context);
+		return false;
+	}
+
+	out.dst = buffer;
+	out.size = capacity;
+	out.pos = 0;
+	for(;;) {
+		result = ZSTD_decompressStream(context, &out, &in);
+		if(ZSTD_isError(result)) {
+			ERROR("Error: Can't decompress elf file (%s).\r\n", ZSTD_getErrorName(result));
+			break;
+		}
+		if(!result && in.pos == in.size)
+			break;  // the end of the last frame
+		if(out.pos == out.size) {
+			buffer = GrowBuffer(elf, buffer, (uint32_t)out.pos, &capacity);
+			if(!buffer) {
+				ERROR("Error: Elf file is too large to decompress.\r\n");
+				break;
+			}
+			out.dst = buffer;
+			out.size = capacity;
+		} else if(in.pos == in.size) {
+			ERROR("Error: Can't decompress elf file (truncated).\r\n");
+			break;
+		}
+	}
+	ZSTD_freeDCtx(context);
+	if(ZSTD_isError(result) || result || in.pos != in.size)
+		return false;
+
+	elf->image = buffer;
+	elf->imageSize = (uint32_t)out.pos;
+	return true;
+}
+#endif
+
+// If the elf file is gzip or zstd compressed, decompress all of it into
+// memory once; sections are then read from there (see ElfRead), with the
+// usual section index. Uncompressed files are left as they are.
+// Produces error message on failure (so caller doesn't need to).
+static bool DecompressElf(MyElf_File *elf, const char *name) {
+
+	uint8_t magic[4];
+	uint32_t size;
+	bool gzip, zstd;
+	bool success = false;
+
+	if(!ElfRead(elf, 0, magic, sizeof(magic)))
+		return true;  // too short; the header check reports it
+	gzip = !memcmp(magic, GZIP_MAGIC, 2);
+	zstd = !memcmp(magic, ZSTD_MAGIC, 4);
+	if(!gzip && !zstd)
+		return true;
+
+#if !defined(ZTOOL_ZLIB)
+	if(gzip) {
+		ERROR("Error: Elf file '%s' is gzip compressed; ztool was built without zlib.\r\n", name);
+		return false;
+	}
+#endif
+#if !defined(ZTOOL_ZSTD)
+	if(zstd) {
+		ERROR("Error: Elf file '%s' is zstd compressed; ztool was built without libzstd.\r\n", name);
+		return false;
+	}
+#endif
+
+	// the compressed file is read into memory in one go, too
+	if(elf->fd) {
+		long length = (!fseek(elf->fd, 0, SEEK_END)) ? ftell(elf->fd) : -1;
+		uint8_t *buffer = (length > 0 && length < DECOMPRESS_LIMIT)
+			? (uint8_t*)ArenaAlloc(elf->arena, length) : 0;
+		if(!buffer || fseek(elf->fd, 0, SEEK_SET) || fread(buffer, 1, length, elf->fd) != (size_t)length) {
+			ERROR("Error: Can't read elf file '%s'.\r\n", name);
+			return false;
+		}
+		fclose(elf->fd);
+		elf->fd = 0;
+		elf->image = buffer;
+		elf->imageSize = (uint32_t)length;
+	}
+	size = elf->imageSize;
+
+	TRACE_BEGIN_ARG("decompress", name);
+#ifdef ZTOOL_ZLIB
+	if(gzip)
+		success = InflateElf(elf);
+#endif
+#ifdef ZTOOL_ZSTD
+	if(zstd)
+		success = ZstdDecompressElf(elf);
+#endif
+	TRACE_END("decompress");
+	if(success)
+		DEBUG("Decompressed %u bytes of elf file to %u bytes.\r\n", size, elf->imageSize);
+	return success;
+}
 
 // Find a section in an elf file by name.
 // Returns pointer to section if found, else returns zero.
@@ -36,7 +284,6 @@ MyElf_Section* GetElfSection(MyElf_File *elf, char *name) {
 
     for(i = 0; i < elf->header.e_shnum - 1; i++) {
 		if(!strcmp(name, elf->sections[i].name)) {
-			DEBUG("Found section '%s'.\r\n", name);
 			return &elf->sections[i];
 		}
 	}
@@ -45,142 +292,250 @@ MyElf_Section* GetElfSection(MyElf_File *elf, char *name) {
 	return 0;
 }
 
+// Reads an elf section (actual data) from the elf file into a caller
+// supplied buffer of at least section->size bytes.
+// Produces error message on failure (so caller doesn't need to).
+bool ReadElfSectionData(MyElf_File *elf, MyElf_Section *section, unsigned char *buffer) {
+
+	if (!section->size || !section->offset) {
+		ERROR("Error: Section '%s' has no data to read.\r\n", section->name);
+		return false;
+	}
+	TRACE_BEGIN_ARG("read section", section->name);
+	if(!ElfRead(elf, section->offset, buffer, section->size)) {
+		TRACE_END("read section");
+		ERROR("Error: Can't read section '%s' data from elf file.\r\n", section->name);
+		return false;
+	}
+	TRACE_END("read section");
+	return true;
+}
+
 // Reads an elf section (actual data) from the elf file.
-// Returns a pointer to newly allocated memory (or zero on error),
-// which should be freed by the caller when finished with.
+// Returns a pointer to memory allocated from the elf file's arena (or zero
+// on error), followed by 'pad' zero bytes. Released with the arena.
 // Produces error message on failure (so caller doesn't need to).
 unsigned char* GetElfSectionData(MyElf_File *elf, MyElf_Section *section, uint8_t pad) {
 
-    unsigned char *data = 0;
-    
+	unsigned char *data = 0;
+
 	if (section->size && section->offset) {
 
-		data = (unsigned char*)malloc(section->size + pad);
-		if(!data) {
-	        error("Error: Out of memory!\r\n");
+		data = (unsigned char*)ArenaAlloc(elf->arena, section->size + pad);
+		if(!data)
 			return 0;
-		}
-                memset(data, 0, section->size + pad);
-            
-		if(fseek(elf->fd, section->offset, SEEK_SET) ||
-		   fread(data, 1, section->size, elf->fd) != section->size) {
-			error("Error: Can't read section '%s' data from elf file.\r\n", section->name);
-			free(data);
+		memset(data + section->size, 0, pad);
+		if(!ReadElfSectionData(elf, section, data))
 			return 0;
-	    }
 
 	} else {
-		error("Error: Section '%s' has no data to read.\r\n", section->name);
+		ERROR("Error: Section '%s' has no data to read.\r\n", section->name);
+	}
+
+	return data;
+}
+
+// Find a section in an elf file by its section header index (as used by
+// symbol st_shndx and section sh_link fields).
+// Returns pointer to section if valid, else returns zero.
+MyElf_Section* GetElfSectionByIndex(MyElf_File *elf, uint32_t index) {
+
+	if(index < 1 || index >= elf->header.e_shnum)
+		return 0;
+	return &elf->sections[index - 1];
+}
+
+// Reads the symbol table (.symtab) and its string table from the elf file.
+// The whole table is read with a single fread and converted in one pass,
+// so this stays fast for elf files with hundreds of thousands of symbols.
+// Symbols are stored in elf->symbols and freed by UnloadElf.
+// Produces error message on failure (so caller doesn't need to).
+bool LoadElfSymbols(MyElf_File *elf) {
+
+	MyElf_Section *symtab = 0;
+	MyElf_Section *strtab;
+	Elf32_Sym *raw = 0;
+	uint32_t count;
+	uint32_t i;
+
+	if(elf->symbols)
+		return true;  // already loaded
+
+	for(i = 0; i < elf->header.e_shnum - 1; i++) {
+		if(SHT_SYMTAB == elf->sections[i].type) {
+			symtab = &elf->sections[i];
+			break;
+		}
+	}
+	if(!symtab) {
+		ERROR("Error: Elf file does not contain a symbol table.\n");
+		return false;
+	}
+	strtab = GetElfSectionByIndex(elf, symtab->link);
+	if(!strtab || SHT_STRTAB != strtab->type) {
+		ERROR("Error: Elf symbol table has no string table.\n");
+		return false;
+	}
+
+	TRACE_BEGIN("LoadElfSymbols");
+	raw = (Elf32_Sym*)GetElfSectionData(elf, symtab, 0);
+	elf->symbolStrings = (char*)GetElfSectionData(elf, strtab, 1);
+	count = symtab->size / sizeof(Elf32_Sym);
+	elf->symbols = (MyElf_Symbol*)ArenaAlloc(elf->arena, count * sizeof(MyElf_Symbol));
+	if(!raw || !elf->symbolStrings || !elf->symbols) {
+		TRACE_END("LoadElfSymbols");
+		ERROR("Error: Failed to read symbol table.\n");
+		elf->symbols = 0;
+		return false;
+	}
+
+	elf->symbolCount = 0;
+	for(i = 1; i < count; i++) {  // entry 0 is always the null symbol
+		MyElf_Symbol *sym = &elf->symbols[elf->symbolCount];
+		if(raw[i].st_name >= strtab->size)
+			continue;
+		sym->value = raw[i].st_value;
+		sym->size = raw[i].st_size;
+		sym->shndx = raw[i].st_shndx;
+		sym->type = ELF32_ST_TYPE(raw[i].st_info);
+		sym->name = elf->symbolStrings + raw[i].st_name;
+		elf->symbolCount++;
 	}
 
-    return data;
+	TRACE_END("LoadElfSymbols");
+	DEBUG("Read %u symbols.\n", elf->symbolCount);
+	return true;
 }
 
-// Opens an elf file and reads the string table and file & section headers.
-// Returns a pointer to a MyElf_File structure (or zero on error).
-// UnloadElf should be called to dispose of the MyElf_File structure.
+// Opens an elf file ("-" for standard input) and reads the string table and file & section headers.
+// Returns a pointer to a MyElf_File structure (or zero on error). All memory
+// is allocated from 'arena'; the section table and section names are packed
+// into one contiguous allocation.
+// UnloadElf should be called to close the file.
 // Produces error message on failure (so caller doesn't need to).
-MyElf_File* LoadElf(char *infile) {
+MyElf_File* LoadElf(char *infile, tArena *arena) {
 
 	int i;
 	MyElf_File *elf;
 	Elf32_Shdr temp;
+	uint8_t *headers;
+	uint32_t tableSize;
+	uint32_t stringsSize;
 
 	// allocate the elf structure
-	elf = (MyElf_File*)malloc(sizeof(MyElf_File));
+	elf = (MyElf_File*)ArenaCalloc(arena, sizeof(MyElf_File));
 	if(!elf) {
-		error("Error: Out of memory!\r\n");
-        goto error_exit;
+		return 0;
 	}
-	memset(elf, 0, sizeof(MyElf_File));
+	elf->arena = arena;
+	TRACE_BEGIN_ARG("LoadElf", infile);
 
-	// open the file
-    elf->fd = fopen(infile, "rb");
-    if(!elf->fd) {
-		error("Error: Can't open elf file '%s'.\r\n", infile);
+	// open the file; standard input is read into memory once, since it
+	// may be a pipe that can't seek
+	if(!strcmp(infile, "-")) {
+		if(!ReadElfStream(elf, stdin)) {
+			ERROR("Error: Can't read elf file from standard input.\r\n");
+			goto error_exit;
+		}
+	} else {
+		elf->fd = fopen(infile, "rb");
+		if(!elf->fd) {
+			ERROR("Error: Can't open elf file '%s'.\r\n", infile);
+			goto error_exit;
+		}
+		DEPEND_INPUT(infile);
+	}
+	if(!DecompressElf(elf, infile)) {
 		goto error_exit;
 	}
 
 	// read the header
-	if(fread(&elf->header, 1, sizeof(Elf32_Ehdr), elf->fd) != sizeof(Elf32_Ehdr)) {
-        error("Error: Can't read elf file header.\r\n");
+	if(!ElfRead(elf, 0, &elf->header, sizeof(Elf32_Ehdr))) {
+		ERROR("Error: Can't read elf file header.\r\n");
 		goto error_exit;
-    }
-    
+	}
+
 	// check the file header
 	if (memcmp(elf->header.e_ident, "\x7f" "ELF", 4)) {
-		error("Error: Input files doesn't look like an elf file (bad header).\r\n");
+		ERROR("Error: Input files doesn't look like an elf file (bad header).\r\n");
 		goto error_exit;
 	}
-    
-	// is there a string table section (we need one)
-    if(!elf->header.e_shstrndx) {
-		error("Error: Elf file does not contain a string table.\r\n");
+	if (elf->header.e_ident[EI_CLASS] != ELFCLASS32) {
+		ERROR("Error: Input file is not a 32-bit elf file.\r\n");
+		goto error_exit;
+	}
+	if (elf->header.e_shentsize < sizeof(Elf32_Shdr) || !elf->header.e_shnum) {
+		ERROR("Error: Elf file has no usable section header table.\r\n");
 		goto error_exit;
 	}
 
-	// get the string table section header
-    if(fseek(elf->fd, elf->header.e_shoff + (elf->header.e_shentsize * elf->header.e_shstrndx), SEEK_SET) ||
-	   fread(&temp, 1, sizeof(Elf32_Shdr), elf->fd) != sizeof(Elf32_Shdr)) {
-
-        error("Error: Can't read string table section from elf file.\r\n");
+	// is there a string table section (we need one)
+	if(!elf->header.e_shstrndx || elf->header.e_shstrndx >= elf->header.e_shnum) {
+		ERROR("Error: Elf file does not contain a string table.\r\n");
 		goto error_exit;
-    }
- 
-	// read the actual string table
-    if(!temp.sh_size) {
-		error("Error: Elf file contains an empty string table.\r\n");
+	}
+
+	// read the whole section header table in one go
+	tableSize = elf->header.e_shentsize * elf->header.e_shnum;
+	headers = (uint8_t*)ArenaAlloc(arena, tableSize);
+	if(!headers) {
 		goto error_exit;
 	}
-    elf->strings = (char*)malloc(temp.sh_size);
-    if(!elf->strings) {
-        error("Error: Out of memory!\r\n");
+	if(!ElfRead(elf, elf->header.e_shoff, headers, tableSize)) {
+		ERROR("Error: Can't read section headers from elf file.\r\n");
 		goto error_exit;
-    }
-    if(fseek(elf->fd, temp.sh_offset, SEEK_SET) ||
-	   fread(elf->strings, 1, temp.sh_size, elf->fd) != temp.sh_size) {
-        error("Error: Failed to read string stable from elf file.\r\n");
+	}
+
+	// get the string table section header
+	memcpy(&temp, headers + (elf->header.e_shentsize * elf->header.e_shstrndx), sizeof(Elf32_Shdr));
+	if(!temp.sh_size) {
+		ERROR("Error: Elf file contains an empty string table.\r\n");
 		goto error_exit;
-    }
+	}
 
-	// read section headers
-	elf->sections = (MyElf_Section*)malloc(sizeof(MyElf_Section) * elf->header.e_shnum);
+	// section table and string table share one allocation
+	elf->sections = (MyElf_Section*)ArenaAlloc(arena,
+		sizeof(MyElf_Section) * elf->header.e_shnum + temp.sh_size + 1);
 	if(!elf->sections) {
-		error("Error: Out of memory!\r\n");
-        goto error_exit;
+		goto error_exit;
 	}
+	stringsSize = temp.sh_size;
+	elf->strings = (char*)(elf->sections + elf->header.e_shnum);
+	elf->strings[stringsSize] = '\0';
+	if(!ElfRead(elf, temp.sh_offset, elf->strings, temp.sh_size)) {
+		ERROR("Error: Failed to read string stable from elf file.\r\n");
+		goto error_exit;
+	}
+
+	// convert section headers
 	for(i = 1; i < elf->header.e_shnum; i++) {
-        if(fseek(elf->fd, elf->header.e_shoff + (elf->header.e_shentsize * i), SEEK_SET)
-		   || fread(&temp, 1, sizeof(Elf32_Shdr), elf->fd) != sizeof(Elf32_Shdr)) {
-            error("Error: Can't read section %d from elf file.\r\n", i);
-            break;
-		}
-		DEBUG("Read section %d '%s'.\r\n", i, elf->strings + temp.sh_name);
+		memcpy(&temp, headers + (elf->header.e_shentsize * i), sizeof(Elf32_Shdr));
+		if(temp.sh_name >= stringsSize)
+			temp.sh_name = stringsSize;  // points at the terminating null
 		elf->sections[i-1].address = temp.sh_addr;
 		elf->sections[i-1].offset = temp.sh_offset;
 		elf->sections[i-1].size = temp.sh_size;
+		elf->sections[i-1].type = temp.sh_type;
+		elf->sections[i-1].flags = temp.sh_flags;
+		elf->sections[i-1].link = temp.sh_link;
 		elf->sections[i-1].name = elf->strings + temp.sh_name;
 	}
 
-    return elf;
+	TRACE_END("LoadElf");
+	return elf;
 
 error_exit:
-	if (elf) {
-		if (elf->fd) fclose(elf->fd);
-		if (elf->strings) free(elf->strings);
-		free(elf);
-	}
+	TRACE_END("LoadElf");
+	if (elf->fd) fclose(elf->fd);
 	return 0;
 
 }
 
-// Close an elf file and dispose of the MyElf_File structure.
+// Close an elf file. Memory is released along with the arena passed to LoadElf.
 void UnloadElf(MyElf_File *elf) {
 	if (elf) {
 		DEBUG("Unloading elf file.\r\n");
 		if(elf->fd) fclose(elf->fd);
-		if(elf->strings) free(elf->strings);
-		if(elf->sections) free(elf->sections);
-		free(elf);
+		elf->fd = 0;
 	}
 }
@@ -26,27 +26,50 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include "ztool.h"
 #include "elf.h"
+#include "ztool_arena.h"
 
 typedef struct 
 {
    Elf32_Off    offset;
    Elf32_Addr   address;
    Elf32_Word   size;
+   Elf32_Word   type;
+   Elf32_Word   flags;
+   Elf32_Word   link;
    char        *name;
 } MyElf_Section;
 
+typedef struct
+{
+   Elf32_Addr   value;
+   Elf32_Word   size;
+   Elf32_Half   shndx;   // ELF section index (sections[shndx-1])
+   uint8_t      type;
+   char        *name;
+} MyElf_Symbol;
+
 typedef struct 
 {
+   tArena         *arena;
    FILE           *fd;
+   uint8_t        *image;       // whole file, when read from a stream
+   uint32_t        imageSize;
    Elf32_Ehdr      header;
    char           *strings;
    MyElf_Section  *sections;
+   MyElf_Symbol   *symbols;
+   uint32_t        symbolCount;
+   char           *symbolStrings;
 } MyElf_File;
 
-MyElf_File* LoadElf(char *infile);
+MyElf_File* LoadElf(char *infile, tArena *arena);
 void UnloadElf(MyElf_File *e_object);
 MyElf_Section* GetElfSection(MyElf_File *e_object, char *name);
+bool ReadElfSectionData(MyElf_File *e_object, MyElf_Section *section, unsigned char *buffer);
 unsigned char* GetElfSectionData(MyElf_File *e_object, MyElf_Section *section, uint8_t pad);
+MyElf_Section* GetElfSectionByIndex(MyElf_File *e_object, uint32_t index);
+bool LoadElfSymbols(MyElf_File *e_object);
 
 #endif /* ZTOOL_ELF_H */
@@ -0,0 +1,69 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <string.h>
+
+#include "ztool.h"
+#include "ztool_hash.h"
+
+// 64-bit multiply/xor-shift hash over 8-byte words (in the style of
+// MurmurHash64A). Processes about one word per cycle, which keeps hashing
+// multi-megabyte images cheap compared to reading them.
+
+#define HASH_M 0xc6a4a7935bd1e995ULL
+#define HASH_R 47
+
+static uint64_t HashMix(uint64_t k)
+{
+   k *= HASH_M;
+   k ^= k >> HASH_R;
+   k *= HASH_M;
+   return k;
+}
+
+uint64_t Hash64(const void *data, size_t length, uint64_t seed)
+{
+   const uint8_t *p = (const uint8_t *) data;
+   uint64_t h = seed ^ (length * HASH_M);
+   uint64_t k;
+
+   while(length >= sizeof(uint64_t))
+   {
+      memcpy(&k, p, sizeof(k));
+      h ^= HashMix(k);
+      h *= HASH_M;
+      p += sizeof(uint64_t);
+      length -= sizeof(uint64_t);
+   }
+   if(length > 0)
+   {
+      k = 0;
+      memcpy(&k, p, length);
+      h ^= k;
+      h *= HASH_M;
+   }
+
+   h ^= h >> HASH_R;
+   h *= HASH_M;
+   h ^= h >> HASH_R;
+   return h;
+}
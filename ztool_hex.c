@@ -0,0 +1,191 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <string.h>
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_hex.h"
+
+#define HEX_ERASED 0xff
+
+static char hexTable[256][2];   // two upper case hex digits for every byte value
+static bool hexTableReady = false;
+
+// --------------------------------------------------------------------------------
+// Helper Functions
+
+static void HexTableInit(void)
+{
+   static const char digits[] = "0123456789ABCDEF";
+   uint32_t i;
+
+   for(i = 0; i < 256; ++i)
+   {
+      hexTable[i][0] = digits[i >> 4];
+      hexTable[i][1] = digits[i & 0xf];
+   }
+   hexTableReady = true;
+}
+
+// Format and write one record. The record is built in a line buffer with one
+// table lookup per byte, and written with a single fwrite.
+//   IHEX: ':' count, 16-bit address, type, data, two's complement checksum
+//   SREC: 'S' type, count, address (2, 3 or 4 bytes by type), data,
+//         one's complement checksum
+// Produces error message on failure (so caller doesn't need to).
+static bool HexRecord(FILE *fd, eHexFormat format, uint8_t type, uint32_t address,
+   const uint8_t *data, uint32_t length)
+{
+   uint8_t bytes[HEX_RECORD_SIZE + 6];
+   char line[2 * sizeof(bytes) + 4];
+   uint32_t count = 0;
+   uint32_t size = 0;
+   uint8_t sum = 0;
+   uint32_t i;
+
+   if(HEX_FORMAT_IHEX == format)
+   {
+      line[size++] = ':';
+      bytes[count++] = (uint8_t) length;
+      bytes[count++] = (uint8_t) (address >> 8);
+      bytes[count++] = (uint8_t) address;
+      bytes[count++] = type;
+   }
+   else
+   {
+      uint32_t addressBytes = (type == 2 || type == 8) ? 3 : (type == 3 || type == 7) ? 4 : 2;
+      line[size++] = 'S';
+      line[size++] = (char) ('0' + type);
+      bytes[count++] = (uint8_t) (addressBytes + length + 1);
+      for(i = addressBytes; i > 0; --i)
+         bytes[count++] = (uint8_t) (address >> (8 * (i - 1)));
+   }
+   if(length > 0)
+      memcpy(&bytes[count], data, length);
+   count += length;
+
+   for(i = 0; i < count; ++i)
+   {
+      sum += bytes[i];
+      line[size++] = hexTable[bytes[i]][0];
+      line[size++] = hexTable[bytes[i]][1];
+   }
+   sum = (HEX_FORMAT_IHEX == format) ? (uint8_t) (0x100 - sum) : (uint8_t) ~sum;
+   line[size++] = hexTable[sum][0];
+   line[size++] = hexTable[sum][1];
+   line[size++] = '\n';
+
+   if(fwrite(line, 1, size, fd) != size)
+   {
+      ERROR("Failed to write %s record\n", (HEX_FORMAT_IHEX == format) ? "hex" : "S-");
+      return false;
+   }
+   return true;
+}
+
+// --------------------------------------------------------------------------------
+// Operations
+
+// Start hex output (SREC files start with an S0 header record)
+bool HexStart(tHexSink *hex, FILE *fd, eHexFormat format)
+{
+   static const uint8_t header[] = "ztool";
+
+   if(!hexTableReady)
+      HexTableInit();
+   memset(hex, 0, sizeof(*hex));
+   hex->format = format;
+   if(HEX_FORMAT_SREC == format)
+      return HexRecord(fd, format, 0, 0, header, sizeof(header) - 1);
+   return true;
+}
+
+// Write the collected record, without leading and trailing erased bytes
+bool HexFlush(tHexSink *hex, FILE *fd)
+{
+   uint8_t *data = hex->record;
+   uint32_t address = hex->address;
+   uint32_t length = hex->length;
+
+   hex->length = 0;
+   while(length > 0 && HEX_ERASED == data[length - 1])
+      --length;
+   while(length > 0 && HEX_ERASED == data[0])
+      ++data, ++address, --length;
+   if(0 == length)
+      return true;
+
+   if(HEX_FORMAT_SREC == hex->format)
+      return HexRecord(fd, hex->format, 3, address, data, length);
+
+   if(!hex->haveUpper || hex->upper != address >> 16)
+   {
+      uint8_t upper[2] = { (uint8_t) (address >> 24), (uint8_t) (address >> 16) };
+      if(!HexRecord(fd, hex->format, 4, 0, upper, sizeof(upper)))
+         return false;
+      hex->upper = address >> 16;
+      hex->haveUpper = true;
+   }
+   return HexRecord(fd, hex->format, 0, address & 0xffff, data, length);
+}
+
+// Add data at a flash address. Data that doesn't continue the current record
+// starts a new one; IHEX records also never cross a 64KB boundary.
+// Produces error message on failure (so caller doesn't need to).
+bool HexWrite(tHexSink *hex, FILE *fd, uint32_t address, const uint8_t *data, uint32_t length)
+{
+   while(length > 0)
+   {
+      uint32_t count;
+
+      if(hex->length > 0 && hex->address + hex->length != address && !HexFlush(hex, fd))
+         return false;
+      if(0 == hex->length)
+         hex->address = address;
+      count = HEX_RECORD_SIZE - hex->length;
+      if(HEX_FORMAT_IHEX == hex->format && count > 0x10000 - (address & 0xffff))
+         count = 0x10000 - (address & 0xffff);
+      if(count > length)
+         count = length;
+
+      memcpy(&hex->record[hex->length], data, count);
+      hex->length += count;
+      address += count;
+      data += count;
+      length -= count;
+      if((HEX_RECORD_SIZE == hex->length || (HEX_FORMAT_IHEX == hex->format && 0 == (address & 0xffff)))
+         && !HexFlush(hex, fd))
+         return false;
+   }
+   return true;
+}
+
+// Write the last record and the end of file record
+bool HexEnd(tHexSink *hex, FILE *fd)
+{
+   if(!HexFlush(hex, fd))
+      return false;
+   if(HEX_FORMAT_SREC == hex->format)
+      return HexRecord(fd, hex->format, 7, 0, NULL, 0);
+   return HexRecord(fd, hex->format, 1, 0, NULL, 0);
+}
@@ -0,0 +1,65 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_HEX_H
+#define ZTOOL_HEX_H
+
+#include <stdio.h>
+#include "ztool.h"
+
+// Intel HEX and Motorola S-record output, for device programmers that don't
+// take binary images. Data is collected into records of up to
+// HEX_RECORD_SIZE bytes; erased flash (0xff) at the start or end of a record
+// is left out, so a record of nothing but 0xff is never written, and a
+// programmer writing the file skips blank flash.
+
+#define HEX_RECORD_SIZE 32
+
+typedef enum
+{
+   HEX_FORMAT_NONE,    // binary output
+   HEX_FORMAT_IHEX,    // Intel HEX, with extended linear address records
+   HEX_FORMAT_SREC     // Motorola S-records, with 32-bit addresses (S3)
+} eHexFormat;
+
+typedef struct
+{
+   eHexFormat format;
+   uint32_t   base;    // flash address of the first byte of an image
+} tHexOutput;
+
+typedef struct
+{
+   eHexFormat format;
+   uint32_t   address;                    // of record[0]
+   uint32_t   length;                     // bytes in record
+   uint32_t   upper;                      // IHEX: upper 16 address bits in effect
+   bool       haveUpper;
+   uint8_t    record[HEX_RECORD_SIZE];
+} tHexSink;
+
+bool HexStart(tHexSink *hex, FILE *fd, eHexFormat format);
+bool HexWrite(tHexSink *hex, FILE *fd, uint32_t address, const uint8_t *data, uint32_t length);
+bool HexFlush(tHexSink *hex, FILE *fd);
+bool HexEnd(tHexSink *hex, FILE *fd);
+
+#endif /* ZTOOL_HEX_H */
@@ -0,0 +1,333 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_arena.h"
+#include "ztool_depend.h"
+#include "ztool_image.h"
+#include "ztool_sha256.h"
+
+// --------------------------------------------------------------------------------
+// Helper Functions
+
+// Walk a chain of 'count' section headers starting at 'offset', with every
+// header and segment bounds-checked against 'size'. With fillRecords (zboot),
+// a header with ZBOOT_SECTION_FILL set is followed by a pattern word only.
+// Returns the offset just past the last segment, or zero if the chain
+// doesn't fit.
+static uint32_t WalkSegments(const uint8_t *data, uint32_t size, uint32_t offset,
+   tImageInfo *info, bool fillRecords, tArena *arena)
+{
+   uint32_t i;
+
+   info->segments = (tImageSegment *) ArenaAlloc(arena, info->count * sizeof(tImageSegment) + 1);
+   if(NULL == info->segments)
+      return 0;
+
+   for(i = 0; i < info->count; ++i)
+   {
+      Section_Header sechead;
+
+      if(size - offset < sizeof(sechead))
+         return 0;
+      memcpy(&sechead, data + offset, sizeof(sechead));
+      offset += sizeof(sechead);
+      info->segments[i].fill = fillRecords && 0 != (sechead.size & ZBOOT_SECTION_FILL);
+      info->segments[i].address = sechead.addr;
+      info->segments[i].size = sechead.size & ~(info->segments[i].fill ? ZBOOT_SECTION_FILL : 0);
+      info->segments[i].offset = offset;
+      info->segments[i].checksumValid = true;
+      if(info->segments[i].fill)
+         sechead.size = sizeof(uint32_t);  // the pattern
+      if(sechead.size > size - offset)
+         return 0;
+      offset += sechead.size;
+   }
+   return offset;
+}
+
+// ESP8266 and ESP32: XOR checksum of the segment data in the last byte of
+// a 16-byte aligned image
+static bool ParseBinImage(const uint8_t *data, uint32_t size, uint32_t offset,
+   tImageInfo *info, tArena *arena)
+{
+   uint8_t chksum = CHECKSUM_INIT;
+   uint32_t i, j;
+
+   offset = WalkSegments(data, size, offset, info, false, arena);
+   if(0 == offset)
+      return false;
+   offset += (IMAGE_PADDING - ((offset + sizeof(uint8_t)) % IMAGE_PADDING)) % IMAGE_PADDING;
+   if(offset >= size)
+      return false;
+
+   for(i = 0; i < info->count; ++i)
+      for(j = 0; j < info->segments[i].size; ++j)
+         chksum ^= data[info->segments[i].offset + j];
+   info->checksumValid = (chksum == data[offset]);
+   info->length = offset + sizeof(uint8_t);
+   return true;
+}
+
+static bool ParseEsp32Image(const uint8_t *data, uint32_t size, tImageInfo *info, tArena *arena)
+{
+   tEsp32ExtendedHeader extended;
+   uint32_t i;
+
+   if(size < sizeof(tImageHeader) + sizeof(extended))
+      return false;
+   memcpy(&extended, data + sizeof(tImageHeader), sizeof(extended));
+   if(extended.hashAppended > 1)
+      return false;
+   for(i = 0; i < sizeof(extended.reserved); ++i)
+      if(0 != extended.reserved[i])
+         return false;
+
+   if(!ParseBinImage(data, size, sizeof(tImageHeader) + sizeof(extended), info, arena))
+      return false;
+   info->format = IMAGE_FORMAT_ESP32;
+
+   if(extended.hashAppended)
+   {
+      uint8_t digest[SHA256_DIGEST_SIZE];
+      tSha256 sha;
+
+      if(size - info->length < SHA256_DIGEST_SIZE)
+         return false;
+      Sha256Init(&sha);
+      Sha256Update(&sha, data, info->length);
+      Sha256Final(&sha, digest);
+      info->checksumValid = info->checksumValid
+         && 0 == memcmp(digest, data + info->length, SHA256_DIGEST_SIZE);
+      info->length += SHA256_DIGEST_SIZE;
+   }
+   return true;
+}
+
+static uint32_t WordSum(const uint8_t *data, uint32_t length)
+{
+   uint32_t chksum = 0;
+   uint32_t i;
+
+   for(i = 0; i + sizeof(uint32_t) <= length; i += sizeof(uint32_t))
+   {
+      uint32_t word;
+      memcpy(&word, data + i, sizeof(word));
+      chksum += word;
+   }
+   return chksum;
+}
+
+static void ParseZbootHeader(const tzImageHeader *header, tImageInfo *info)
+{
+   info->format = IMAGE_FORMAT_ZBOOT;
+   info->count = header->count;
+   info->entry = header->entry;
+   info->version = header->version;
+   info->date = header->date;
+   memcpy(info->description, header->description, sizeof(header->description));
+   info->description[sizeof(header->description)] = '\0';
+}
+
+// zboot v2: section table after the header, with a checksum per section;
+// the image checksum follows the section that ends last
+static bool ParseZbootIndexedImage(const uint8_t *data, uint32_t size, tImageInfo *info, tArena *arena)
+{
+   tzImageHeader header;
+   uint32_t tableEnd;
+   uint32_t end;
+   uint32_t stored;
+   uint32_t i;
+
+   if(size < sizeof(header))
+      return false;
+   memcpy(&header, data, sizeof(header));
+   if(header.count > (size - sizeof(header)) / sizeof(tzSectionEntry))
+      return false;
+   ParseZbootHeader(&header, info);
+   info->layout = ZBOOT_LAYOUT_V2;
+
+   info->segments = (tImageSegment *) ArenaAlloc(arena, info->count * sizeof(tImageSegment) + 1);
+   if(NULL == info->segments)
+      return false;
+   tableEnd = end = sizeof(header) + header.count * sizeof(tzSectionEntry);
+   info->checksumValid = true;
+   for(i = 0; i < info->count; ++i)
+   {
+      tzSectionEntry entry;
+
+      memcpy(&entry, data + sizeof(header) + i * sizeof(entry), sizeof(entry));
+      if(entry.offset < tableEnd || entry.offset > size || entry.size > size - entry.offset
+         || 0 != entry.offset % sizeof(uint32_t) || 0 != entry.size % sizeof(uint32_t))
+         return false;
+      info->segments[i].address = entry.addr;
+      info->segments[i].size = entry.size;
+      info->segments[i].offset = entry.offset;
+      info->segments[i].checksumValid = (entry.chksum == WordSum(data + entry.offset, entry.size));
+      info->checksumValid = info->checksumValid && info->segments[i].checksumValid;
+      if(entry.offset + entry.size > end)
+         end = entry.offset + entry.size;
+   }
+
+   if(size - end < sizeof(stored))
+      return false;
+   memcpy(&stored, data + end, sizeof(stored));
+   info->checksumValid = info->checksumValid && (WordSum(data, end) == stored);
+   info->length = end + sizeof(stored);
+   return true;
+}
+
+// zboot: 32-bit sum of the header, section headers and data, after the last
+// section; a fill record's pattern counts for every word it fills
+static bool ParseZbootImage(const uint8_t *data, uint32_t size, tImageInfo *info, tArena *arena)
+{
+   tzImageHeader header;
+   uint32_t chksum;
+   uint32_t stored;
+   uint32_t offset;
+   uint32_t i;
+
+   if(size < sizeof(header))
+      return false;
+   memcpy(&header, data, sizeof(header));
+   if(header.count > (size - sizeof(header)) / sizeof(Section_Header))
+      return false;
+
+   ParseZbootHeader(&header, info);
+   info->layout = ZBOOT_LAYOUT_V1;
+
+   offset = WalkSegments(data, size, sizeof(header), info, true, arena);
+   if(0 == offset || size - offset < sizeof(stored) || 0 != offset % sizeof(uint32_t))
+      return false;
+   memcpy(&stored, data + offset, sizeof(stored));
+   chksum = WordSum(data, offset);
+   for(i = 0; i < info->count; ++i)
+   {
+      uint32_t pattern;
+      if(!info->segments[i].fill)
+         continue;
+      if(0 != info->segments[i].offset % sizeof(uint32_t))
+         return false;
+      memcpy(&pattern, data + info->segments[i].offset, sizeof(pattern));
+      chksum += pattern * (info->segments[i].size / sizeof(uint32_t) - 1);  // counted once already
+   }
+   info->checksumValid = (chksum == stored);
+   info->length = offset + sizeof(stored);
+   return true;
+}
+
+// --------------------------------------------------------------------------------
+// Operations
+
+const char* ImageFormatName(eImageFormat format)
+{
+   switch(format)
+   {
+      case IMAGE_FORMAT_BIN:   return "bin";
+      case IMAGE_FORMAT_ESP32: return "esp32";
+      case IMAGE_FORMAT_ZBOOT: return "zboot";
+   }
+   return "unknown";
+}
+
+// Parse the image at the start of 'data' (of which 'size' bytes are
+// available; an image may be followed by other data, as in a flash dump).
+// The section header chain (or zboot v2 section table) is bounds-checked,
+// and the checksum (for ESP32 also the SHA-256, for zboot v2 also each
+// section's checksum) verified; the result is in info->checksumValid.
+// An ESP32 image is recognized by its extended header; any other image
+// starting with BIN_MAGIC_FLASH is taken to be an ESP8266 image.
+// Returns false if the data does not hold a well-formed image.
+// Does not produce any messages.
+bool ParseImage(const uint8_t *data, uint32_t size, tImageInfo *info, tArena *arena)
+{
+   uint32_t magic;
+
+   memset(info, 0, sizeof(*info));
+   if(size < sizeof(tImageHeader))
+      return false;
+
+   memcpy(&magic, data, sizeof(magic));
+   if(ZBOOT_MAGIC == magic)
+      return ParseZbootImage(data, size, info, arena);
+   if(ZBOOT_MAGIC_V2 == magic)
+      return ParseZbootIndexedImage(data, size, info, arena);
+
+   if(BIN_MAGIC_FLASH == data[0])
+   {
+      tImageHeader header;
+      memcpy(&header, data, sizeof(header));
+      if(0 == header.count)
+         return false;
+      info->count = header.count;
+      info->entry = header.entry;
+      info->flags1 = header.flags1;
+      info->flags2 = header.flags2;
+      if(ParseEsp32Image(data, size, info, arena) && info->checksumValid)
+         return true;
+      info->format = IMAGE_FORMAT_BIN;
+      info->checksumValid = false;
+      return ParseBinImage(data, size, sizeof(tImageHeader), info, arena);
+   }
+   return false;
+}
+
+// Read a whole image file ("-" for standard input) into arena memory. The
+// data is followed by a zero byte, so text files can be parsed in place.
+// Produces error message on failure (so caller doesn't need to).
+uint8_t* ReadImageFile(const char *path, uint32_t *size, tArena *arena)
+{
+   uint32_t length = 0;
+   uint8_t *buffer;
+   FILE *fd;
+
+   fd = (0 == strcmp(path, "-")) ? stdin : fopen(path, "rb");
+   if(NULL == fd)
+   {
+      ERROR("Failed to open image file '%s'\n", path);
+      return NULL;
+   }
+   DEPEND_INPUT(path);
+#ifdef WIN32
+   if(stdin == fd)
+      _setmode(_fileno(stdin), _O_BINARY);
+#endif
+
+   buffer = ArenaReadStream(arena, fd, &length);
+   if(NULL == buffer)
+      ERROR("Failed to read image file '%s'\n", path);
+   else
+      buffer[length] = '\0';  // the buffer is always larger than the data read
+   if(stdin != fd)
+      fclose(fd);
+
+   *size = length;
+   return buffer;
+}
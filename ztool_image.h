@@ -0,0 +1,151 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_IMAGE_H
+#define ZTOOL_IMAGE_H
+
+#include <stdint.h>
+#include "ztool.h"
+#include "ztool_arena.h"
+
+// Layout constants and headers of the image formats written by ztool
+
+#define IMAGE_PADDING   16
+#define SECTION_PADDING 4
+#define CHECKSUM_INIT   0xEF
+#define BIN_MAGIC_FLASH 0xE9
+
+typedef struct
+{
+    uint32_t addr;
+    uint32_t size;
+} Section_Header;
+
+#define ZBOOT_MAGIC 0x279bfbf1
+#define SECONDS_BETWEEN_1970_AND_2000 946684800L  // zboot dates count from 2000
+
+// A zboot (v1) section header with ZBOOT_SECTION_FILL set in its size is a
+// fill record: it is followed by one pattern word instead of the data, and
+// the loader fills (size & ~ZBOOT_SECTION_FILL) bytes at the address with
+// the pattern, rather than copying them from flash. The image checksum
+// covers the logical contents: the pattern word counts once for every word
+// it fills. Runs shorter than ZBOOT_FILL_MIN would make the image larger.
+#define ZBOOT_SECTION_FILL 0x80000000
+#define ZBOOT_FILL_MIN     24
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t count;
+    uint32_t entry;
+    uint32_t version; 
+    uint32_t date;
+    uint32_t reserved[3];
+    char     description[88];
+} tzImageHeader;
+
+// zboot v2 (indexed) images start with the same header, with magic
+// ZBOOT_MAGIC_V2, followed by a table of 'count' section entries. Section
+// data is at the image offsets given, so the loader can go straight to a
+// section, verify it on its own, and skip it if unchanged. Each entry's
+// checksum is the 32-bit word sum of the section data (padded to
+// SECTION_PADDING); the image checksum after the last section is the word
+// sum of everything before it, as in v1.
+
+#define ZBOOT_MAGIC_V2  0x279bfbf2
+#define ZBOOT_LAYOUT_V1 1
+#define ZBOOT_LAYOUT_V2 2
+
+typedef struct
+{
+    uint32_t addr;
+    uint32_t size;
+    uint32_t offset;
+    uint32_t chksum;
+} tzSectionEntry;
+
+typedef struct
+{
+    uint8_t  magic;
+    uint8_t  count;
+    uint8_t  flags1;
+    uint8_t  flags2;
+    uint32_t entry;
+} tImageHeader;
+
+// ESP32 application images use the tImageHeader layout (with ESP32 flash
+// size codes) followed by an extended header, and a SHA-256 appended after
+// the checksum. Flash-mapped segments must sit at an image offset congruent
+// to their load address modulo ESP32_IROM_ALIGN.
+
+#define ESP32_IROM_ALIGN      0x10000
+#define ESP32_WP_PIN_DISABLED 0xEE
+
+typedef struct
+{
+    uint8_t  wpPin;
+    uint8_t  spiPinDrive[3];
+    uint16_t chipId;
+    uint8_t  minChipRevision;
+    uint8_t  reserved[8];
+    uint8_t  hashAppended;
+} tEsp32ExtendedHeader;
+
+// Parsed view of an existing image (see ParseImage)
+
+typedef enum
+{
+    IMAGE_FORMAT_BIN,       // ESP8266 boot ROM image
+    IMAGE_FORMAT_ESP32,     // ESP32 application image
+    IMAGE_FORMAT_ZBOOT      // zboot image
+} eImageFormat;
+
+typedef struct
+{
+    uint32_t address;
+    uint32_t size;
+    uint32_t offset;        // of the segment data (or fill pattern), from the start of the image
+    bool     checksumValid; // zboot v2 section checksum (true for other formats)
+    bool     fill;          // zboot fill record; size is the bytes it fills
+} tImageSegment;
+
+typedef struct
+{
+    eImageFormat   format;
+    uint32_t       length;          // whole image, including checksum (and hash)
+    uint32_t       entry;
+    uint32_t       count;
+    tImageSegment *segments;
+    bool           checksumValid;
+    uint8_t        flags1;          // bin and ESP32 only
+    uint8_t        flags2;
+    uint32_t       version;         // zboot only
+    uint32_t       date;
+    uint32_t       layout;          // ZBOOT_LAYOUT_V1 or ZBOOT_LAYOUT_V2
+    char           description[sizeof(((tzImageHeader *) 0)->description) + 1];
+} tImageInfo;
+
+const char* ImageFormatName(eImageFormat format);
+bool ParseImage(const uint8_t *data, uint32_t size, tImageInfo *info, tArena *arena);
+uint8_t* ReadImageFile(const char *path, uint32_t *size, tArena *arena);
+
+#endif /* ZTOOL_IMAGE_H */
@@ -0,0 +1,860 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#define _GNU_SOURCE  // sysconf(_SC_NPROCESSORS_ONLN)
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifndef WIN32
+#include <dirent.h>
+#include <pthread.h>
+#endif
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_arena.h"
+#include "ztool_depend.h"
+#include "ztool_elf.h"
+#include "ztool_hash.h"
+#include "ztool_image.h"
+#include "ztool_index.h"
+#include "ztool_trace.h"
+#include "ztool_write.h"
+
+#define INDEX_PATH_SIZE      1024
+#define INDEX_MAX_DEPTH      32
+#define INDEX_MAX_THREADS    64
+#define INDEX_PARTIAL_REPORT 10    // partial matches listed by a lookup
+
+typedef struct
+{
+   uint32_t  address;
+   uint32_t  size;
+   uint64_t  hash;       // whole contents
+   uint64_t  prefix;     // first INDEX_PREFIX_SIZE bytes (all, if smaller)
+   uint32_t  elf;        // index of the owning entry
+   char     *name;
+} tIndexSection;
+
+typedef struct
+{
+   char          *path;
+   long long      mtime;
+   long long      size;
+   uint32_t       sectionCount;
+   tIndexSection *sections;
+   bool           indexed;   // sections are known (loaded, or read from the old index)
+} tIndexEntry;
+
+typedef struct
+{
+   tIndexEntry *entries;
+   uint32_t     count;
+} tIndex;
+
+typedef struct
+{
+   char    **paths;
+   uint32_t  count;
+   uint32_t  capacity;
+} tPathList;
+
+typedef struct
+{
+   tIndexEntry *entries;
+   uint32_t     count;
+   uint32_t     next;      // next entry to be claimed by a worker
+#ifndef WIN32
+   pthread_mutex_t lock;
+#endif
+} tIndexJob;
+
+typedef struct
+{
+   tIndexJob *job;
+   tArena    *arena;       // results; one per worker, since arenas aren't thread safe
+   uint32_t   indexed;     // ELF files (re)indexed by this worker
+#ifndef WIN32
+   pthread_t  thread;
+#endif
+} tIndexWorker;
+
+typedef struct
+{
+   tIndex          *index;
+   tIndexSection  **byPrefix;     // all sections, sorted by prefix hash
+   uint32_t         sectionCount;
+   bool             smallSize[INDEX_PREFIX_SIZE];  // sizes of sections smaller than a prefix
+   uint32_t        *stamp;        // per entry: last segment it matched in (plus one)
+   uint32_t        *best;         // per entry: bytes matched in that segment
+   uint32_t        *matched;      // per entry: bytes matched in the image
+   uint32_t        *segments;     // per entry: segments matched completely
+} tLookup;
+
+// --------------------------------------------------------------------------------
+// Helper Functions
+
+static int CompareEntryPath(const void *a, const void *b)
+{
+   return strcmp((*(const tIndexEntry **) a)->path, (*(const tIndexEntry **) b)->path);
+}
+
+static int ComparePath(const void *a, const void *b)
+{
+   return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int ComparePrefix(const void *a, const void *b)
+{
+   uint64_t x = (*(const tIndexSection **) a)->prefix;
+   uint64_t y = (*(const tIndexSection **) b)->prefix;
+   return (x > y) - (x < y);
+}
+
+static char* ArenaStrdup(tArena *arena, const char *string)
+{
+   char *copy = (char *) ArenaAlloc(arena, strlen(string) + 1);
+   if(NULL != copy)
+      strcpy(copy, string);
+   return copy;
+}
+
+// Read an index file into arena memory; a missing file is an empty index.
+// Produces error message on failure (so caller doesn't need to).
+static bool ReadIndex(tIndex *index, const char *indexFile, bool mustExist, tArena *arena)
+{
+   tIndexEntry *entry = NULL;
+   tIndexSection *section;
+   uint32_t sectionCount = 0;
+   uint32_t size;
+   struct stat info;
+   char *text, *line, *end;
+
+   memset(index, 0, sizeof(*index));
+   if(!mustExist && 0 != stat(indexFile, &info))
+      return true;
+
+   text = (char *) ReadImageFile(indexFile, &size, arena);
+   if(NULL == text)
+      return false;
+   if(0 != strncmp(text, INDEX_MAGIC "\n", strlen(INDEX_MAGIC) + 1))
+   {
+      ERROR("'%s' is not a ztool index\n", indexFile);
+      return false;
+   }
+
+   // Size the tables up front
+   for(line = text; NULL != (line = strchr(line, '\n')); ++line)
+   {
+      if(0 == strncmp(line + 1, "elf ", 4))
+         ++index->count;
+      else if(0 == strncmp(line + 1, "sec ", 4))
+         ++sectionCount;
+   }
+   index->entries = (tIndexEntry *) ArenaCalloc(arena, index->count * sizeof(tIndexEntry) + 1);
+   section = (tIndexSection *) ArenaAlloc(arena, sectionCount * sizeof(tIndexSection) + 1);
+   if(NULL == index->entries || NULL == section)
+      return false;
+
+   index->count = 0;
+   for(line = strchr(text, '\n') + 1; '\0' != *line; line = end)
+   {
+      int used = 0;
+
+      end = line + strcspn(line, "\n");
+      if('\0' != *end)
+         *end++ = '\0';
+
+      if(0 == strncmp(line, "elf ", 4)
+         && 2 == sscanf(line + 4, "%lld %lld %n", &index->entries[index->count].mtime,
+            &index->entries[index->count].size, &used) && used > 0)
+      {
+         entry = &index->entries[index->count++];
+         entry->path = line + 4 + used;
+         entry->sections = section;
+         entry->indexed = true;
+      }
+      else if(0 == strncmp(line, "sec ", 4) && NULL != entry
+         && 4 == sscanf(line + 4, "%x %x %llx %llx %n", &section->address, &section->size,
+            (unsigned long long *) &section->hash, (unsigned long long *) &section->prefix, &used)
+         && used > 0)
+      {
+         section->name = line + 4 + used;
+         section->elf = index->count - 1;
+         ++entry->sectionCount;
+         ++section;
+      }
+      else if('\0' != *line)
+      {
+         ERROR("Bad index line in '%s': %s\n", indexFile, line);
+         return false;
+      }
+   }
+   return true;
+}
+
+// Write an index, to a temporary file that is renamed into place so a
+// concurrent lookup never sees a partial index. An unchanged index is left
+// alone.
+// Produces error message on failure (so caller doesn't need to).
+static bool WriteIndex(tIndex *index, const char *indexFile)
+{
+   char temp[INDEX_PATH_SIZE + 32];
+   bool success = true; // optimism
+   uint32_t i, j;
+   FILE *fd;
+
+   snprintf(temp, sizeof(temp), "%s.%lu.tmp", indexFile, (unsigned long) getpid());
+   fd = fopen(temp, "w");
+   if(NULL == fd)
+   {
+      ERROR("Failed to create index '%s'\n", temp);
+      return false;
+   }
+
+   DEPEND_OUTPUT(indexFile);
+   fprintf(fd, "%s\n", INDEX_MAGIC);
+   for(i = 0; i < index->count; ++i)
+   {
+      tIndexEntry *entry = &index->entries[i];
+      if(!entry->indexed)
+         continue;
+      fprintf(fd, "elf %lld %lld %s\n", entry->mtime, entry->size, entry->path);
+      for(j = 0; j < entry->sectionCount; ++j)
+      {
+         tIndexSection *section = &entry->sections[j];
+         fprintf(fd, "sec %08x %08x %016llx %016llx %s\n", section->address, section->size,
+            (unsigned long long) section->hash, (unsigned long long) section->prefix, section->name);
+      }
+   }
+
+   success = !ferror(fd);
+   success = (0 == fclose(fd)) && success;
+   if(success)
+      success = ReplaceIfChanged(temp, indexFile);
+   if(!success)
+   {
+      ERROR("Failed to write index '%s'\n", indexFile);
+      remove(temp);
+   }
+   return success;
+}
+
+static bool AddPath(tPathList *list, const char *path, tArena *arena)
+{
+   if(list->count == list->capacity)
+   {
+      char **larger;
+      list->capacity = (0 == list->capacity) ? 256 : list->capacity * 2;
+      larger = (char **) ArenaAlloc(arena, list->capacity * sizeof(char *));
+      if(NULL == larger)
+         return false;
+      if(list->count > 0)
+         memcpy(larger, list->paths, list->count * sizeof(char *));
+      list->paths = larger;
+   }
+   list->paths[list->count] = ArenaStrdup(arena, path);
+   return NULL != list->paths[list->count++];
+}
+
+// Add a file, or every file below a directory, to the list.
+// Produces error message on failure (so caller doesn't need to).
+static bool CollectPaths(tPathList *list, const char *path, uint32_t depth, tArena *arena)
+{
+   struct stat info;
+   bool success = true; // optimism
+
+   if(0 != stat(path, &info))
+   {
+      ERROR("Failed to find '%s'\n", path);
+      return false;
+   }
+   DEPEND_INPUT(path);  // a directory changes when files are added or removed
+   if(!S_ISDIR(info.st_mode))
+      return AddPath(list, path, arena);
+
+#ifdef WIN32
+   ERROR("Directories are not supported on this platform ('%s')\n", path);
+   success = false;
+#else
+   if(depth < INDEX_MAX_DEPTH)
+   {
+      struct dirent *item;
+      DIR *dir = opendir(path);
+      if(NULL == dir)
+      {
+         ERROR("Failed to open directory '%s'\n", path);
+         return false;
+      }
+      while(success && NULL != (item = readdir(dir)))
+      {
+         char child[INDEX_PATH_SIZE];
+         if('.' == item->d_name[0])
+            continue;  // also skips . and ..
+         if(snprintf(child, sizeof(child), "%s/%s", path, item->d_name) >= (int) sizeof(child))
+         {
+            ERROR("Path too long in '%s'\n", path);
+            success = false;
+         }
+         else
+         {
+            success = CollectPaths(list, child, depth + 1, arena);
+         }
+      }
+      closedir(dir);
+   }
+#endif
+   return success;
+}
+
+// Hash the sections of one ELF file that can go into an image (allocated,
+// with contents). Files that aren't ELF files are skipped silently, since
+// archives hold other files too.
+// Returns false only for a file that looks like an ELF file, but can't be read.
+static bool IndexElf(tIndexEntry *entry, tArena *results)
+{
+   static const char elfMagic[4] = { 0x7f, 'E', 'L', 'F' };
+   char magic[sizeof(elfMagic)];
+   MyElf_File *elf;
+   tArena *arena;
+   bool success = true; // optimism
+   uint32_t i;
+   FILE *fd;
+
+   fd = fopen(entry->path, "rb");
+   if(NULL == fd)
+      return false;
+   success = (sizeof(magic) == fread(magic, 1, sizeof(magic), fd));
+   fclose(fd);
+   if(!success || 0 != memcmp(magic, elfMagic, sizeof(elfMagic)))
+   {
+      DEBUG("%s: Skipping '%s'; not an ELF file\n", __func__, entry->path);
+      return true;
+   }
+
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return false;
+   TRACE_BEGIN_ARG("index elf", entry->path);
+   elf = LoadElf(entry->path, arena);
+   success = (NULL != elf);
+
+   if(success)
+   {
+      entry->sections = (tIndexSection *) ArenaAlloc(results,
+         (elf->header.e_shnum) * sizeof(tIndexSection));
+      success = (NULL != entry->sections);
+   }
+   for(i = 0; success && i + 1 < elf->header.e_shnum; ++i)
+   {
+      MyElf_Section *sect = &elf->sections[i];
+      tIndexSection *section = &entry->sections[entry->sectionCount];
+      uint8_t *data;
+
+      if(0 == (sect->flags & SHF_ALLOC) || SHT_NOBITS == sect->type || 0 == sect->size || 0 == sect->offset)
+         continue;
+      data = GetElfSectionData(elf, sect, 0);
+      section->name = ArenaStrdup(results, sect->name);
+      success = (NULL != data && NULL != section->name);
+      if(success)
+      {
+         section->address = sect->address;
+         section->size = sect->size;
+         section->hash = Hash64(data, sect->size, 0);
+         section->prefix = Hash64(data, (sect->size < INDEX_PREFIX_SIZE) ? sect->size : INDEX_PREFIX_SIZE, 0);
+         ++entry->sectionCount;
+      }
+   }
+   entry->indexed = success;
+
+   if(NULL != elf)
+      UnloadElf(elf);
+   TRACE_END("index elf");
+   ArenaRelease(arena);
+   return success;
+}
+
+static void* IndexWorker(void *parameter)
+{
+   tIndexWorker *worker = (tIndexWorker *) parameter;
+   tIndexJob *job = worker->job;
+
+   for(;;)
+   {
+      tIndexEntry *entry;
+#ifndef WIN32
+      pthread_mutex_lock(&job->lock);
+#endif
+      entry = (job->next < job->count) ? &job->entries[job->next++] : NULL;
+      while(NULL != entry && entry->indexed)
+         entry = (job->next < job->count) ? &job->entries[job->next++] : NULL;
+#ifndef WIN32
+      pthread_mutex_unlock(&job->lock);
+#endif
+      if(NULL == entry)
+         break;
+      if(!IndexElf(entry, worker->arena))
+      {
+         ERROR("Failed to index '%s'\n", entry->path);
+      }
+      else if(entry->indexed)
+      {
+         ++worker->indexed;
+      }
+   }
+   return NULL;
+}
+
+// Find the sections that start at 'data' (with 'length' bytes available),
+// optionally only those of one entry. Calls back with each one found, and
+// stops when the callback returns false.
+static void FindSections(tLookup *lookup, const uint8_t *data, uint32_t length, int32_t elf,
+   bool (*found)(tLookup *lookup, tIndexSection *section, const uint8_t *data, uint32_t length, void *context),
+   void *context)
+{
+   uint32_t prefixSize;
+
+   for(prefixSize = 1; prefixSize <= INDEX_PREFIX_SIZE && prefixSize <= length; ++prefixSize)
+   {
+      uint64_t lastHash = 0;
+      uint32_t lastSize = 0;
+      uint64_t prefix;
+      uint32_t low = 0, high = lookup->sectionCount;
+
+      if(prefixSize < INDEX_PREFIX_SIZE && !lookup->smallSize[prefixSize])
+         continue;
+      prefix = Hash64(data, prefixSize, 0);
+
+      while(low < high)  // first section with this prefix hash
+      {
+         uint32_t middle = low + (high - low) / 2;
+         if(lookup->byPrefix[middle]->prefix < prefix)
+            low = middle + 1;
+         else
+            high = middle;
+      }
+
+      for(; low < lookup->sectionCount && lookup->byPrefix[low]->prefix == prefix; ++low)
+      {
+         tIndexSection *section = lookup->byPrefix[low];
+         if(section->size > length || (elf >= 0 && section->elf != (uint32_t) elf))
+            continue;
+         if(section->size != lastSize)  // archived builds often share sections
+         {
+            lastSize = section->size;
+            lastHash = Hash64(data, section->size, 0);
+         }
+         if(lastHash == section->hash && !found(lookup, section, data, length, context))
+            return;
+      }
+   }
+}
+
+static bool FoundNext(tLookup *lookup, tIndexSection *section, const uint8_t *data, uint32_t length,
+   void *context)
+{
+   *((tIndexSection **) context) = section;
+   return false;
+}
+
+// A segment can hold several sections of one ELF file back to back (the ROM
+// sections). Returns the number of bytes covered by 'first' and the sections
+// of the same ELF file that follow it.
+static uint32_t MatchChain(tLookup *lookup, tIndexSection *first, const uint8_t *data, uint32_t length)
+{
+   uint32_t covered = first->size;
+
+   while(covered < length)
+   {
+      tIndexSection *next = NULL;
+      FindSections(lookup, data + covered, length - covered, first->elf, FoundNext, &next);
+      if(NULL == next)
+         break;
+      covered += next->size;
+   }
+   return covered;
+}
+
+static bool FoundFirst(tLookup *lookup, tIndexSection *section, const uint8_t *data, uint32_t length,
+   void *context)
+{
+   uint32_t segment = *((uint32_t *) context);
+   uint32_t covered = MatchChain(lookup, section, data, length);
+   uint32_t elf = section->elf;
+
+   if(lookup->stamp[elf] != segment + 1)
+   {
+      lookup->stamp[elf] = segment + 1;
+      lookup->best[elf] = 0;
+   }
+   if(covered > lookup->best[elf])
+   {
+      if(length - lookup->best[elf] >= SECTION_PADDING && length - covered < SECTION_PADDING)
+         ++lookup->segments[elf];  // padding is all that isn't covered
+      lookup->matched[elf] += covered - lookup->best[elf];
+      lookup->best[elf] = covered;
+   }
+   return true;
+}
+
+// Address zero segments filled with one value are padding (ESP32) or filler (zboot)
+static bool IsFillerSegment(const uint8_t *data, tImageSegment *segment)
+{
+   uint32_t i;
+
+   if(0 != segment->address)
+      return false;
+   for(i = 1; i < segment->size; ++i)
+      if(data[segment->offset + i] != data[segment->offset])
+         return false;
+   return true;
+}
+
+// Fill records (see ZBOOT_SECTION_FILL) split a zboot section into records
+// at contiguous addresses. Join the records from 'first' on back into the
+// section contents, so the section can be matched whole. Returns the
+// number of segments joined (one if the segment isn't split), or zero if
+// out of memory.
+static uint32_t JoinRecords(tImageInfo *image, uint32_t first, const uint8_t *data, const uint8_t **bytes,
+   uint32_t *size, tArena *arena)
+{
+   tImageSegment *segments = image->segments;
+   uint32_t last = first + 1;
+   uint32_t fills = segments[first].fill;
+   uint32_t offset = 0;
+   uint8_t *joined;
+   uint32_t i, j;
+
+   *bytes = data + segments[first].offset;
+   *size = segments[first].size;
+   while(last < image->count && 0 != segments[first].address
+      && segments[last].address == segments[last - 1].address + segments[last - 1].size)
+   {
+      *size += segments[last].size;
+      fills += segments[last++].fill;
+   }
+   if(0 == fills)
+   {
+      *size = segments[first].size;
+      return 1;
+   }
+
+   joined = (uint8_t *) ArenaAlloc(arena, *size);
+   if(NULL == joined)
+      return 0;
+   for(i = first; i < last; ++i)
+   {
+      if(!segments[i].fill)
+         memcpy(joined + offset, data + segments[i].offset, segments[i].size);
+      for(j = 0; segments[i].fill && j < segments[i].size; j += sizeof(uint32_t))
+         memcpy(joined + offset + j, data + segments[i].offset, sizeof(uint32_t));
+      offset += segments[i].size;
+   }
+   *bytes = joined;
+   return last - first;
+}
+
+static tLookup *sortLookup;  // qsort has no context parameter
+
+static int CompareMatch(const void *a, const void *b)
+{
+   uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+   if(sortLookup->segments[x] != sortLookup->segments[y])
+      return (sortLookup->segments[x] < sortLookup->segments[y]) ? 1 : -1;
+   if(sortLookup->matched[x] != sortLookup->matched[y])
+      return (sortLookup->matched[x] < sortLookup->matched[y]) ? 1 : -1;
+   return strcmp(sortLookup->index->entries[x].path, sortLookup->index->entries[y].path);
+}
+
+// --------------------------------------------------------------------------------
+// Operations
+
+// Add ELF files (and all the ELF files below directories) to an index, and
+// drop entries for files that are no longer there. The files already in the
+// index stay in it; those whose modification time and size match their
+// index entry are not read again, so re-indexing a growing archive only
+// reads the new files. Files are indexed in parallel
+// by 'threads' workers (zero for one per processor).
+// Produces error message on failure (so caller doesn't need to).
+bool IndexElfFiles(char *indexFile, char *paths[], uint32_t pathCount, uint32_t threads)
+{
+   tIndexWorker workers[INDEX_MAX_THREADS];
+   tIndexEntry **previous = NULL;
+   tPathList list;
+   tIndexJob job;
+   tIndex index, old;
+   tArena *arena = NULL;
+   bool success = true; // optimism
+   uint32_t reused = 0;
+   uint32_t i;
+
+   memset(&list, 0, sizeof(list));
+   memset(&job, 0, sizeof(job));
+   memset(workers, 0, sizeof(workers));
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return false;
+
+   success = ReadIndex(&old, indexFile, false, arena);
+   for(i = 0; success && i < pathCount; ++i)
+      success = CollectPaths(&list, paths[i], 0, arena);
+   for(i = 0; success && i < old.count; ++i)
+      success = AddPath(&list, old.entries[i].path, arena);  // dropped below if missing
+
+   // Entries are kept sorted by path, so the index doesn't depend on the
+   // order of directory listings
+   if(success && list.count > 0)
+      qsort(list.paths, list.count, sizeof(char *), ComparePath);
+   if(success)
+   {
+      index.count = 0;
+      index.entries = (tIndexEntry *) ArenaCalloc(arena, list.count * sizeof(tIndexEntry) + 1);
+      previous = (tIndexEntry **) ArenaAlloc(arena, old.count * sizeof(tIndexEntry *) + 1);
+      success = (NULL != index.entries && NULL != previous);
+   }
+   if(success)
+   {
+      for(i = 0; i < old.count; ++i)
+         previous[i] = &old.entries[i];
+      qsort(previous, old.count, sizeof(tIndexEntry *), CompareEntryPath);
+   }
+
+   for(i = 0; success && i < list.count; ++i)
+   {
+      tIndexEntry *entry = &index.entries[index.count];
+      tIndexEntry **match;
+      struct stat info;
+
+      if(i > 0 && 0 == strcmp(list.paths[i], list.paths[i - 1]))
+         continue;  // named twice
+      if(0 != stat(list.paths[i], &info))
+         continue;
+      ++index.count;
+      entry->path = list.paths[i];
+      entry->mtime = (long long) info.st_mtime;
+      entry->size = (long long) info.st_size;
+      match = (tIndexEntry **) bsearch(&entry, previous, old.count, sizeof(tIndexEntry *), CompareEntryPath);
+      if(NULL != match && (*match)->mtime == entry->mtime && (*match)->size == entry->size)
+      {
+         entry->sections = (*match)->sections;
+         entry->sectionCount = (*match)->sectionCount;
+         entry->indexed = true;
+         ++reused;
+      }
+   }
+
+   if(success)
+   {
+      uint32_t count = threads;
+#ifdef WIN32
+      count = 1;
+#else
+      if(0 == count)
+      {
+         long processors = sysconf(_SC_NPROCESSORS_ONLN);
+         count = (processors > 0) ? (uint32_t) processors : 1;
+      }
+#endif
+      if(count > INDEX_MAX_THREADS)
+         count = INDEX_MAX_THREADS;
+      if(count > index.count - reused)
+         count = (index.count - reused > 0) ? index.count - reused : 1;
+      DEBUG("%s: %u file(s), %u unchanged, %u worker(s)\n", __func__, index.count, reused, count);
+
+      job.entries = index.entries;
+      job.count = index.count;
+      for(i = 0; success && i < count; ++i)
+      {
+         workers[i].job = &job;
+         workers[i].arena = ArenaCreate(0);
+         success = (NULL != workers[i].arena);
+      }
+#ifdef WIN32
+      if(success)
+         IndexWorker(&workers[0]);
+#else
+      pthread_mutex_init(&job.lock, NULL);
+      for(i = 1; success && i < count; ++i)
+      {
+         if(0 != pthread_create(&workers[i].thread, NULL, IndexWorker, &workers[i]))
+         {
+            ERROR("Failed to start index worker\n");
+            break;
+         }
+      }
+      count = i;
+      if(success)
+         IndexWorker(&workers[0]);  // this thread works too
+      for(i = 1; i < count; ++i)
+         pthread_join(workers[i].thread, NULL);
+      pthread_mutex_destroy(&job.lock);
+#endif
+   }
+
+   if(success)
+      success = WriteIndex(&index, indexFile);
+   if(success)
+   {
+      uint32_t indexed = 0;
+      for(i = 0; i < INDEX_MAX_THREADS; ++i)
+         indexed += workers[i].indexed;
+      PRINT("Indexed %u ELF file(s) in '%s' (%u new or changed)\n", reused + indexed, indexFile, indexed);
+   }
+
+   for(i = 0; i < INDEX_MAX_THREADS; ++i)
+      if(NULL != workers[i].arena)
+         ArenaRelease(workers[i].arena);
+   ArenaRelease(arena);
+   return success;
+}
+
+// Find the ELF files in an index that produced an image. Every segment of
+// the image (other than padding) is matched against the indexed sections,
+// with zboot fill records joined back into their sections first; an ELF
+// file matches when its sections account for every segment. The
+// result lists complete matches, then the best partial matches:
+//    match <path>
+//    partial <bytes matched>/<image bytes> <path>
+// Produces error message on failure (so caller doesn't need to).
+bool LookupImage(char *indexFile, char *imageFile, char *outFile)
+{
+   tImageInfo image;
+   tLookup lookup;
+   tIndex index;
+   tWriter writer;
+   tArena *arena = NULL;
+   uint32_t *order = NULL;
+   uint32_t imageSize = 0;
+   uint32_t segmentCount = 0;
+   uint32_t total = 0;
+   uint32_t found = 0;
+   uint8_t *data = NULL;
+   bool success = true; // optimism
+   uint32_t i, j;
+
+   memset(&lookup, 0, sizeof(lookup));
+   WriterInit(&writer, NULL);
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return false;
+
+   TRACE_BEGIN("read index");
+   success = ReadIndex(&index, indexFile, true, arena);
+   TRACE_END("read index");
+   if(success)
+   {
+      data = ReadImageFile(imageFile, &imageSize, arena);
+      success = (NULL != data);
+   }
+   if(success && !ParseImage(data, imageSize, &image, arena))
+   {
+      ERROR("'%s' is not a recognized image\n", imageFile);
+      success = false;
+   }
+   if(success && !image.checksumValid)
+      ERROR("Warning: Image '%s' has a bad checksum\n", imageFile);
+
+   // Table of all sections, by prefix hash
+   if(success)
+   {
+      lookup.index = &index;
+      for(i = 0; i < index.count; ++i)
+         lookup.sectionCount += index.entries[i].sectionCount;
+      lookup.byPrefix = (tIndexSection **) ArenaAlloc(arena, lookup.sectionCount * sizeof(tIndexSection *) + 1);
+      lookup.stamp = (uint32_t *) ArenaCalloc(arena, 4 * index.count * sizeof(uint32_t) + 1);
+      order = (uint32_t *) ArenaAlloc(arena, index.count * sizeof(uint32_t) + 1);
+      success = (NULL != lookup.byPrefix && NULL != lookup.stamp && NULL != order);
+   }
+   if(success)
+   {
+      uint32_t k = 0;
+      lookup.best = lookup.stamp + index.count;
+      lookup.matched = lookup.best + index.count;
+      lookup.segments = lookup.matched + index.count;
+      for(i = 0; i < index.count; ++i)
+      {
+         for(j = 0; j < index.entries[i].sectionCount; ++j)
+         {
+            tIndexSection *section = &index.entries[i].sections[j];
+            lookup.byPrefix[k++] = section;
+            if(section->size < INDEX_PREFIX_SIZE)
+               lookup.smallSize[section->size] = true;
+         }
+      }
+      qsort(lookup.byPrefix, lookup.sectionCount, sizeof(tIndexSection *), ComparePrefix);
+   }
+
+   for(i = 0; success && i < image.count; i += j)
+   {
+      const uint8_t *bytes;
+      uint32_t size;
+
+      j = JoinRecords(&image, i, data, &bytes, &size, arena);
+      if(0 == j)
+      {
+         ERROR("Failed to allocate memory for segment %u\n", i);
+         success = false;
+      }
+      else if(0 != size && (j > 1 || image.segments[i].fill || !IsFillerSegment(data, &image.segments[i])))
+      {
+         TRACE_BEGIN("match segment");
+         FindSections(&lookup, bytes, size, -1, FoundFirst, &i);
+         TRACE_END("match segment");
+         total += size;
+         ++segmentCount;
+      }
+   }
+
+   if(success)
+   {
+      for(i = 0; i < index.count; ++i)
+         if(lookup.matched[i] > 0)
+            order[found++] = i;
+      sortLookup = &lookup;
+      qsort(order, found, sizeof(uint32_t), CompareMatch);
+      success = WriterOpen(&writer, (NULL != outFile) ? outFile : "-", false);
+   }
+   if(success)
+   {
+      uint32_t partial = 0;
+      for(i = 0; i < found; ++i)
+      {
+         tIndexEntry *entry = &index.entries[order[i]];
+         if(lookup.segments[order[i]] == segmentCount)
+            fprintf(writer.fd, "match %s\n", entry->path);
+         else if(partial++ < INDEX_PARTIAL_REPORT)
+            fprintf(writer.fd, "partial %u/%u %s\n", lookup.matched[order[i]], total, entry->path);
+      }
+      success = WriterClose(&writer);
+      if(success && (0 == found || lookup.segments[order[0]] != segmentCount))
+      {
+         ERROR("No ELF file in '%s' matches all of '%s'\n", indexFile, imageFile);
+         success = false;
+      }
+   }
+
+   ArenaRelease(arena);
+   return success;
+}
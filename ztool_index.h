@@ -0,0 +1,45 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_INDEX_H
+#define ZTOOL_INDEX_H
+
+#include "ztool.h"
+
+// Image provenance index. Records, for every ELF file in an archive, the
+// contents hash of each section that can end up in an image, so the ELF
+// file(s) that produced a given image can be found quickly. The index is a
+// text file:
+//    ztool-index 1
+//    elf <mtime> <size> <path>
+//    sec <address> <size> <hash> <prefix hash> <name>   (one per section)
+// The prefix hash covers the first INDEX_PREFIX_SIZE bytes of a section. It
+// lets a lookup find sections at any offset of an image segment, so
+// sections that were concatenated into one ROM segment are found too.
+
+#define INDEX_MAGIC       "ztool-index 1"
+#define INDEX_PREFIX_SIZE 64
+
+bool IndexElfFiles(char *indexFile, char *paths[], uint32_t pathCount, uint32_t threads);
+bool LookupImage(char *indexFile, char *imageFile, char *outFile);
+
+#endif /* ZTOOL_INDEX_H */
@@ -0,0 +1,357 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_arena.h"
+#include "ztool_elf.h"
+#include "ztool_image.h"
+#include "ztool_iram.h"
+#include "ztool_write.h"
+
+// Addresses are copied out of the symbol, so the sample lookups (a binary
+// search per sample) don't chase symbol pointers.
+typedef struct
+{
+   uint32_t      address;
+   uint32_t      length;  // function size in the symbol table
+   MyElf_Symbol *sym;
+   uint32_t      literal; // bytes of the literal pool before the function
+   uint32_t      size;    // bytes the function and its literals take in IRAM (padded)
+   uint64_t      hits;
+   bool          rom;     // in a ROM section, so a candidate for IRAM
+} tIramFunction;
+
+typedef struct
+{
+   uint32_t      pc;
+   uint32_t      hits;
+} tIramSample;
+
+// --------------------------------------------------------------------------------
+// Helper Functions
+
+static uint32_t AlignUp(uint32_t size, uint32_t align)
+{
+   return (size + align - 1) & ~(align - 1);
+}
+
+static int CompareFunctionByAddress(const void *a, const void *b)
+{
+   const tIramFunction *fa = (const tIramFunction *) a;
+   const tIramFunction *fb = (const tIramFunction *) b;
+   if(fa->address != fb->address)
+      return (fa->address < fb->address) ? -1 : 1;
+   if(fa->length != fb->length)
+      return (fa->length > fb->length) ? -1 : 1;
+   return 0;
+}
+
+// Hottest per byte first; hits/size compared by cross multiplication, so
+// there is no rounding.
+static int CompareFunctionByHotness(const void *a, const void *b)
+{
+   const tIramFunction *fa = (const tIramFunction *) a;
+   const tIramFunction *fb = (const tIramFunction *) b;
+   uint64_t ha = fa->hits * fb->size;
+   uint64_t hb = fb->hits * fa->size;
+   if(ha != hb)
+      return (ha > hb) ? -1 : 1;
+   if(fa->hits != fb->hits)
+      return (fa->hits > fb->hits) ? -1 : 1;
+   return strcmp(fa->sym->name, fb->sym->name);
+}
+
+// Index of the function containing 'address' in the address-sorted table,
+// or 'count' if no function contains it.
+static uint32_t FindFunction(tIramFunction *functions, uint32_t count, uint32_t address)
+{
+   uint32_t lo = 0, hi = count;
+   while(lo < hi)
+   {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if(functions[mid].address <= address) lo = mid + 1; else hi = mid;
+   }
+   // lo is the first function starting after 'address'; walk back over any
+   // functions nested inside a larger one
+   while(lo > 0)
+   {
+      tIramFunction *f = &functions[--lo];
+      if(address - f->address < f->length)
+         return lo;
+      if(0 == lo || functions[lo - 1].address + functions[lo - 1].length <= f->address)
+         break;
+   }
+   return count;
+}
+
+// The linker places each function's .literal.<fn> input section just before
+// its .text.<fn>, and neither has a symbol for the pool, so the gap between
+// the end of the previous function in the section (or the section start)
+// and a function is taken as its literal pool. Alignment padding is counted
+// with it, so the size moved to IRAM is overestimated, never underestimated.
+// The functions must be sorted by address.
+static void CountLiterals(MyElf_File *elf, tIramFunction *functions, uint32_t count)
+{
+   uint32_t end = 0;
+   uint32_t i;
+
+   for(i = 0; i < count; ++i)
+   {
+      tIramFunction *f = &functions[i];
+      if(0 == i || functions[i - 1].sym->shndx != f->sym->shndx)
+      {
+         MyElf_Section *section = GetElfSectionByIndex(elf, f->sym->shndx);
+         end = (NULL != section) ? section->address : f->address;
+      }
+      f->literal = (f->address > end) ? f->address - end : 0;
+      f->size = AlignUp(f->literal + f->length, SECTION_PADDING);
+      if(f->address + f->length > end)
+         end = f->address + f->length;
+   }
+}
+
+// Bytes of IRAM taken by the sections that CreateZbootFile loads there
+static uint32_t IramUsed(MyElf_File *elf, char *otherSectionList[], uint32_t otherSectionCount, uint32_t iramSize)
+{
+   uint32_t used = 0;
+   uint32_t i;
+
+   for(i = 0; i < otherSectionCount; ++i)
+   {
+      MyElf_Section *section = GetElfSection(elf, otherSectionList[i]);
+      if(NULL != section && section->address >= IRAM_START && section->address - IRAM_START < iramSize)
+         used += AlignUp(section->size, SECTION_PADDING);
+   }
+   return used;
+}
+
+static int CompareSampleByAddress(const void *a, const void *b)
+{
+   const tIramSample *sa = (const tIramSample *) a;
+   const tIramSample *sb = (const tIramSample *) b;
+   return (sa->pc < sb->pc) ? -1 : (sa->pc > sb->pc);
+}
+
+// Parse the sample file into 'samples' (one entry per line, at most).
+// Returns the number of samples read.
+static uint32_t ParseSamples(char *text, tIramSample *samples)
+{
+   uint32_t count = 0;
+   char *line = text;
+
+   while('\0' != *line)
+   {
+      char *next = line + strcspn(line, "\n");
+      char *end;
+
+      if('\n' == *next)
+         *next++ = '\0';
+      line += strspn(line, " \t");
+      if('\0' == *line || '#' == *line)
+      {
+         line = next;
+         continue;
+      }
+      samples[count].pc = (uint32_t) strtoul(line, &end, 16);
+      samples[count].hits = 1;
+      if(end != line)
+      {
+         line = end;
+         if(' ' == *line || '\t' == *line)
+         {
+            samples[count].hits = strtoul(line, &end, 10);
+            if(end == line)
+               samples[count].hits = 1;
+         }
+         count++;
+      }
+      line = next;
+   }
+   return count;
+}
+
+// Add the samples to the functions they hit. The samples are sorted first,
+// so the function table is walked in address order (which keeps the lookups
+// in cache) and runs of samples in one function need no lookup at all.
+// Returns the total number of hits.
+static uint64_t CountSamples(tIramSample *samples, uint32_t sampleCount, tIramFunction *functions,
+   uint32_t count, uint64_t *unmatched)
+{
+   uint64_t total = 0;
+   uint32_t index = count;
+   uint32_t i;
+
+   qsort(samples, sampleCount, sizeof(tIramSample), CompareSampleByAddress);
+   *unmatched = 0;
+   for(i = 0; i < sampleCount; ++i)
+   {
+      uint32_t pc = samples[i].pc;
+      if(index >= count || pc - functions[index].address >= functions[index].length)
+         index = FindFunction(functions, count, pc);
+      if(index < count)
+         functions[index].hits += samples[i].hits;
+      else
+         *unmatched += samples[i].hits;
+      total += samples[i].hits;
+   }
+   return total;
+}
+
+// --------------------------------------------------------------------------------
+// Operations
+
+// Rank the functions of an ELF file by sampled hits per byte and write a
+// linker-script fragment that moves the hottest ROM functions that fit in
+// the remaining IRAM (iramSize less the IRAM sections in the other section
+// list) into IRAM. Candidates are the functions in the ROM section list.
+// Each function is counted with its literal pool (see CountLiterals), as
+// both move. The fragment names the input sections that -ffunction-sections gives each
+// function, for inclusion in the IRAM output section (.text) of the linker
+// script. Fragment goes to outFile, or stdout if NULL.
+// Produces error message on failure (so caller doesn't need to).
+bool CreateIramAdvice(char *inFile, char *sampleFile, char *outFile, uint32_t iramSize,
+   char *romSectionList[], uint32_t romSectionCount,
+   char *otherSectionList[], uint32_t otherSectionCount)
+{
+   tIramFunction *functions = NULL;
+   uint32_t functionCount = 0;
+   uint32_t romIndex[romSectionCount + 1];
+   uint64_t total, unmatched, romHits = 0, movedHits = 0;
+   uint32_t used, free, moved = 0, movedBytes = 0;
+   MyElf_File *elf = NULL;
+   tArena *arena = NULL;
+   char *samples;
+   uint32_t sampleSize, sampleCount, lines;
+   tIramSample *sampleTable = NULL;
+   tWriter writer;
+   FILE *out = stdout;
+   uint32_t i, j;
+   bool success = true; // optimism
+
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return false;
+
+   elf = LoadElf(inFile, arena);
+   if(NULL == elf)
+   {
+      ERROR("Failed to open ELF file '%s'\n", inFile);
+      success = false;
+   }
+   else if(!LoadElfSymbols(elf))
+   {
+      success = false;
+   }
+   else
+   {
+      samples = (char *) ReadImageFile(sampleFile, &sampleSize, arena);
+      functions = (tIramFunction *) ArenaAlloc(arena, (elf->symbolCount + 1) * sizeof(tIramFunction));
+      if(NULL == samples)
+      {
+         success = false;
+      }
+      else
+      {
+         for(i = 0, lines = 1; i < sampleSize; ++i)
+            lines += ('\n' == samples[i]);
+         sampleTable = (tIramSample *) ArenaAlloc(arena, lines * sizeof(tIramSample));
+      }
+      if(success && (NULL == functions || NULL == sampleTable))
+      {
+         ERROR("Failed to allocate memory for %u symbols and %u samples\n", elf->symbolCount, lines);
+         success = false;
+      }
+   }
+
+   if(success)
+   {
+      for(i = 0; i < romSectionCount; ++i)
+      {
+         MyElf_Section *section = GetElfSection(elf, romSectionList[i]);
+         romIndex[i] = (NULL == section) ? 0 : (uint32_t) (section - elf->sections) + 1;
+      }
+      for(i = 0; i < elf->symbolCount; ++i)
+      {
+         MyElf_Symbol *sym = &elf->symbols[i];
+         if(STT_FUNC != sym->type || 0 == sym->size || SHN_UNDEF == sym->shndx || sym->shndx >= SHN_LORESERVE)
+            continue;
+         functions[functionCount].address = sym->value;
+         functions[functionCount].length = sym->size;
+         functions[functionCount].sym = sym;
+         functions[functionCount].hits = 0;
+         functions[functionCount].rom = false;
+         for(j = 0; j < romSectionCount; ++j)
+            functions[functionCount].rom |= (romIndex[j] == sym->shndx);
+         functionCount++;
+      }
+      qsort(functions, functionCount, sizeof(tIramFunction), CompareFunctionByAddress);
+      CountLiterals(elf, functions, functionCount);
+
+      sampleCount = ParseSamples(samples, sampleTable);
+      total = CountSamples(sampleTable, sampleCount, functions, functionCount, &unmatched);
+      qsort(functions, functionCount, sizeof(tIramFunction), CompareFunctionByHotness);
+
+      used = IramUsed(elf, otherSectionList, otherSectionCount, iramSize);
+      free = (used < iramSize) ? iramSize - used : 0;
+
+      WriterInit(&writer, NULL);
+      if(NULL != outFile)
+      {
+         success = WriterOpen(&writer, outFile, false);
+         out = writer.fd;
+      }
+   }
+
+   if(success)
+   {
+      fprintf(out, "/* IRAM placement for %s from %llu sample(s) (%llu outside any function)\n",
+         inFile, (unsigned long long) total, (unsigned long long) unmatched);
+      fprintf(out, "   IRAM %u bytes, %u used, %u free\n", iramSize, used, free);
+      fprintf(out, "   Include inside the IRAM output section; objects must be built with\n"
+                   "   -ffunction-sections. */\n");
+      for(i = 0; i < functionCount && functions[i].hits > 0; ++i)
+      {
+         tIramFunction *f = &functions[i];
+         if(!f->rom)
+            continue;
+         romHits += f->hits;
+         if(f->size > free - movedBytes)
+            continue;  // a smaller, less hot function may still fit
+         fprintf(out, "*(.literal.%s .text.%s) /* %llu hits, %u bytes (%u of literals) */\n",
+            f->sym->name, f->sym->name, (unsigned long long) f->hits, f->size, f->literal);
+         movedBytes += f->size;
+         movedHits += f->hits;
+         moved++;
+      }
+      fprintf(out, "/* %u function(s), %u bytes: %llu of %llu ROM sample(s) */\n",
+         moved, movedBytes, (unsigned long long) movedHits, (unsigned long long) romHits);
+      success = WriterClose(&writer);
+   }
+
+   UnloadElf(elf);
+   ArenaRelease(arena);
+   return success;
+}
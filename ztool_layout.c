@@ -0,0 +1,1237 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_arena.h"
+#include "ztool_elf.h"
+#include "ztool_image.h"
+#include "ztool_layout.h"
+#include "ztool_trace.h"
+#include "ztool_write.h"
+
+#define LAYOUT_CHECKSUM_XOR8  1
+#define LAYOUT_CHECKSUM_SUM32 2
+#define LAYOUT_MAX_TOKENS     16
+#define LAYOUT_PAD_BYTE       0xa5
+
+#define STRINGIFY(x)  #x
+#define XSTRINGIFY(x) STRINGIFY(x)
+
+typedef enum
+{
+   LAYOUT_STEP_FIELD,
+   LAYOUT_STEP_STRING,
+   LAYOUT_STEP_TABLE,
+   LAYOUT_STEP_DATA,
+   LAYOUT_STEP_ALIGN
+} eLayoutStep;
+
+// Values of fields and table columns; the order matches valueNames
+typedef enum
+{
+   LAYOUT_VALUE_NUMBER,
+   LAYOUT_VALUE_COUNT,
+   LAYOUT_VALUE_ENTRY,
+   LAYOUT_VALUE_FLASH_MODE,
+   LAYOUT_VALUE_FLASH_CONFIG,
+   LAYOUT_VALUE_VERSION,
+   LAYOUT_VALUE_DATE,
+   LAYOUT_VALUE_CHECKSUM,
+   LAYOUT_VALUE_ROMALIGN,
+   LAYOUT_VALUE_ADDRESS,      // table columns from here on
+   LAYOUT_VALUE_SIZE,
+   LAYOUT_VALUE_OFFSET,
+   LAYOUT_VALUE_SEGMENT_CHECKSUM
+} eLayoutValue;
+
+static const char *valueNames[] =
+{
+   NULL, "count", "entry", "flash_mode", "flash_config", "version", "date", "checksum", "romalign"
+};
+static const char *columnNames[] =
+{
+   "address", "size", "offset", "checksum"
+};
+
+typedef struct
+{
+   uint8_t  type;          // eLayoutStep
+   uint8_t  width;         // bytes in a field
+   uint8_t  value;         // eLayoutValue of a field
+   uint8_t  fill;
+   bool     headed;        // data: address and size before each segment
+   bool     fillRecords;   // data: runs of one byte value may become fill records
+   uint32_t number;        // field constant, string length or align multiple
+   uint32_t reserve;       // align: bytes to leave room for
+   uint8_t  columns[LAYOUT_MAX_COLUMNS];
+   uint32_t columnCount;
+} tLayoutStep;
+
+typedef struct
+{
+   bool     rom;           // all ROM sections in one segment; otherwise one per section
+   bool     setAddress;
+   bool     skipEmpty;
+   uint8_t  fill;
+   uint8_t  alignValue;    // LAYOUT_VALUE_NUMBER or LAYOUT_VALUE_ROMALIGN
+   uint32_t align;
+   uint32_t address;
+   uint32_t pad;
+} tLayoutGroup;
+
+struct tLayout
+{
+   const char  *name;
+   uint8_t      checksum;  // LAYOUT_CHECKSUM_XOR8 or LAYOUT_CHECKSUM_SUM32
+   bool         overData;  // checksum covers the segment data only
+   uint32_t     init;
+   bool         hasTable;
+   bool         hasData;
+   bool         headed;
+   bool         fillRecords;
+   uint32_t     groupCount;
+   tLayoutGroup groups[LAYOUT_MAX_GROUPS];
+   uint32_t     stepCount;
+   tLayoutStep  steps[LAYOUT_MAX_STEPS];
+};
+
+// One segment of an image being placed
+typedef struct
+{
+   tSectionData        data;
+   const char         *name;     // section name, or ROM section names joined with '+'
+   const tLayoutGroup *group;
+   uint32_t            offset;   // of the data in the image
+   uint32_t            sum;      // sum32 of the data
+} tLayoutSegment;
+
+typedef enum
+{
+   LAYOUT_CHUNK_BYTES,
+   LAYOUT_CHUNK_FILL,
+   LAYOUT_CHUNK_DATA
+} eLayoutChunk;
+
+// The placed image is a list of chunks, written in order. Literal bytes
+// (fields, tables, segment headers) are allocated in image order from one
+// buffer, so neighbouring literals go to the writer in a single call.
+typedef struct
+{
+   uint8_t            kind;      // eLayoutChunk
+   uint8_t            fill;
+   bool               checksum;  // the image checksum field, left out of the checksum
+   uint32_t           offset;
+   uint32_t           length;
+   uint8_t           *bytes;
+   const tLayoutStep *step;      // field or table to resolve once the image is placed
+   tLayoutSegment    *segment;
+   uint32_t           from;      // data: offset in the segment data
+   uint32_t           words;     // fill record pattern: words of data it stands for
+} tLayoutChunk;
+
+typedef struct
+{
+   tLayoutChunk   *chunks;
+   uint32_t        chunkCount;
+   uint8_t        *bytes;
+   uint32_t        byteCount;
+   tLayoutSegment *segments;
+   uint32_t        segmentCount;
+   uint32_t        fillers;      // filler segments added for alignment
+   uint32_t        records;      // records added by splitting segments at fill runs
+   uint32_t        fillRecords;
+   uint32_t        fillBytes;    // of segment data replaced by fill records
+   uint32_t        offset;
+   tStableLayout  *stable;       // optional; keep segments where the last build put them
+} tLayoutPlan;
+
+// Built-in specs for the formats ztool has always written; CreateBinFile and
+// CreateZbootFile use these, and they are a starting point for new formats
+static const struct
+{
+   const char *name;
+   const char *spec;
+} builtinLayouts[] =
+{
+   { "bin",
+     "# ESP8266 boot ROM image\n"
+     "checksum xor8 init " XSTRINGIFY(CHECKSUM_INIT) " over data\n"
+     "segment rom address 0 pad " XSTRINGIFY(SECTION_PADDING) "\n"
+     "segment other pad " XSTRINGIFY(SECTION_PADDING) "\n"
+     "u8 " XSTRINGIFY(BIN_MAGIC_FLASH) "\n"
+     "u8 count\n"
+     "u8 flash_mode\n"
+     "u8 flash_config\n"
+     "u32 entry\n"
+     "data headed\n"
+     "align " XSTRINGIFY(IMAGE_PADDING) " fill 0 reserve 1\n"
+     "u8 checksum\n" },
+   { "zboot",
+     "# zboot image, with a header before each section\n"
+     "checksum sum32\n"
+     "segment rom address 0 pad " XSTRINGIFY(SECTION_PADDING) " align romalign fill 0xff\n"
+     "segment other pad " XSTRINGIFY(SECTION_PADDING) "\n"
+     "u32 " XSTRINGIFY(ZBOOT_MAGIC) "\n"
+     "u32 count\n"
+     "u32 entry\n"
+     "u32 version\n"
+     "u32 date\n"
+     "u32 0\n"
+     "u32 0\n"
+     "u32 0\n"
+     "string 88 description\n"
+     "data headed fill-records\n"
+     "u32 checksum\n" },
+   { "zboot2",
+     "# zboot v2 (indexed) image, with a section table after the header\n"
+     "checksum sum32\n"
+     "segment rom address 0 pad " XSTRINGIFY(SECTION_PADDING) " align romalign fill 0xff skip-empty\n"
+     "segment other pad " XSTRINGIFY(SECTION_PADDING) " skip-empty\n"
+     "u32 " XSTRINGIFY(ZBOOT_MAGIC_V2) "\n"
+     "u32 count\n"
+     "u32 entry\n"
+     "u32 version\n"
+     "u32 date\n"
+     "u32 0\n"
+     "u32 0\n"
+     "u32 0\n"
+     "string 88 description\n"
+     "table address size offset checksum\n"
+     "data\n"
+     "u32 checksum\n" }
+};
+
+// --------------------------------------------------------------------------------
+// Helper Functions
+
+// 32-bit sum of little endian words, for data at image 'offset'; bytes of
+// words that are only partly in the data count in their place in the word
+static uint32_t Sum32(uint32_t sum, uint32_t offset, const uint8_t *data, uint32_t length)
+{
+   uint32_t i = 0;
+
+   for(; i < length && 0 != (offset + i) % sizeof(uint32_t); ++i)
+      sum += (uint32_t) data[i] << (8 * ((offset + i) % sizeof(uint32_t)));
+   for(; i + sizeof(uint32_t) <= length; i += sizeof(uint32_t))
+   {
+      uint32_t word;
+      memcpy(&word, data + i, sizeof(word));
+      sum += word;
+   }
+   for(; i < length; ++i)
+      sum += (uint32_t) data[i] << (8 * ((offset + i) % sizeof(uint32_t)));
+   return sum;
+}
+
+static uint32_t FillSum32(uint32_t sum, uint32_t offset, uint8_t fill, uint32_t length)
+{
+   uint32_t head = (sizeof(uint32_t) - offset % sizeof(uint32_t)) % sizeof(uint32_t);
+   uint8_t bytes[sizeof(uint32_t)];
+
+   memset(bytes, fill, sizeof(bytes));
+   if(length <= head)
+      return Sum32(sum, offset, bytes, length);
+   sum = Sum32(sum, offset, bytes, head);
+   sum += ((length - head) / sizeof(uint32_t)) * (fill * 0x01010101u);
+   return Sum32(sum, offset + length - (length - head) % sizeof(uint32_t), bytes, (length - head) % sizeof(uint32_t));
+}
+
+static bool ParseNumber(const char *token, uint32_t *number)
+{
+   char *end;
+   if(NULL == token || !isdigit((unsigned char) token[0]))
+      return false;
+   *number = (uint32_t) strtoul(token, &end, 0);
+   return '\0' == *end;
+}
+
+static int FindName(const char *token, const char *names[], uint32_t count)
+{
+   uint32_t i;
+   for(i = 0; NULL != token && i < count; ++i)
+      if(NULL != names[i] && 0 == strcmp(token, names[i]))
+         return (int) i;
+   return -1;
+}
+
+// Compile one statement (already split into tokens).
+// Produces error message on failure (so caller doesn't need to).
+static bool CompileStatement(tLayout *layout, char *tokens[], uint32_t count, const char *name, uint32_t line)
+{
+   tLayoutStep *step = &layout->steps[layout->stepCount];
+   const char *keyword = tokens[0];
+   uint32_t i;
+   int value;
+
+   if(0 == strcmp(keyword, "checksum"))
+   {
+      if(count < 2 || (0 != strcmp(tokens[1], "xor8") && 0 != strcmp(tokens[1], "sum32")))
+      {
+         ERROR("%s:%u: Checksum must be xor8 or sum32\n", name, line);
+         return false;
+      }
+      layout->checksum = ('x' == tokens[1][0]) ? LAYOUT_CHECKSUM_XOR8 : LAYOUT_CHECKSUM_SUM32;
+      for(i = 2; i < count; i += 2)
+      {
+         if(0 == strcmp(tokens[i], "init") && ParseNumber(tokens[i + 1], &layout->init))
+            continue;
+         if(0 == strcmp(tokens[i], "over") && i + 1 < count
+            && (0 == strcmp(tokens[i + 1], "data") || 0 == strcmp(tokens[i + 1], "image")))
+         {
+            layout->overData = ('d' == tokens[i + 1][0]);
+            continue;
+         }
+         ERROR("%s:%u: Bad checksum option '%s'\n", name, line, tokens[i]);
+         return false;
+      }
+      return true;
+   }
+
+   if(0 == strcmp(keyword, "segment"))
+   {
+      tLayoutGroup *group = &layout->groups[layout->groupCount];
+      if(layout->groupCount >= LAYOUT_MAX_GROUPS)
+      {
+         ERROR("%s:%u: More than %u segment groups\n", name, line, LAYOUT_MAX_GROUPS);
+         return false;
+      }
+      if(count < 2 || (0 != strcmp(tokens[1], "rom") && 0 != strcmp(tokens[1], "other")))
+      {
+         ERROR("%s:%u: Segment group must be rom or other\n", name, line);
+         return false;
+      }
+      memset(group, 0, sizeof(*group));
+      group->rom = ('r' == tokens[1][0]);
+      group->pad = SECTION_PADDING;
+      group->fill = 0xff;
+      for(i = 2; i < count; ++i)
+      {
+         const char *argument = tokens[i + 1];  // NULL after the last token
+         uint32_t number;
+
+         if(0 == strcmp(tokens[i], "skip-empty"))
+         {
+            group->skipEmpty = true;
+            continue;
+         }
+         ++i;
+         if(0 == strcmp(tokens[i - 1], "address") && ParseNumber(argument, &group->address))
+            group->setAddress = true;
+         else if(0 == strcmp(tokens[i - 1], "pad") && ParseNumber(argument, &group->pad) && group->pad > 0)
+            continue;
+         else if(0 == strcmp(tokens[i - 1], "fill") && ParseNumber(argument, &number) && number <= 0xff)
+            group->fill = (uint8_t) number;
+         else if(0 == strcmp(tokens[i - 1], "align") && NULL != argument && 0 == strcmp(argument, "romalign"))
+            group->alignValue = LAYOUT_VALUE_ROMALIGN;
+         else if(0 == strcmp(tokens[i - 1], "align") && ParseNumber(argument, &group->align))
+            continue;
+         else
+         {
+            ERROR("%s:%u: Bad segment option '%s'\n", name, line, tokens[i - 1]);
+            return false;
+         }
+      }
+      layout->groupCount++;
+      return true;
+   }
+
+   if(layout->stepCount >= LAYOUT_MAX_STEPS)
+   {
+      ERROR("%s:%u: More than %u statements\n", name, line, LAYOUT_MAX_STEPS);
+      return false;
+   }
+   memset(step, 0, sizeof(*step));
+
+   if(0 == strcmp(keyword, "u8") || 0 == strcmp(keyword, "u16") || 0 == strcmp(keyword, "u32"))
+   {
+      step->type = LAYOUT_STEP_FIELD;
+      step->width = ('8' == keyword[1]) ? 1 : ('1' == keyword[1]) ? 2 : 4;
+      value = FindName(tokens[1], valueNames, sizeof(valueNames) / sizeof(valueNames[0]));
+      if(value > 0)
+         step->value = (uint8_t) value;
+      else if(count != 2 || !ParseNumber(tokens[1], &step->number))
+      {
+         ERROR("%s:%u: Field must be a number or a value name\n", name, line);
+         return false;
+      }
+   }
+   else if(0 == strcmp(keyword, "string"))
+   {
+      step->type = LAYOUT_STEP_STRING;
+      if(3 != count || !ParseNumber(tokens[1], &step->number) || 0 != strcmp(tokens[2], "description"))
+      {
+         ERROR("%s:%u: Expected 'string <length> description'\n", name, line);
+         return false;
+      }
+   }
+   else if(0 == strcmp(keyword, "table"))
+   {
+      step->type = LAYOUT_STEP_TABLE;
+      for(i = 1; i < count; ++i)
+      {
+         value = FindName(tokens[i], columnNames, sizeof(columnNames) / sizeof(columnNames[0]));
+         if(value < 0)
+         {
+            ERROR("%s:%u: Bad table column '%s'\n", name, line, tokens[i]);
+            return false;
+         }
+         step->columns[step->columnCount++] = (uint8_t) (LAYOUT_VALUE_ADDRESS + value);
+      }
+      layout->hasTable = true;
+   }
+   else if(0 == strcmp(keyword, "data"))
+   {
+      step->type = LAYOUT_STEP_DATA;
+      step->headed = (count >= 2 && 0 == strcmp(tokens[1], "headed"));
+      step->fillRecords = (3 == count && 0 == strcmp(tokens[2], "fill-records"));
+      if(layout->hasData || count > 3 || (count >= 2 && !step->headed) || (3 == count && !step->fillRecords))
+      {
+         ERROR("%s:%u: Expected one 'data [headed [fill-records]]'\n", name, line);
+         return false;
+      }
+      layout->hasData = true;
+      layout->headed = step->headed;
+      layout->fillRecords = step->fillRecords;
+   }
+   else if(0 == strcmp(keyword, "align"))
+   {
+      step->type = LAYOUT_STEP_ALIGN;
+      if(count < 2 || !ParseNumber(tokens[1], &step->number) || 0 == step->number)
+      {
+         ERROR("%s:%u: Expected 'align <n>'\n", name, line);
+         return false;
+      }
+      for(i = 2; i < count; i += 2)
+      {
+         uint32_t number;
+         if(0 == strcmp(tokens[i], "fill") && ParseNumber(tokens[i + 1], &number) && number <= 0xff)
+            step->fill = (uint8_t) number;
+         else if(0 == strcmp(tokens[i], "reserve") && ParseNumber(tokens[i + 1], &step->reserve))
+            continue;
+         else
+         {
+            ERROR("%s:%u: Bad align option '%s'\n", name, line, tokens[i]);
+            return false;
+         }
+      }
+   }
+   else
+   {
+      ERROR("%s:%u: Unknown statement '%s'\n", name, line, keyword);
+      return false;
+   }
+
+   layout->stepCount++;
+   return true;
+}
+
+// The ROM section names joined with '+', the name of the ROM segment in a
+// stable layout sidecar
+static const char* JoinNames(char *nameList[], uint32_t count, tArena *arena)
+{
+   size_t length = 1;
+   char *name;
+   uint32_t i;
+
+   for(i = 0; i < count; ++i)
+      length += strlen(nameList[i]) + 1;
+   name = (char *) ArenaAlloc(arena, length);
+   if(NULL != name)
+   {
+      name[0] = '\0';
+      for(i = 0; i < count; ++i)
+      {
+         if(i > 0)
+            strcat(name, "+");
+         strcat(name, nameList[i]);
+      }
+   }
+   return name;
+}
+
+// Read the segments of every group.
+// Produces error message on failure (so caller doesn't need to).
+static bool ReadSegments(const tLayout *layout, MyElf_File *elf, tLayoutPlan *plan,
+   char *romSectionList[], uint32_t romSectionCount, char *otherSectionList[], uint32_t otherSectionCount)
+{
+   uint32_t g, i;
+
+   plan->segments = (tLayoutSegment *) ArenaAlloc(elf->arena,
+      (layout->groupCount * (otherSectionCount + 1) + 1) * sizeof(tLayoutSegment));
+   if(NULL == plan->segments)
+   {
+      ERROR("Failed to allocate memory for segment list\n");
+      return false;
+   }
+
+   for(g = 0; g < layout->groupCount; ++g)
+   {
+      const tLayoutGroup *group = &layout->groups[g];
+      uint32_t count = group->rom ? ((romSectionCount > 0 && NULL != romSectionList) ? 1 : 0) : otherSectionCount;
+
+      for(i = 0; i < count; ++i)
+      {
+         tLayoutSegment *segment = &plan->segments[plan->segmentCount];
+         bool success = group->rom
+            ? ReadElfSections(elf, romSectionList, romSectionCount, true, group->pad, &segment->data)
+            : ReadElfSections(elf, &otherSectionList[i], 1, false, group->pad, &segment->data);
+         if(!success)
+            return false;
+         if(0 == segment->data.size && group->skipEmpty)
+            continue;
+         if(group->setAddress)
+            segment->data.address = group->address;
+         segment->name = group->rom ? JoinNames(romSectionList, romSectionCount, elf->arena)
+            : otherSectionList[i];
+         if(NULL == segment->name)
+         {
+            ERROR("Failed to allocate memory for segment list\n");
+            return false;
+         }
+         segment->group = group;
+         segment->sum = Sum32(0, 0, segment->data.data, segment->data.size);
+         plan->segmentCount++;
+      }
+   }
+   return true;
+}
+
+static tLayoutChunk* AddChunk(tLayoutPlan *plan, uint8_t kind, uint32_t length)
+{
+   tLayoutChunk *chunk = &plan->chunks[plan->chunkCount++];
+
+   memset(chunk, 0, sizeof(*chunk));
+   chunk->kind = kind;
+   chunk->offset = plan->offset;
+   chunk->length = length;
+   if(LAYOUT_CHUNK_BYTES == kind)
+   {
+      chunk->bytes = &plan->bytes[plan->byteCount];
+      memset(chunk->bytes, 0, length);
+      plan->byteCount += length;
+   }
+   plan->offset += length;
+   return chunk;
+}
+
+static void AddSegmentHeader(tLayoutPlan *plan, uint32_t address, uint32_t size)
+{
+   Section_Header sechead;
+   sechead.addr = address;
+   sechead.size = size;
+   memcpy(AddChunk(plan, LAYOUT_CHUNK_BYTES, sizeof(sechead))->bytes, &sechead, sizeof(sechead));
+}
+
+// Segments loaded to a word aligned address can be split at runs of one
+// byte value into data and fill records. ROM segments (address zero) are
+// mapped, not loaded, so they are left whole.
+static bool CanFillRuns(const tLayoutSegment *segment, uint32_t threshold)
+{
+   return threshold > 0 && 0 != segment->data.address && 0 == segment->data.address % sizeof(uint32_t);
+}
+
+// The next run of at least 'threshold' bytes of one value in the segment
+// data, at or after 'from' (a multiple of four). Runs are whole words, so
+// the records around them stay word aligned.
+static bool FindRun(const tSectionData *data, uint32_t from, uint32_t threshold, uint32_t *start,
+   uint32_t *length)
+{
+   uint32_t words = data->size / sizeof(uint32_t);
+   uint32_t i = from / sizeof(uint32_t);
+   uint32_t j;
+
+   while(i < words)
+   {
+      uint32_t word;
+      memcpy(&word, data->data + i * sizeof(word), sizeof(word));
+      if(word != (word & 0xff) * 0x01010101)
+      {
+         ++i;
+         continue;
+      }
+      for(j = i + 1; j < words && 0 == memcmp(data->data + j * sizeof(word), &word, sizeof(word)); ++j)
+         ;
+      if((j - i) * sizeof(word) >= threshold)
+      {
+         *start = i * sizeof(word);
+         *length = (j - i) * sizeof(word);
+         return true;
+      }
+      i = j;
+   }
+   return false;
+}
+
+static uint32_t CountRuns(const tSectionData *data, uint32_t threshold)
+{
+   uint32_t from = 0, start, length;
+   uint32_t runs = 0;
+
+   while(FindRun(data, from, threshold, &start, &length))
+   {
+      from = start + length;
+      runs++;
+   }
+   return runs;
+}
+
+static void AddDataRecord(tLayoutPlan *plan, tLayoutSegment *segment, uint32_t from, uint32_t length)
+{
+   tLayoutChunk *chunk;
+
+   AddSegmentHeader(plan, segment->data.address + from, length);
+   chunk = AddChunk(plan, LAYOUT_CHUNK_DATA, length);
+   chunk->segment = segment;
+   chunk->from = from;
+}
+
+// Place a headed segment as data records, with a fill record for each run.
+// A fill record's header has ZBOOT_SECTION_FILL set in its size, and is
+// followed by the fill pattern word instead of the run; the pattern counts
+// in the image checksum once for every word it stands for.
+static void PlaceRecords(tLayoutPlan *plan, tLayoutSegment *segment, uint32_t threshold)
+{
+   uint32_t from = 0, start, length;
+   uint32_t records = 0;
+   tLayoutChunk *chunk;
+
+   segment->offset = plan->offset + sizeof(Section_Header);
+   while(FindRun(&segment->data, from, threshold, &start, &length))
+   {
+      if(start > from)
+      {
+         AddDataRecord(plan, segment, from, start - from);
+         records++;
+      }
+      DEBUG("Adding fill record: address %08x, size %08x, pattern 0x%02x\n", segment->data.address + start,
+         length, segment->data.data[start]);
+      AddSegmentHeader(plan, segment->data.address + start, length | ZBOOT_SECTION_FILL);
+      chunk = AddChunk(plan, LAYOUT_CHUNK_BYTES, sizeof(uint32_t));
+      memcpy(chunk->bytes, segment->data.data + start, sizeof(uint32_t));
+      chunk->words = length / sizeof(uint32_t);
+      plan->fillRecords++;
+      plan->fillBytes += length;
+      records++;
+      from = start + length;
+   }
+   if(from < segment->data.size || 0 == records)
+   {
+      AddDataRecord(plan, segment, from, segment->data.size - from);
+      records++;
+   }
+   plan->records += records - 1;
+}
+
+// Where a segment goes in a stable layout: where the previous build put
+// it, or (for a segment new to the sidecar) 'slack' bytes after the one
+// before it. If the segments before it have grown into that room, or left
+// a gap too small for a filler segment's header, it moves to the first free
+// offset. Returns the size of the gap before the segment
+// data.
+static uint32_t StableGap(tStableLayout *stable, const tLayoutSegment *segment, uint32_t index,
+   uint32_t natural, uint32_t header)
+{
+   const tStableEntry *previous = StableFind(stable, segment->name);
+   uint32_t target;
+
+   if(NULL != previous)
+      target = previous->offset;
+   else
+      target = (0 == index) ? natural : natural + stable->slack + header;
+
+   if(target < natural)
+   {
+      ERROR("Warning: Section '%s' ran out of slack, moved from image offset 0x%08x to 0x%08x\n",
+         segment->name, target, natural);
+      return 0;
+   }
+   if(target > natural && target - natural < header)
+   {
+      // The segments before it shrank by less than a filler header, so no
+      // filler segment can take up the difference
+      ERROR("Warning: Section '%s' moved from image offset 0x%08x to 0x%08x; a %u byte gap is too "
+         "small for a filler segment\n", segment->name, target, natural, target - natural);
+      return 0;
+   }
+   return target - natural;
+}
+
+// Place the segment data, with headers and alignment as the spec asks
+static void PlaceData(const tLayout *layout, const tLayoutStep *step, const tLayoutValues *values,
+   tLayoutPlan *plan)
+{
+   bool aligned;
+   uint32_t i;
+
+   for(i = 0; i < plan->segmentCount; ++i)
+   {
+      tLayoutSegment *segment = &plan->segments[i];
+      const tLayoutGroup *group = segment->group;
+      uint32_t align = (LAYOUT_VALUE_ROMALIGN == group->alignValue) ? values->romAlign : group->align;
+      uint32_t header = step->headed ? sizeof(Section_Header) : 0;
+
+      aligned = (align > 0 && (0 == i || plan->segments[i - 1].group != group));
+      if(aligned)
+      {
+         uint32_t filler = 0;
+         if(step->headed && 0 != (plan->offset + header) % align)
+         {
+            // A filler segment, so the data after it and its own header is aligned
+            filler = (align - ((plan->offset + 2 * header) % align)) % align;
+            AddSegmentHeader(plan, 0, filler);
+            AddChunk(plan, LAYOUT_CHUNK_FILL, filler)->fill = group->fill;
+            plan->fillers++;
+         }
+         else if(!step->headed)
+         {
+            filler = (align - (plan->offset % align)) % align;
+            AddChunk(plan, LAYOUT_CHUNK_FILL, filler)->fill = group->fill;
+         }
+         PRINT("%s data at image offset 0x%08x (alignment 0x%x, %u filler bytes)\n",
+            group->rom ? "ROM" : "Section", plan->offset + header, align, filler);
+      }
+      else if(NULL != plan->stable)
+      {
+         // Headed data fills the gap with a filler segment (so its header
+         // takes part of it), otherwise the gap is simply filled
+         uint32_t gap = StableGap(plan->stable, segment, i, plan->offset + header, header);
+         if(gap > 0 && step->headed)
+         {
+            AddSegmentHeader(plan, 0, gap - header);
+            AddChunk(plan, LAYOUT_CHUNK_FILL, gap - header)->fill = group->fill;
+            plan->fillers++;
+         }
+         else if(gap > 0)
+         {
+            AddChunk(plan, LAYOUT_CHUNK_FILL, gap)->fill = group->fill;
+         }
+      }
+
+      if(step->fillRecords && 0 == plan->offset % sizeof(uint32_t) && CanFillRuns(segment, values->fillRuns))
+      {
+         PlaceRecords(plan, segment, values->fillRuns);
+         continue;
+      }
+      if(step->headed)
+      {
+         DEBUG("Adding section header: address %08x, size %08x\n", segment->data.address, segment->data.size);
+         AddSegmentHeader(plan, segment->data.address, segment->data.size);
+      }
+      segment->offset = plan->offset;
+      AddChunk(plan, LAYOUT_CHUNK_DATA, segment->data.size)->segment = segment;
+   }
+}
+
+// Record where each segment was placed, for the next stable build, and
+// count the segments that kept their offset from the previous one
+// Produces error message on failure (so caller doesn't need to).
+static bool RecordSegments(tLayoutPlan *plan)
+{
+   uint32_t i;
+
+   for(i = 0; i < plan->segmentCount; ++i)
+   {
+      tLayoutSegment *segment = &plan->segments[i];
+      const tStableEntry *previous = StableFind(plan->stable, segment->name);
+      if(NULL != previous && previous->offset == segment->offset)
+         plan->stable->kept++;
+      else if(NULL != previous)
+         plan->stable->moved++;
+      if(!StableRecord(plan->stable, segment->name, segment->offset, segment->data.size))
+         return false;
+   }
+   return true;
+}
+
+static uint32_t FieldValue(uint8_t value, const tLayoutStep *step, const tLayoutValues *values,
+   MyElf_File *elf, tLayoutPlan *plan)
+{
+   switch(value)
+   {
+      case LAYOUT_VALUE_COUNT:        return plan->segmentCount + plan->fillers + plan->records;
+      case LAYOUT_VALUE_ENTRY:        return elf->header.e_entry;
+      case LAYOUT_VALUE_FLASH_MODE:   return values->flashMode;
+      case LAYOUT_VALUE_FLASH_CONFIG: return values->flashConfig;
+      case LAYOUT_VALUE_VERSION:      return values->version;
+      case LAYOUT_VALUE_DATE:         return values->date;
+      case LAYOUT_VALUE_ROMALIGN:     return values->romAlign;
+      case LAYOUT_VALUE_CHECKSUM:     return 0;  // filled in last
+      default:                        return step->number;
+   }
+}
+
+// Fill in the fields and tables, now that every offset is known
+static void ResolveChunks(const tLayoutValues *values, MyElf_File *elf, tLayoutPlan *plan)
+{
+   uint32_t i, row, column;
+
+   for(i = 0; i < plan->chunkCount; ++i)
+   {
+      tLayoutChunk *chunk = &plan->chunks[i];
+      const tLayoutStep *step = chunk->step;
+      uint32_t value;
+
+      if(NULL == step)
+         continue;
+      if(LAYOUT_STEP_FIELD == step->type)
+      {
+         value = FieldValue(step->value, step, values, elf, plan);
+         memcpy(chunk->bytes, &value, step->width);  // ztool only runs on little endian hosts
+         continue;
+      }
+      for(row = 0; row < plan->segmentCount; ++row)
+      {
+         tLayoutSegment *segment = &plan->segments[row];
+         for(column = 0; column < step->columnCount; ++column)
+         {
+            switch(step->columns[column])
+            {
+               case LAYOUT_VALUE_ADDRESS: value = segment->data.address; break;
+               case LAYOUT_VALUE_SIZE:    value = segment->data.size; break;
+               case LAYOUT_VALUE_OFFSET:  value = segment->offset; break;
+               default:                   value = segment->sum; break;
+            }
+            memcpy(chunk->bytes + (row * step->columnCount + column) * sizeof(value), &value, sizeof(value));
+         }
+      }
+   }
+}
+
+// Take the image checksum over the placed image, and fill it in
+static uint32_t ChecksumChunks(const tLayout *layout, tLayoutPlan *plan)
+{
+   uint32_t chksum = layout->init;
+   uint32_t i, j;
+
+   TRACE_BEGIN("checksum");
+   for(i = 0; i < plan->chunkCount; ++i)
+   {
+      tLayoutChunk *chunk = &plan->chunks[i];
+      const uint8_t *data = (LAYOUT_CHUNK_DATA == chunk->kind) ? chunk->segment->data.data + chunk->from
+         : chunk->bytes;
+
+      if(chunk->checksum || (layout->overData && LAYOUT_CHUNK_DATA != chunk->kind))
+         continue;
+      if(LAYOUT_CHECKSUM_XOR8 == layout->checksum)
+      {
+         if(LAYOUT_CHUNK_FILL == chunk->kind)
+            chksum ^= (chunk->length & 1) ? chunk->fill : 0;
+         else
+            for(j = 0; j < chunk->length; ++j)
+               chksum ^= data[j];
+      }
+      else if(LAYOUT_CHUNK_FILL == chunk->kind)
+         chksum = FillSum32(chksum, chunk->offset, chunk->fill, chunk->length);
+      else if(LAYOUT_CHUNK_DATA == chunk->kind && 0 == chunk->offset % sizeof(uint32_t)
+         && chunk->length == chunk->segment->data.size)
+         chksum += chunk->segment->sum;
+      else if(chunk->words > 0)
+      {
+         uint32_t pattern;
+         memcpy(&pattern, chunk->bytes, sizeof(pattern));
+         chksum += pattern * chunk->words;  // the run the fill record stands for
+      }
+      else
+         chksum = Sum32(chksum, chunk->offset, data, chunk->length);
+   }
+   TRACE_END("checksum");
+
+   for(i = 0; i < plan->chunkCount; ++i)
+      if(plan->chunks[i].checksum)
+         memcpy(plan->chunks[i].bytes, &chksum, plan->chunks[i].length);
+   return chksum;
+}
+
+// Write the placed image. Neighbouring literal chunks are contiguous in the
+// byte buffer, and are written together.
+// Produces error message on failure (so caller doesn't need to).
+static bool WriteChunks(tWriter *writer, tLayoutPlan *plan)
+{
+   bool success = true;
+   uint32_t i = 0;
+
+   while(success && i < plan->chunkCount)
+   {
+      tLayoutChunk *chunk = &plan->chunks[i++];
+      if(LAYOUT_CHUNK_DATA == chunk->kind && chunk->length == chunk->segment->data.size)
+      {
+         success = WriteSectionData(writer, &chunk->segment->data);
+      }
+      else if(LAYOUT_CHUNK_DATA == chunk->kind)
+      {
+         success = WriterWriteBlob(writer, chunk->segment->data.data + chunk->from, chunk->length);
+         if(!success)
+            ERROR("Failed to write data (%u bytes)\n", chunk->length);
+      }
+      else if(LAYOUT_CHUNK_FILL == chunk->kind)
+      {
+         success = WriterFill(writer, chunk->fill, chunk->length);
+      }
+      else
+      {
+         uint32_t length = chunk->length;
+         while(i < plan->chunkCount && LAYOUT_CHUNK_BYTES == plan->chunks[i].kind)
+            length += plan->chunks[i++].length;
+         success = WriterWrite(writer, chunk->bytes, length);
+      }
+      if(!success && LAYOUT_CHUNK_DATA != chunk->kind)
+         ERROR("Failed to write image at offset 0x%x\n", chunk->offset);
+   }
+   return success;
+}
+
+// --------------------------------------------------------------------------------
+// Operations
+
+// Read one or more elf sections (by name) into a single buffer, padded to a
+// multiple of 'padto' bytes. Missing sections produce a warning and empty
+// sections are skipped. The address is that of the first section read, or
+// zero if zeroAddress is set.
+// Produces error message on failure (so caller doesn't need to).
+bool ReadElfSections(MyElf_File *elf, char* sectionNameList[], uint32_t sectionCount,
+   bool zeroAddress, uint32_t padto, tSectionData *sectionData)
+{
+   bool success = true;
+   uint32_t pad = 0;
+   uint32_t totalSize = 0;
+   uint32_t i;
+
+   memset(sectionData, 0, sizeof(*sectionData));
+   if(sectionCount <= 0)
+      return true;  // Nothing to do?
+
+   sectionData->sections = (MyElf_Section **) ArenaAlloc(elf->arena, sectionCount * sizeof(MyElf_Section *));
+   if(NULL == sectionData->sections)
+   {
+      ERROR("Failed to allocate memory for section list\n");
+      return false;
+   }
+   sectionData->count = sectionCount;
+
+   // Get the information for all sections, to size the buffer once
+   for(i = 0; i < sectionCount; ++i)
+   {
+      char *sectionName = sectionNameList[i];
+      MyElf_Section *section = GetElfSection(elf, sectionName);
+
+      sectionData->sections[i] = section;
+      if(NULL == section) 
+      {
+         ERROR("Warning: Section '%s' not found in elf file.\n", sectionName);
+      }
+      else if(0 == section->size)
+      {
+         DEBUG("Section '%s' is empty; skipping\n", sectionName);
+         sectionData->sections[i] = NULL;
+      }
+      else
+      {
+         if(!zeroAddress && 0 == sectionData->address)
+            sectionData->address = section->address;
+         totalSize += section->size; 
+      }
+   }
+
+   sectionData->data = (uint8_t *) ArenaAlloc(elf->arena, totalSize + padto); // Reserve enough space for max padding 
+   if(NULL == sectionData->data)
+   {
+      ERROR("%s: Failed to allocate buffer (%u bytes)\n", __func__, totalSize + padto);
+      return false;
+   }
+
+   // Read the section data straight into place
+   totalSize = 0;
+   for(i = 0; success && i < sectionCount; ++i)
+   {
+      if(NULL == sectionData->sections[i])
+         continue;
+      if(!ReadElfSectionData(elf, sectionData->sections[i], &sectionData->data[totalSize]))
+      {
+         ERROR("%s: Failed to read data from ELF section '%s'\n", __func__, sectionNameList[i]);
+         success = false;
+      }
+      else
+      {
+         totalSize += sectionData->sections[i]->size;
+      }
+   }
+
+   // Determine padding (if any)
+   if(success && padto > 0)
+   {
+      pad = totalSize % padto;
+      if(pad > 0)
+      {
+         pad = padto - pad;
+         DEBUG("%s: Total length is %u bytes, padto %u bytes, padding is %u bytes\n",
+            __func__, totalSize, padto, pad);
+         memset(&sectionData->data[totalSize], 0xa5, pad);  // pad bytes
+         totalSize += pad;
+      }
+      else
+      {
+         DEBUG("%s: Total length is %u bytes, no padding needed (padto is %u)\n", __func__, totalSize, padto);
+      }
+   }
+
+   sectionData->size = totalSize;
+   return success;
+}
+
+// 32-bit word sum of section data read by ReadElfSections (padded to a
+// multiple of four bytes)
+uint32_t SectionDataChecksum(tSectionData *sectionData)
+{
+   uint32_t chksum = 0;
+   uint32_t i;
+
+   TRACE_BEGIN("checksum");
+   for(i = 0; i + sizeof(uint32_t) <= sectionData->size; i += sizeof(uint32_t))
+      chksum += *((uint32_t *) (sectionData->data + i));
+   TRACE_END("checksum");
+   return chksum;
+}
+
+// Write section data read by ReadElfSections. Each section's contents are
+// written as a separate payload (so they can be deduplicated in store mode),
+// followed by the padding.
+// Produces error message on failure (so caller doesn't need to).
+bool WriteSectionData(tWriter *writer, tSectionData *sectionData)
+{
+   uint32_t offset = 0;
+   bool success = true;
+   uint32_t i;
+
+   if(0 == sectionData->size)
+      return true;
+
+   TRACE_BEGIN("write");
+   for(i = 0; success && i < sectionData->count; ++i)
+   {
+      if(NULL == sectionData->sections[i])
+         continue;
+      success = WriterWriteBlob(writer, &sectionData->data[offset], sectionData->sections[i]->size);
+      offset += sectionData->sections[i]->size;
+   }
+   if(success)
+      success = WriterWrite(writer, &sectionData->data[offset], sectionData->size - offset);
+   TRACE_END("write");
+   if(!success)
+      ERROR("Failed to write data (%u bytes)\n", sectionData->size); 
+   return success;
+}
+
+// Compile a layout spec into a plan; 'name' is used in error messages.
+// Produces error message on failure (so caller doesn't need to).
+tLayout* LayoutCompile(const char *spec, const char *name, tArena *arena)
+{
+   tLayout *layout = (tLayout *) ArenaCalloc(arena, sizeof(tLayout));
+   char *text = (char *) ArenaAlloc(arena, strlen(spec) + 1);
+   char *line, *next;
+   uint32_t lineNumber = 0;
+   uint32_t i;
+
+   if(NULL == layout || NULL == text)
+   {
+      ERROR("Failed to allocate memory for layout '%s'\n", name);
+      return NULL;
+   }
+   strcpy(text, spec);
+   layout->name = name;
+   layout->checksum = LAYOUT_CHECKSUM_SUM32;
+
+   for(line = text; NULL != line; line = next)
+   {
+      char *tokens[LAYOUT_MAX_TOKENS + 1];
+      uint32_t count = 0;
+      char *token;
+
+      next = strchr(line, '\n');
+      if(NULL != next)
+         *next++ = '\0';
+      ++lineNumber;
+      line[strcspn(line, "#\r")] = '\0';
+      for(token = strtok(line, " \t"); NULL != token; token = strtok(NULL, " \t"))
+      {
+         if(count == LAYOUT_MAX_TOKENS)
+         {
+            ERROR("%s:%u: Too many words\n", name, lineNumber);
+            return NULL;
+         }
+         tokens[count++] = token;
+      }
+      tokens[count] = NULL;
+      if(count > 0 && !CompileStatement(layout, tokens, count, name, lineNumber))
+         return NULL;
+   }
+
+   if(!layout->hasData)
+   {
+      ERROR("%s: No 'data' statement\n", name);
+      return NULL;
+   }
+   if(layout->fillRecords && (layout->hasTable || LAYOUT_CHECKSUM_SUM32 != layout->checksum))
+   {
+      ERROR("%s: Fill records need a sum32 checksum, and can't be listed in a table\n", name);
+      return NULL;
+   }
+   for(i = 0; layout->hasTable && layout->headed && i < layout->groupCount; ++i)
+   {
+      if(0 != layout->groups[i].align || LAYOUT_VALUE_ROMALIGN == layout->groups[i].alignValue)
+      {
+         ERROR("%s: Aligned groups need filler segments, which a table can't list; use unheaded data\n", name);
+         return NULL;
+      }
+   }
+   DEBUG("%s: Layout '%s': %u group(s), %u step(s)\n", __func__, name, layout->groupCount, layout->stepCount);
+   return layout;
+}
+
+// Load a layout by name: one of the built-in layouts (bin, zboot, zboot2),
+// or else a spec file.
+// Produces error message on failure (so caller doesn't need to).
+tLayout* LayoutLoad(const char *name, tArena *arena)
+{
+   uint32_t size;
+   char *spec;
+   uint32_t i;
+
+   for(i = 0; i < sizeof(builtinLayouts) / sizeof(builtinLayouts[0]); ++i)
+      if(0 == strcmp(name, builtinLayouts[i].name))
+         return LayoutCompile(builtinLayouts[i].spec, name, arena);
+
+   spec = (char *) ReadImageFile(name, &size, arena);  // zero terminated
+   if(NULL == spec)
+      return NULL;
+   return LayoutCompile(spec, name, arena);
+}
+
+// Write an image from an ELF file as a compiled layout describes it. The
+// sections are read and the image placed first, then written in one pass.
+// With 'stable', segments are kept at their offsets from the previous build
+// where they still fit (see ztool_stable.h), and the offsets recorded.
+// Produces error message on failure (so caller doesn't need to).
+bool LayoutWriteImage(const tLayout *layout, MyElf_File *elf, tWriter *writer, const tLayoutValues *values,
+   char *romSectionList[], uint32_t romSectionCount, char *otherSectionList[], uint32_t otherSectionCount,
+   tStableLayout *stable)
+{
+   tLayoutPlan plan;
+   uint32_t byteMax = 0;
+   uint32_t chunkMax = 0;
+   uint32_t runs = 0;
+   uint32_t chksum;
+   uint32_t i;
+
+   memset(&plan, 0, sizeof(plan));
+   plan.stable = stable;
+   if(NULL != stable && layout->hasTable && layout->headed)
+   {
+      // Filler segments would need rows in the table, which is sized already
+      ERROR("Layout '%s' can't be stable: it has both a table and headed data\n", layout->name);
+      return false;
+   }
+   if(values->fillRuns > 0 && !layout->fillRecords)
+   {
+      ERROR("Layout '%s' has no fill records ('data headed fill-records')\n", layout->name);
+      return false;
+   }
+   if(!ReadSegments(layout, elf, &plan, romSectionList, romSectionCount, otherSectionList, otherSectionCount))
+      return false;
+   for(i = 0; i < plan.segmentCount; ++i)
+      if(CanFillRuns(&plan.segments[i], values->fillRuns))
+         runs += CountRuns(&plan.segments[i].data, values->fillRuns);
+
+   // Size the chunk list and literal buffer for the worst case
+   for(i = 0; i < layout->stepCount; ++i)
+   {
+      const tLayoutStep *step = &layout->steps[i];
+      chunkMax += 1;
+      if(LAYOUT_STEP_FIELD == step->type)
+         byteMax += step->width;
+      else if(LAYOUT_STEP_STRING == step->type)
+         byteMax += step->number;
+      else if(LAYOUT_STEP_TABLE == step->type)
+         byteMax += plan.segmentCount * step->columnCount * sizeof(uint32_t);
+      else if(LAYOUT_STEP_DATA == step->type)
+      {
+         chunkMax += 2 * (plan.segmentCount + layout->groupCount);
+         chunkMax += (NULL != stable) ? 2 * plan.segmentCount : 0;
+         chunkMax += 4 * runs;  // a fill record, and a data record after it
+         byteMax += runs * (2 * sizeof(Section_Header) + sizeof(uint32_t));
+         byteMax += 2 * sizeof(Section_Header) * (plan.segmentCount + layout->groupCount);
+      }
+   }
+   plan.chunks = (tLayoutChunk *) ArenaAlloc(elf->arena, chunkMax * sizeof(tLayoutChunk));
+   plan.bytes = (uint8_t *) ArenaAlloc(elf->arena, byteMax + 1);
+   if(NULL == plan.chunks || NULL == plan.bytes)
+   {
+      ERROR("Failed to allocate memory for layout '%s'\n", layout->name);
+      return false;
+   }
+
+   for(i = 0; i < layout->stepCount; ++i)
+   {
+      const tLayoutStep *step = &layout->steps[i];
+      tLayoutChunk *chunk;
+
+      switch(step->type)
+      {
+         case LAYOUT_STEP_FIELD:
+            chunk = AddChunk(&plan, LAYOUT_CHUNK_BYTES, step->width);
+            chunk->step = step;
+            chunk->checksum = (LAYOUT_VALUE_CHECKSUM == step->value);
+            break;
+         case LAYOUT_STEP_STRING:
+            chunk = AddChunk(&plan, LAYOUT_CHUNK_BYTES, step->number);
+            if(NULL != values->description)
+               strncpy((char *) chunk->bytes, values->description, step->number);
+            break;
+         case LAYOUT_STEP_TABLE:
+            chunk = AddChunk(&plan, LAYOUT_CHUNK_BYTES, plan.segmentCount * step->columnCount * sizeof(uint32_t));
+            chunk->step = step;
+            break;
+         case LAYOUT_STEP_DATA:
+            PlaceData(layout, step, values, &plan);
+            break;
+         default:
+            chunk = AddChunk(&plan, LAYOUT_CHUNK_FILL,
+               (step->number - (plan.offset + step->reserve) % step->number) % step->number);
+            chunk->fill = step->fill;
+            break;
+      }
+   }
+
+   if(NULL != stable && !RecordSegments(&plan))
+      return false;
+   if(plan.fillRecords > 0)
+      PRINT("%u fill record(s) stand for %u bytes of section data\n", plan.fillRecords, plan.fillBytes);
+   ResolveChunks(values, elf, &plan);
+   chksum = ChecksumChunks(layout, &plan);
+   DEBUG("%s: '%s' image: %u segment(s), %u bytes, checksum 0x%08x\n", __func__, layout->name,
+      plan.segmentCount + plan.fillers + plan.records, plan.offset, chksum);
+   return WriteChunks(writer, &plan);
+}
@@ -0,0 +1,108 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_LAYOUT_H
+#define ZTOOL_LAYOUT_H
+
+#include "ztool.h"
+#include "ztool_arena.h"
+#include "ztool_elf.h"
+#include "ztool_stable.h"
+#include "ztool_write.h"
+
+// Image layout specs. A spec describes an image format as text, one
+// statement per line ('#' starts a comment; numbers are decimal or 0x hex):
+//
+//    checksum <xor8|sum32> [init <n>] [over <image|data>]
+//       The image checksum: an XOR of bytes, or a 32-bit sum of the little
+//       endian words at image offsets that are multiples of four. It covers
+//       the whole image (default) or the segment data only, never itself.
+//    segment <rom|other> [address <n>] [pad <n>] [align <n>] [fill <byte>] [skip-empty]
+//       A group of segments: 'rom' is all the ROM sections (-r) in one
+//       segment, 'other' one segment per other section (-s). Segment data
+//       is padded with 0xa5 bytes to a multiple of 'pad' (default 4). With
+//       'align' ('romalign' for the -A value), the group's data starts at a
+//       multiple of it, after 'fill' bytes (default 0xff): a filler segment
+//       with address zero when data is headed, otherwise a gap. Missing and
+//       empty sections give segments of size zero, unless 'skip-empty'.
+//    u8|u16|u32 <n|value>
+//       A field: a number, or one of count (segments), entry, flash_mode,
+//       flash_config, version, date or checksum.
+//    string <length> description
+//       The -n description, zero padded (and not terminated when full).
+//    table <column> ...
+//       A row per segment of u32 columns: address, size, offset (of its
+//       data in the image) and checksum (sum32 of its data).
+//    data [headed [fill-records]]
+//       The segment data, in group order; 'headed' puts the u32 address and
+//       size before each segment. With 'fill-records', loaded segments are
+//       split at runs of one byte value of at least the caller's threshold,
+//       and each run is written as a fill record (see ZBOOT_SECTION_FILL).
+//    align <n> [fill <byte>] [reserve <n>]
+//       Fill bytes (default 0) up to where 'reserve' more bytes end on a
+//       multiple of n.
+//
+// A spec is compiled once into a plan of steps. For each image the plan is
+// placed (every section read, every offset and value resolved, checksums
+// taken over the result) and then written in a single pass, so fields and
+// tables can refer to data that comes after them.
+
+#define LAYOUT_MAX_STEPS   64
+#define LAYOUT_MAX_GROUPS  8
+#define LAYOUT_MAX_COLUMNS 8
+
+// Contents of one or more ELF sections, read into one padded buffer
+typedef struct
+{
+   MyElf_Section **sections;   // NULL entries for missing and empty sections
+   uint32_t        count;
+   uint8_t        *data;
+   uint32_t        size;       // including padding
+   uint32_t        address;    // of the first section, or zero
+} tSectionData;
+
+// Values a spec can refer to, supplied by the caller for each image
+typedef struct
+{
+   uint8_t     flashMode;
+   uint8_t     flashConfig;   // flash size << 4 | flash clock
+   uint32_t    version;
+   uint32_t    date;
+   const char *description;
+   uint32_t    romAlign;      // zero for no alignment
+   uint32_t    fillRuns;      // shortest run for a fill record; zero for none
+} tLayoutValues;
+
+typedef struct tLayout tLayout;
+
+bool ReadElfSections(MyElf_File *elf, char* sectionNameList[], uint32_t sectionCount,
+   bool zeroAddress, uint32_t padto, tSectionData *sectionData);
+uint32_t SectionDataChecksum(tSectionData *sectionData);
+bool WriteSectionData(tWriter *writer, tSectionData *sectionData);
+
+tLayout* LayoutCompile(const char *spec, const char *name, tArena *arena);
+tLayout* LayoutLoad(const char *name, tArena *arena);
+bool LayoutWriteImage(const tLayout *layout, MyElf_File *elf, tWriter *writer, const tLayoutValues *values,
+   char *romSectionList[], uint32_t romSectionCount, char *otherSectionList[], uint32_t otherSectionCount,
+   tStableLayout *stable);
+
+#endif /* ZTOOL_LAYOUT_H */
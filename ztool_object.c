@@ -0,0 +1,425 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_elf.h"
+#include "ztool_object.h"
+#include "ztool_write.h"
+
+// Alternatives to the C header output of -i. Both make the cost of building
+// the consumer independent of the size of the sections:
+//   - a relocatable ELF object holding the section data, with the same
+//     entry_addr and <name>_addr/_len/_data symbols the C header defines
+//   - an assembler file that pulls the section data in with .incbin
+// Each comes with a small C header of extern declarations.
+
+#define OBJECT_SYMBOL_NAME_SIZE 31
+
+typedef struct
+{
+   MyElf_Section *section;
+   uint8_t       *data;
+   char           name[OBJECT_SYMBOL_NAME_SIZE];
+   uint32_t       offset;   // of the _addr word in the object's data section
+} tObjectSection;
+
+// Object file layout: header, data, symbols, strings, section headers
+enum
+{
+   OBJ_SECTION_NULL,
+   OBJ_SECTION_DATA,
+   OBJ_SECTION_SYMTAB,
+   OBJ_SECTION_STRTAB,
+   OBJ_SECTION_SHSTRTAB,
+   OBJ_SECTION_COUNT
+};
+
+static const char OBJ_SECTION_NAMES[] = "\0.rodata\0.symtab\0.strtab\0.shstrtab";
+#define OBJ_NAME_DATA     1
+#define OBJ_NAME_SYMTAB   9
+#define OBJ_NAME_STRTAB   17
+#define OBJ_NAME_SHSTRTAB 25
+
+// --------------------------------------------------------------------------------
+// Helper Functions 
+
+// Same name mangling as the C header output ('.' becomes '_')
+static void MakeSymbolName(char *name, const char *sectionName)
+{
+   size_t i;
+
+   strncpy(name, sectionName, OBJECT_SYMBOL_NAME_SIZE - 1);
+   name[OBJECT_SYMBOL_NAME_SIZE - 1] = '\0';
+   for(i = 0; name[i] != '\0'; ++i)
+      if(name[i] == '.') name[i] = '_';
+}
+
+// Look up and read all requested sections
+static tObjectSection* LoadObjectSections(MyElf_File *elf, char *sections[], int numsec)
+{
+   tObjectSection *result;
+   int i;
+
+   result = (tObjectSection *) ArenaCalloc(elf->arena, (numsec + 1) * sizeof(tObjectSection));
+   if(NULL == result)
+      return NULL;
+
+   for(i = 0; i < numsec; ++i)
+   {
+      result[i].section = GetElfSection(elf, sections[i]);
+      if(NULL == result[i].section)
+      {
+         ERROR("Failed to load section '%s'\n", sections[i]);
+         return NULL;
+      }
+      result[i].data = GetElfSectionData(elf, result[i].section, 0);
+      if(NULL == result[i].data)
+      {
+         ERROR("Failed to read data for section '%s'\n", sections[i]);
+         return NULL;
+      }
+      MakeSymbolName(result[i].name, result[i].section->name);
+   }
+   return result;
+}
+
+// Derive the name of a companion file from the output file name, by
+// replacing its extension (if any) with 'suffix'
+static char* CompanionFileName(tArena *arena, const char *outFile, const char *suffix)
+{
+   const char *slash = strrchr(outFile, '/');
+   const char *dot = strrchr(outFile, '.');
+   size_t length = (NULL != dot && (NULL == slash || dot > slash)) ? (size_t) (dot - outFile) : strlen(outFile);
+   char *result = (char *) ArenaAlloc(arena, length + strlen(suffix) + 1);
+
+   if(NULL != result)
+   {
+      memcpy(result, outFile, length);
+      strcpy(result + length, suffix);
+   }
+   return result;
+}
+
+static const char* BaseName(const char *path)
+{
+   const char *slash = strrchr(path, '/');
+   return (NULL == slash) ? path : slash + 1;
+}
+
+// Write the C header declaring the symbols defined by the object/assembler file
+static bool WriteExternHeader(tArena *arena, const char *outFile, tObjectSection *sections, int numsec)
+{
+   char *headerFile;
+   tWriter writer;
+   FILE *fd;
+   int i;
+
+   if(0 == strcmp(outFile, "-"))
+   {
+      DEBUG("No extern header for standard output\n");
+      return true;
+   }
+   headerFile = CompanionFileName(arena, outFile, ".h");
+   if(NULL == headerFile || !WriterOpen(&writer, headerFile, false))
+      return false;
+
+   fd = writer.fd;
+   fprintf(fd, "#include <stdint.h>\n");
+   fprintf(fd, "extern const uint32_t entry_addr;\n");
+   for(i = 0; i < numsec; ++i)
+   {
+      fprintf(fd, "\nextern const uint32_t %s_addr;\nextern const uint32_t %s_len;\nextern const uint8_t  %s_data[];\n",
+         sections[i].name, sections[i].name, sections[i].name);
+   }
+   DEBUG("Wrote extern declarations to '%s'\n", headerFile);
+   return WriterClose(&writer);
+}
+
+static bool WriteSymbol(tWriter *writer, uint32_t name, uint32_t value, uint32_t size)
+{
+   Elf32_Sym sym;
+   sym.st_name = name;
+   sym.st_value = value;
+   sym.st_size = size;
+   sym.st_info = ELF32_ST_INFO(STB_GLOBAL, STT_OBJECT);
+   sym.st_other = 0;
+   sym.st_shndx = OBJ_SECTION_DATA;
+   return WriterWrite(writer, &sym, sizeof(sym));
+}
+
+static void SetSectionHeader(Elf32_Shdr *shdr, uint32_t name, uint32_t type, uint32_t offset, uint32_t size)
+{
+   memset(shdr, 0, sizeof(*shdr));
+   shdr->sh_name = name;
+   shdr->sh_type = type;
+   shdr->sh_offset = offset;
+   shdr->sh_size = size;
+   shdr->sh_addralign = 1;
+}
+
+// --------------------------------------------------------------------------------
+// Operations
+
+// Create a relocatable ELF object (for the same machine as the input ELF)
+// containing the data of the specified sections, and a header declaring it.
+// Produces error message on failure (so caller doesn't need to).
+bool CreateObjectFile(char *inFile, char *outFile, char *sections[], int numsec)
+{
+   static const char *suffixes[] = { "_addr", "_len", "_data" };
+   tArena *arena = NULL;
+   MyElf_File *elf = NULL;
+   tObjectSection *objSections = NULL;
+   tWriter writer;
+   Elf32_Ehdr header;
+   Elf32_Shdr shdr[OBJ_SECTION_COUNT];
+   uint32_t dataSize = sizeof(uint32_t);   // entry_addr
+   uint32_t strtabSize = 1 + sizeof("entry_addr");
+   uint32_t symbolCount = 2;               // null symbol and entry_addr
+   uint32_t offset, strOffset;
+   bool success = true; // optimism
+   int i, j;
+
+   WriterInit(&writer, NULL);
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return false;
+
+   elf = LoadElf(inFile, arena);
+   if(NULL == elf)
+   {
+      ERROR("Failed to open ELF file '%s'\n", inFile);
+      success = false;
+   }
+
+   if(success)
+   {
+      objSections = LoadObjectSections(elf, sections, numsec);
+      success = (NULL != objSections);
+   }
+
+   // Lay out the data section: entry_addr, then addr, len and data per section
+   for(i = 0; success && i < numsec; ++i)
+   {
+      objSections[i].offset = dataSize;
+      dataSize += 2 * sizeof(uint32_t) + ((objSections[i].section->size + 3) & ~3);
+      strtabSize += 3 * strlen(objSections[i].name) + sizeof("_addr") + sizeof("_len") + sizeof("_data");
+      symbolCount += 3;
+   }
+
+   if(success)
+      success = WriterOpen(&writer, outFile, true);
+
+   if(success)
+   {
+      memset(&header, 0, sizeof(header));
+      memcpy(header.e_ident, elf->header.e_ident, EI_NIDENT);
+      header.e_type = ET_REL;
+      header.e_machine = elf->header.e_machine;
+      header.e_version = EV_CURRENT;
+      header.e_flags = elf->header.e_flags;
+      header.e_ehsize = sizeof(Elf32_Ehdr);
+      header.e_shentsize = sizeof(Elf32_Shdr);
+      header.e_shnum = OBJ_SECTION_COUNT;
+      header.e_shstrndx = OBJ_SECTION_SHSTRTAB;
+
+      offset = sizeof(Elf32_Ehdr);
+      memset(&shdr[OBJ_SECTION_NULL], 0, sizeof(Elf32_Shdr));
+      SetSectionHeader(&shdr[OBJ_SECTION_DATA], OBJ_NAME_DATA, SHT_PROGBITS, offset, dataSize);
+      shdr[OBJ_SECTION_DATA].sh_flags = SHF_ALLOC;
+      shdr[OBJ_SECTION_DATA].sh_addralign = sizeof(uint32_t);
+      offset += dataSize;
+      SetSectionHeader(&shdr[OBJ_SECTION_SYMTAB], OBJ_NAME_SYMTAB, SHT_SYMTAB, offset, symbolCount * sizeof(Elf32_Sym));
+      shdr[OBJ_SECTION_SYMTAB].sh_link = OBJ_SECTION_STRTAB;
+      shdr[OBJ_SECTION_SYMTAB].sh_info = 1;  // index of the first global symbol
+      shdr[OBJ_SECTION_SYMTAB].sh_entsize = sizeof(Elf32_Sym);
+      shdr[OBJ_SECTION_SYMTAB].sh_addralign = sizeof(uint32_t);
+      offset += symbolCount * sizeof(Elf32_Sym);
+      SetSectionHeader(&shdr[OBJ_SECTION_STRTAB], OBJ_NAME_STRTAB, SHT_STRTAB, offset, strtabSize);
+      offset += strtabSize;
+      SetSectionHeader(&shdr[OBJ_SECTION_SHSTRTAB], OBJ_NAME_SHSTRTAB, SHT_STRTAB, offset, sizeof(OBJ_SECTION_NAMES));
+      offset += sizeof(OBJ_SECTION_NAMES);
+      header.e_shoff = (offset + 3) & ~3;
+
+      success = WriterWrite(&writer, &header, sizeof(header));
+   }
+
+   // Data section
+   if(success)
+   {
+      uint32_t entry = elf->header.e_entry;
+      success = WriterWrite(&writer, &entry, sizeof(entry));
+   }
+   for(i = 0; success && i < numsec; ++i)
+   {
+      MyElf_Section *sect = objSections[i].section;
+      DEBUG("Adding section '%s', addr: 0x%08x, size: %u.\n", sect->name, sect->address, sect->size);
+      success = WriterWrite(&writer, &sect->address, sizeof(uint32_t))
+             && WriterWrite(&writer, &sect->size, sizeof(uint32_t))
+             && WriterWrite(&writer, objSections[i].data, sect->size)
+             && WriterFill(&writer, 0, ((sect->size + 3) & ~3) - sect->size);
+   }
+
+   // Symbol table; names are laid out in the string table in the same order
+   if(success)
+   {
+      Elf32_Sym sym;
+      memset(&sym, 0, sizeof(sym));
+      success = WriterWrite(&writer, &sym, sizeof(sym))
+             && WriteSymbol(&writer, 1, 0, sizeof(uint32_t));
+   }
+   strOffset = 1 + sizeof("entry_addr");
+   for(i = 0; success && i < numsec; ++i)
+   {
+      uint32_t value = objSections[i].offset;
+      for(j = 0; success && j < 3; ++j)
+      {
+         uint32_t size = (2 == j) ? objSections[i].section->size : sizeof(uint32_t);
+         success = WriteSymbol(&writer, strOffset, value, size);
+         strOffset += strlen(objSections[i].name) + strlen(suffixes[j]) + 1;
+         value += sizeof(uint32_t);
+      }
+   }
+
+   // String tables and section headers
+   if(success)
+      success = WriterWrite(&writer, "\0entry_addr", 1 + sizeof("entry_addr"));
+   for(i = 0; success && i < numsec; ++i)
+   {
+      for(j = 0; success && j < 3; ++j)
+      {
+         success = WriterWrite(&writer, objSections[i].name, strlen(objSections[i].name))
+                && WriterWrite(&writer, suffixes[j], strlen(suffixes[j]) + 1);
+      }
+   }
+   if(success)
+   {
+      success = WriterWrite(&writer, OBJ_SECTION_NAMES, sizeof(OBJ_SECTION_NAMES))
+             && WriterFill(&writer, 0, header.e_shoff - writer.offset)
+             && WriterWrite(&writer, shdr, sizeof(shdr));
+      if(!success)
+         ERROR("Failed to write object file\n");
+   }
+
+   success = WriterClose(&writer) && success;
+   if(success)
+      success = WriteExternHeader(arena, outFile, objSections, numsec);
+
+   if(NULL != elf)
+      UnloadElf(elf);
+   ArenaRelease(arena);
+   return success;
+}
+
+// Create an assembler file that includes the data of the specified sections
+// with .incbin, the data files it includes, and a header declaring it all.
+// Data files are named after the output file: <output>_<section>.bin, and are
+// placed next to it.
+// Produces error message on failure (so caller doesn't need to).
+bool CreateAsmFile(char *inFile, char *outFile, char *sections[], int numsec)
+{
+   tArena *arena = NULL;
+   MyElf_File *elf = NULL;
+   tObjectSection *objSections = NULL;
+   tWriter writer;
+   FILE *fd = NULL;
+   bool success = true; // optimism
+   int i;
+
+   if(0 == strcmp(outFile, "-"))
+   {
+      ERROR("Assembler output needs a file name for its data files\n");
+      return false;
+   }
+
+   WriterInit(&writer, NULL);
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return false;
+
+   elf = LoadElf(inFile, arena);
+   if(NULL == elf)
+   {
+      ERROR("Failed to open ELF file '%s'\n", inFile);
+      success = false;
+   }
+
+   if(success)
+   {
+      objSections = LoadObjectSections(elf, sections, numsec);
+      success = (NULL != objSections);
+   }
+
+   if(success)
+      success = WriterOpen(&writer, outFile, false);
+
+   if(success)
+   {
+      fd = writer.fd;
+      fprintf(fd, "/* Data files are included by name; assemble with -I <directory of this file> */\n");
+      fprintf(fd, "\t.section .rodata\n\t.align 4\n");
+      fprintf(fd, "\n\t.global entry_addr\n\t.type entry_addr, \"object\"\n\t.size entry_addr, 4\n");
+      fprintf(fd, "entry_addr:\n\t.4byte 0x%08x\n", elf->header.e_entry);
+   }
+
+   for(i = 0; success && i < numsec; ++i)
+   {
+      MyElf_Section *sect = objSections[i].section;
+      char *name = objSections[i].name;
+      char *dataFile = NULL;
+      char suffix[OBJECT_SYMBOL_NAME_SIZE + 6];
+      tWriter dataWriter;
+
+      // the section data goes in its own file
+      sprintf(suffix, "_%s.bin", name);
+      dataFile = CompanionFileName(arena, outFile, suffix);
+      success = (NULL != dataFile) && WriterOpen(&dataWriter, dataFile, true);
+      if(success)
+      {
+         success = WriterWrite(&dataWriter, objSections[i].data, sect->size);
+         success = WriterClose(&dataWriter) && success;
+      }
+      if(!success)
+         break;
+
+      DEBUG("Adding section '%s', addr: 0x%08x, size: %u, data file '%s'.\n",
+         sect->name, sect->address, sect->size, dataFile);
+      fprintf(fd, "\n\t.global %s_addr\n\t.type %s_addr, \"object\"\n\t.size %s_addr, 4\n"
+         "%s_addr:\n\t.4byte 0x%08x\n", name, name, name, name, sect->address);
+      fprintf(fd, "\t.global %s_len\n\t.type %s_len, \"object\"\n\t.size %s_len, 4\n"
+         "%s_len:\n\t.4byte %u\n", name, name, name, name, sect->size);
+      fprintf(fd, "\t.global %s_data\n\t.type %s_data, \"object\"\n\t.size %s_data, %u\n"
+         "%s_data:\n\t.incbin \"%s\"\n\t.align 4\n", name, name, name, sect->size, name, BaseName(dataFile));
+   }
+
+   success = WriterClose(&writer) && success;
+   if(success)
+      success = WriteExternHeader(arena, outFile, objSections, numsec);
+
+   if(NULL != elf)
+      UnloadElf(elf);
+   ArenaRelease(arena);
+   return success;
+}
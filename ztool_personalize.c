@@ -0,0 +1,463 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#define _GNU_SOURCE  // sysconf(_SC_NPROCESSORS_ONLN)
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#endif
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_arena.h"
+#include "ztool_depend.h"
+#include "ztool_elf.h"
+#include "ztool_image.h"
+#include "ztool_personalize.h"
+#include "ztool_trace.h"
+#include "ztool_write.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define PERSONALIZE_MAX_THREADS 64
+#define PERSONALIZE_PATH_SIZE   1024
+#define PERSONALIZE_NAME_SIZE   128
+
+typedef struct
+{
+   char     name[PERSONALIZE_NAME_SIZE];
+   uint8_t *data;
+   uint32_t length;
+} tDeviceRecord;
+
+// The template, with the per-device block located and its share of the
+// checksum taken out, shared read-only by the workers. In a zboot v2 image
+// the block's section table entry carries a checksum of its own, which
+// changes with the block (and so counts twice in the image checksum).
+typedef struct
+{
+   const uint8_t *image;
+   uint32_t       imageSize;      // without the trailing checksum
+   uint32_t       blockOffset;    // of the per-device block payload in the image
+   uint32_t       blockSize;      // rounded up to whole checksum words
+   uint32_t       baseChecksum;   // checksum of everything but the block
+   uint32_t       entryOffset;    // v2: of the block's section table entry
+   uint32_t       entrySize;      // v2: sizeof(tzSectionEntry), otherwise 0
+   tzSectionEntry entry;          // v2: that entry, less the block's checksum
+   const char    *outPattern;
+   tDeviceRecord *records;
+   uint32_t       recordCount;
+   uint32_t       next;           // next record to be claimed by a worker
+   uint32_t       written;
+   bool           failed;
+#ifndef WIN32
+   pthread_mutex_t lock;
+#endif
+} tPersonalizeJob;
+
+// --------------------------------------------------------------------------------
+// Helper Functions
+
+static uint32_t WordSum(const uint8_t *data, uint32_t length)
+{
+   uint32_t sum = 0;
+   uint32_t i;
+
+   for(i = 0; i + sizeof(uint32_t) <= length; i += sizeof(uint32_t))
+   {
+      uint32_t word;
+      memcpy(&word, data + i, sizeof(word));
+      sum += word;
+   }
+   return sum;
+}
+
+static int HexValue(char c)
+{
+   if(c >= '0' && c <= '9') return c - '0';
+   if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+   if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+   return -1;
+}
+
+// Read the device records; all of them are read before any image is
+// written, so a bad record doesn't leave a partial batch behind.
+// Produces error message on failure (so caller doesn't need to).
+static tDeviceRecord* ReadDeviceRecords(char *recordFile, uint32_t blockLength, uint32_t *count,
+   tArena *arena)
+{
+   tDeviceRecord *records;
+   uint32_t length = 0;
+   uint32_t i;
+   uint8_t *text;
+   size_t nameLength = strlen(recordFile);
+   bool csv = (nameLength > 4 && 0 == strcmp(recordFile + nameLength - 4, ".csv"));
+
+   text = ReadImageFile(recordFile, &length, arena);
+   if(NULL == text)
+      return NULL;
+
+   if(!csv)
+   {
+      if(0 == length || 0 != length % blockLength)
+      {
+         ERROR("Record file '%s' is not a whole number of %u byte records\n", recordFile, blockLength);
+         return NULL;
+      }
+      *count = length / blockLength;
+      records = (tDeviceRecord *) ArenaAlloc(arena, *count * sizeof(tDeviceRecord));
+      if(NULL == records)
+         return NULL;
+      for(i = 0; i < *count; ++i)
+      {
+         sprintf(records[i].name, "%06u", i);
+         records[i].data = text + i * blockLength;
+         records[i].length = blockLength;
+      }
+      return records;
+   }
+
+   // CSV: one record per line, so there are no more records than lines
+   *count = 1;
+   for(i = 0; i < length; ++i)
+      if('\n' == text[i])
+         ++*count;
+   records = (tDeviceRecord *) ArenaAlloc(arena, *count * sizeof(tDeviceRecord));
+   if(NULL == records)
+      return NULL;
+
+   *count = 0;
+   for(char *line = (char *) text, *end; '\0' != *line; line = end)
+   {
+      tDeviceRecord *record = &records[*count];
+      char *comma, *hex;
+
+      end = line + strcspn(line, "\n");
+      if('\0' != *end)
+         *end++ = '\0';
+      line[strcspn(line, "\r")] = '\0';
+      if('\0' == line[0] || '#' == line[0])
+         continue;
+
+      comma = strchr(line, ',');
+      if(NULL == comma || comma == line || (size_t) (comma - line) >= sizeof(record->name)
+         || strcspn(line, "/\\") < (size_t) (comma - line))
+      {
+         ERROR("Bad device name in record: %s\n", line);
+         return NULL;
+      }
+      memcpy(record->name, line, comma - line);
+      record->name[comma - line] = '\0';
+
+      // The hex is converted in place; it takes twice the space of the bytes
+      record->data = (uint8_t *) comma + 1;
+      record->length = 0;
+      for(hex = comma + 1; HexValue(hex[0]) >= 0 && HexValue(hex[1]) >= 0; hex += 2)
+         record->data[record->length++] = (uint8_t) ((HexValue(hex[0]) << 4) | HexValue(hex[1]));
+      if('\0' != *hex || record->length > blockLength)
+      {
+         ERROR("Bad data for device '%s' (hex, at most %u bytes)\n", record->name, blockLength);
+         return NULL;
+      }
+      ++*count;
+   }
+   return records;
+}
+
+// Write one device image: the template before the block, the patched block,
+// the template after it and the updated checksum, in a single writev (v2
+// images also get their patched section table entry)
+static bool WriteDeviceImage(tPersonalizeJob *job, tDeviceRecord *record, uint8_t *block)
+{
+   char path[PERSONALIZE_PATH_SIZE];
+   char temp[PERSONALIZE_PATH_SIZE + 32];
+   tzSectionEntry entry = job->entry;
+   uint32_t blockSum;
+   uint32_t chksum;
+   bool success;
+   int fd;
+
+   memcpy(block, job->image + job->blockOffset, job->blockSize);
+   memcpy(block, record->data, record->length);
+   blockSum = WordSum(block, job->blockSize);
+   entry.chksum += blockSum;
+   chksum = job->baseChecksum + blockSum;
+   if(0 != job->entrySize)
+      chksum += blockSum;
+
+   if(!DeviceFileName(path, sizeof(path), job->outPattern, record->name))
+      return false;
+   snprintf(temp, sizeof(temp), "%s.%lu.tmp", path, (unsigned long) getpid());
+   fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+   if(fd < 0)
+   {
+      ERROR("Failed to create '%s'\n", path);
+      return false;
+   }
+   DEPEND_OUTPUT(path);
+
+#ifdef WIN32
+   {
+      uint32_t gap = job->entryOffset + job->entrySize;
+      uint32_t tail = job->blockOffset + job->blockSize;
+      success = (int) job->entryOffset == _write(fd, job->image, job->entryOffset)
+             && (int) job->entrySize == _write(fd, &entry, job->entrySize)
+             && (int) (job->blockOffset - gap) == _write(fd, job->image + gap, job->blockOffset - gap)
+             && (int) job->blockSize == _write(fd, block, job->blockSize)
+             && (int) (job->imageSize - tail) == _write(fd, job->image + tail, job->imageSize - tail)
+             && (int) sizeof(chksum) == _write(fd, &chksum, sizeof(chksum));
+   }
+#else
+   {
+      struct iovec parts[6];
+      uint32_t gap = job->entryOffset + job->entrySize;
+      uint32_t tail = job->blockOffset + job->blockSize;
+      parts[0].iov_base = (void *) job->image;
+      parts[0].iov_len = job->entryOffset;
+      parts[1].iov_base = &entry;
+      parts[1].iov_len = job->entrySize;
+      parts[2].iov_base = (void *) (job->image + gap);
+      parts[2].iov_len = job->blockOffset - gap;
+      parts[3].iov_base = block;
+      parts[3].iov_len = job->blockSize;
+      parts[4].iov_base = (void *) (job->image + tail);
+      parts[4].iov_len = job->imageSize - tail;
+      parts[5].iov_base = &chksum;
+      parts[5].iov_len = sizeof(chksum);
+      success = (ssize_t) (job->imageSize + sizeof(chksum)) == writev(fd, parts, 6);
+   }
+#endif
+
+   success = (0 == close(fd)) && success;
+   if(success)
+      success = ReplaceIfChanged(temp, path);
+   if(!success)
+   {
+      ERROR("Failed to write '%s'\n", path);
+      remove(temp);
+   }
+   return success;
+}
+
+static void* PersonalizeWorker(void *parameter)
+{
+   tPersonalizeJob *job = (tPersonalizeJob *) parameter;
+   uint8_t *block = (uint8_t *) malloc(job->blockSize);
+   uint32_t written = 0;
+
+   while(NULL != block)
+   {
+      tDeviceRecord *record = NULL;
+#ifndef WIN32
+      pthread_mutex_lock(&job->lock);
+#endif
+      if(!job->failed && job->next < job->recordCount)
+         record = &job->records[job->next++];
+#ifndef WIN32
+      pthread_mutex_unlock(&job->lock);
+#endif
+      if(NULL == record)
+         break;
+
+      TRACE_BEGIN_ARG("device", record->name);
+      if(WriteDeviceImage(job, record, block))
+      {
+         ++written;
+      }
+      else
+      {
+#ifndef WIN32
+         pthread_mutex_lock(&job->lock);
+#endif
+         job->failed = true;  // stop handing out records
+#ifndef WIN32
+         pthread_mutex_unlock(&job->lock);
+#endif
+      }
+      TRACE_END("device");
+   }
+
+#ifndef WIN32
+   pthread_mutex_lock(&job->lock);
+#endif
+   job->written += written;
+   if(NULL == block)
+      job->failed = true;
+#ifndef WIN32
+   pthread_mutex_unlock(&job->lock);
+#endif
+   free(block);
+   return NULL;
+}
+
+// --------------------------------------------------------------------------------
+// Operations
+
+// Output file name for a device: the pattern with PERSONALIZE_NAME_TOKEN
+// replaced by the device name. Returns false if the pattern has no token.
+bool DeviceFileName(char *path, size_t size, const char *pattern, const char *name)
+{
+   const char *token = strstr(pattern, PERSONALIZE_NAME_TOKEN);
+   if(NULL == token)
+      return false;
+   return snprintf(path, size, "%.*s%s%s", (int) (token - pattern), pattern, name,
+      token + strlen(PERSONALIZE_NAME_TOKEN)) < (int) size;
+}
+
+// Write a personalized copy of a zboot template image for every device
+// record. The template is read once; the payload of 'sectionName' is found
+// by its load address, and its share of the 32-bit checksum is taken out.
+// Each device image then costs one checksum pass over the block and one
+// writev, spread over 'threads' workers (zero for one per processor).
+// Produces error message on failure (so caller doesn't need to).
+bool PersonalizeZbootImages(char *elfFile, char *sectionName, char *templateFile,
+   char *recordFile, char *outPattern, uint32_t threads)
+{
+   tPersonalizeJob job;
+   tImageInfo image;
+   MyElf_File *elf = NULL;
+   MyElf_Section *section = NULL;
+   tArena *arena = NULL;
+   uint8_t *data = NULL;
+   uint32_t size = 0;
+   bool success = true; // optimism
+   uint32_t i;
+
+   memset(&job, 0, sizeof(job));
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return false;
+
+   elf = LoadElf(elfFile, arena);
+   success = (NULL != elf);
+   if(success)
+   {
+      section = GetElfSection(elf, sectionName);
+      if(NULL == section || 0 == section->size)
+      {
+         ERROR("Per-device section '%s' not found in '%s'\n", sectionName, elfFile);
+         success = false;
+      }
+   }
+
+   // Find the block in the template
+   if(success)
+   {
+      data = ReadImageFile(templateFile, &size, arena);
+      success = (NULL != data);
+   }
+   if(success && (!ParseImage(data, size, &image, arena) || IMAGE_FORMAT_ZBOOT != image.format
+      || !image.checksumValid))
+   {
+      ERROR("Template '%s' is not a valid zboot image\n", templateFile);
+      success = false;
+   }
+   for(i = 0; success && i < image.count; ++i)
+   {
+      if(!image.segments[i].fill && image.segments[i].address == section->address
+         && image.segments[i].size >= section->size)
+      {
+         job.blockOffset = image.segments[i].offset;
+         job.blockSize = (section->size + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+         if(ZBOOT_LAYOUT_V2 == image.layout)
+         {
+            job.entryOffset = sizeof(tzImageHeader) + i * sizeof(tzSectionEntry);
+            job.entrySize = sizeof(tzSectionEntry);
+         }
+         break;
+      }
+   }
+   if(success && 0 == job.blockSize)
+   {
+      ERROR("Section '%s' is not in the template; list it with -s\n", sectionName);
+      success = false;
+   }
+
+   if(success)
+   {
+      job.image = data;
+      job.imageSize = image.length - sizeof(uint32_t);
+      memcpy(&job.baseChecksum, data + job.imageSize, sizeof(uint32_t));
+      job.baseChecksum -= WordSum(data + job.blockOffset, job.blockSize);
+      if(0 != job.entrySize)
+      {
+         memcpy(&job.entry, data + job.entryOffset, sizeof(job.entry));
+         job.entry.chksum -= WordSum(data + job.blockOffset, job.blockSize);
+         job.baseChecksum -= WordSum(data + job.blockOffset, job.blockSize);
+      }
+      job.outPattern = outPattern;
+      job.records = ReadDeviceRecords(recordFile, section->size, &job.recordCount, arena);
+      success = (NULL != job.records);
+      DEBUG("%s: Block at image offset 0x%x (%u bytes), %u record(s)\n", __func__,
+         job.blockOffset, job.blockSize, job.recordCount);
+   }
+
+   if(success)
+   {
+      uint32_t count = threads;
+#ifdef WIN32
+      PersonalizeWorker(&job);
+#else
+      pthread_t workers[PERSONALIZE_MAX_THREADS];
+      if(0 == count)
+      {
+         long processors = sysconf(_SC_NPROCESSORS_ONLN);
+         count = (processors > 0) ? (uint32_t) processors : 1;
+      }
+      if(count > PERSONALIZE_MAX_THREADS)
+         count = PERSONALIZE_MAX_THREADS;
+      if(count > job.recordCount)
+         count = (job.recordCount > 0) ? job.recordCount : 1;
+
+      pthread_mutex_init(&job.lock, NULL);
+      for(i = 1; i < count; ++i)
+      {
+         if(0 != pthread_create(&workers[i], NULL, PersonalizeWorker, &job))
+         {
+            ERROR("Failed to start personalization worker\n");
+            break;
+         }
+      }
+      count = i;
+      PersonalizeWorker(&job);  // this thread works too
+      for(i = 1; i < count; ++i)
+         pthread_join(workers[i], NULL);
+      pthread_mutex_destroy(&job.lock);
+#endif
+      success = !job.failed;
+      PRINT("Wrote %u of %u device image(s)\n", job.written, job.recordCount);
+   }
+
+   if(NULL != elf)
+      UnloadElf(elf);
+   ArenaRelease(arena);
+   return success;
+}
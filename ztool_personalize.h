@@ -0,0 +1,43 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_PERSONALIZE_H
+#define ZTOOL_PERSONALIZE_H
+
+#include <stddef.h>
+#include "ztool.h"
+
+// Per-device zboot images, made from a template image by replacing the
+// contents of one section (the per-device block). Records are read from a
+// CSV file (".csv"), one device per line:
+//    <device name>,<block contents as hex>
+// or from a binary file of fixed-size records, each the size of the section
+// and named by its record number. Record contents shorter than the section
+// replace its start; the rest keeps the template's contents.
+
+#define PERSONALIZE_NAME_TOKEN "%s"   // replaced by the device name in output file names
+
+bool DeviceFileName(char *path, size_t size, const char *pattern, const char *name);
+bool PersonalizeZbootImages(char *elfFile, char *sectionName, char *templateFile,
+   char *recordFile, char *outPattern, uint32_t threads);
+
+#endif /* ZTOOL_PERSONALIZE_H */
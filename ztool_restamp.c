@@ -0,0 +1,204 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L  // pread, pwrite
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_image.h"
+#include "ztool_restamp.h"
+#include "ztool_trace.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// --------------------------------------------------------------------------------
+// Helper Functions
+
+// Positioned reads and writes, which don't disturb (or need) a file offset
+static bool ReadAt(int fd, void *buffer, uint32_t length, uint32_t offset)
+{
+#ifdef WIN32
+   return offset == (uint32_t) _lseek(fd, offset, SEEK_SET) && (int) length == _read(fd, buffer, length);
+#else
+   return (ssize_t) length == pread(fd, buffer, length, offset);
+#endif
+}
+
+static bool WriteAt(int fd, const void *buffer, uint32_t length, uint32_t offset)
+{
+#ifdef WIN32
+   return offset == (uint32_t) _lseek(fd, offset, SEEK_SET) && (int) length == _write(fd, buffer, length);
+#else
+   return (ssize_t) length == pwrite(fd, buffer, length, offset);
+#endif
+}
+
+static uint32_t HeaderSum(const tzImageHeader *header)
+{
+   const uint8_t *words = (const uint8_t *) header;
+   uint32_t sum = 0;
+   uint32_t i;
+
+   for(i = 0; i < sizeof(*header); i += sizeof(uint32_t))
+   {
+      uint32_t word;
+      memcpy(&word, words + i, sizeof(word));
+      sum += word;
+   }
+   return sum;
+}
+
+// Restamp one image. Only the section headers (or v2 section table) are
+// read, to find the checksum at the end of the image, never the section
+// data. The checksum is a 32-bit sum of all words, so the new checksum is
+// the old one plus the difference between the new and old header sums.
+// Produces error message on failure (so caller doesn't need to).
+static bool RestampZbootFile(const char *file, const tRestamp *stamp)
+{
+   tzImageHeader header;
+   uint32_t oldSum;
+   uint32_t chksum;
+   uint32_t offset;
+   uint32_t size;
+   struct stat info;
+   bool success = true; // optimism
+   uint32_t i;
+   int fd;
+
+   fd = open(file, O_RDWR | O_BINARY);
+   if(fd < 0 || 0 != fstat(fd, &info))
+   {
+      ERROR("Failed to open image '%s'\n", file);
+      if(fd >= 0)
+         close(fd);
+      return false;
+   }
+   size = (uint32_t) info.st_size;
+
+   if(!ReadAt(fd, &header, sizeof(header), 0) || (ZBOOT_MAGIC != header.magic && ZBOOT_MAGIC_V2 != header.magic))
+   {
+      ERROR("'%s' is not a zboot image\n", file);
+      close(fd);
+      return false;
+   }
+
+   // Walk the section headers (v2: the section table) to the checksum
+   offset = sizeof(header);
+   if(ZBOOT_MAGIC_V2 == header.magic)
+   {
+      uint32_t tableEnd = offset + header.count * sizeof(tzSectionEntry);
+      success = (header.count <= (size - offset) / sizeof(tzSectionEntry));
+      for(offset = tableEnd, i = 0; success && i < header.count; ++i)
+      {
+         tzSectionEntry entry;
+         if(!ReadAt(fd, &entry, sizeof(entry), sizeof(header) + i * sizeof(entry)))
+            success = false;
+         else if(entry.offset > size || entry.size > size - entry.offset)
+            success = false;
+         else if(entry.offset + entry.size > offset)
+            offset = entry.offset + entry.size;
+      }
+   }
+   for(i = 0; success && ZBOOT_MAGIC == header.magic && i < header.count; ++i)
+   {
+      Section_Header sechead;
+      if(size - offset < sizeof(sechead) || !ReadAt(fd, &sechead, sizeof(sechead), offset))
+      {
+         success = false;
+         break;
+      }
+      if(0 != (sechead.size & ZBOOT_SECTION_FILL))
+         sechead.size = sizeof(uint32_t);  // fill record: the pattern only
+      if(sechead.size > size - offset - sizeof(sechead))
+         success = false;
+      else
+         offset += sizeof(sechead) + sechead.size;
+   }
+   if(success && (size - offset < sizeof(chksum) || !ReadAt(fd, &chksum, sizeof(chksum), offset)))
+      success = false;
+   if(!success)
+      ERROR("Image '%s' is truncated or corrupt\n", file);
+
+   if(success)
+   {
+      oldSum = HeaderSum(&header);
+      if(stamp->setVersion)
+         header.version = stamp->version;
+      if(stamp->setDate)
+         header.date = stamp->date;
+      if(NULL != stamp->description)
+      {
+         memset(header.description, 0, sizeof(header.description));
+         strncpy(header.description, stamp->description, sizeof(header.description) - 1);
+      }
+      chksum += HeaderSum(&header) - oldSum;
+
+      if(!WriteAt(fd, &header, sizeof(header), 0) || !WriteAt(fd, &chksum, sizeof(chksum), offset))
+      {
+         ERROR("Failed to update image '%s'\n", file);
+         success = false;
+      }
+      else
+      {
+         DEBUG("%s: '%s' version 0x%08x, date 0x%08x, checksum 0x%08x\n", __func__, file,
+            header.version, header.date, chksum);
+      }
+   }
+
+   success = (0 == close(fd)) && success;
+   return success;
+}
+
+// --------------------------------------------------------------------------------
+// Operations
+
+// Change the version, date and/or description of existing zboot images in
+// place, updating their checksums, without rebuilding them from the ELF file.
+// Produces error message on failure (so caller doesn't need to).
+bool RestampZbootFiles(char *files[], uint32_t fileCount, const tRestamp *stamp)
+{
+   uint32_t restamped = 0;
+   uint32_t i;
+
+   for(i = 0; i < fileCount; ++i)
+   {
+      TRACE_BEGIN_ARG("restamp", files[i]);
+      if(RestampZbootFile(files[i], stamp))
+         ++restamped;
+      TRACE_END("restamp");
+   }
+
+   PRINT("Restamped %u of %u image(s)\n", restamped, fileCount);
+   return restamped == fileCount;
+}
@@ -0,0 +1,40 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_RESTAMP_H
+#define ZTOOL_RESTAMP_H
+
+#include "ztool.h"
+
+// New header values for RestampZbootFiles; fields not set are kept
+typedef struct
+{
+   bool        setVersion;
+   uint32_t    version;
+   bool        setDate;
+   uint32_t    date;          // seconds since 2000
+   const char *description;   // NULL to keep
+} tRestamp;
+
+bool RestampZbootFiles(char *files[], uint32_t fileCount, const tRestamp *stamp);
+
+#endif /* ZTOOL_RESTAMP_H */
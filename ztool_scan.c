@@ -0,0 +1,252 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_arena.h"
+#include "ztool_image.h"
+#include "ztool_scan.h"
+#include "ztool_trace.h"
+#include "ztool_write.h"
+
+#define SCAN_MAX_SEGMENTS   16    // the boot ROMs load no more than this
+#define SCAN_MAX_FLASH_MODE 3     // dout
+#define SCAN_MAX_FLASH_SIZE 9     // largest ESP8266 or ESP32 size code
+#define SCAN_MIN_ENTRY      0x40000000  // entry points are in instruction RAM or flash
+#define SCAN_MAX_ENTRY      0x40400000
+
+typedef struct
+{
+   const uint8_t *magic;     // little endian magic number
+   uint32_t       length;
+   uint32_t       next;      // offset of the next match (or the dump size)
+   bool           searched;  // next is valid
+} tScanMagic;
+
+// --------------------------------------------------------------------------------
+// Helper Functions
+
+// Offset of the next occurrence of a magic number at or after 'offset', or
+// 'size' if there is none. The search uses memchr, which the C library
+// vectorizes, for the first byte. The last match is kept between calls, so
+// the dump is searched only once per magic number.
+static uint32_t FindMagic(const uint8_t *data, uint32_t size, uint32_t offset, tScanMagic *magic)
+{
+   if(magic->searched && magic->next >= offset)
+      return magic->next;
+
+   magic->searched = true;
+   while(offset < size)
+   {
+      const uint8_t *match = (const uint8_t *) memchr(data + offset, magic->magic[0], size - offset);
+      if(NULL == match)
+         break;
+      offset = (uint32_t) (match - data);
+      if(size - offset >= magic->length && 0 == memcmp(match, magic->magic, magic->length))
+      {
+         magic->next = offset;
+         return offset;
+      }
+      ++offset;
+   }
+   magic->next = size;
+   return size;
+}
+
+// Cheap checks of the header fields at a magic number match, to keep random
+// data that happens to start with a magic number away from ParseImage
+// (which walks the whole image, and hashes ESP32 images)
+static bool PlausibleHeader(const uint8_t *data, uint32_t size)
+{
+   if(BIN_MAGIC_FLASH == data[0])
+   {
+      tImageHeader header;
+      uint8_t clock;
+      if(size < sizeof(header))
+         return false;
+      memcpy(&header, data, sizeof(header));
+      clock = header.flags2 & 0xf;
+      return header.count >= 1 && header.count <= SCAN_MAX_SEGMENTS
+         && header.flags1 <= SCAN_MAX_FLASH_MODE
+         && (header.flags2 >> 4) <= SCAN_MAX_FLASH_SIZE
+         && (clock <= 2 || 0xf == clock)  // 40, 26, 20 or 80 MHz
+         && header.entry >= SCAN_MIN_ENTRY && header.entry < SCAN_MAX_ENTRY;
+   }
+   else
+   {
+      tzImageHeader header;
+      if(size < sizeof(header))
+         return false;
+      memcpy(&header, data, sizeof(header));
+      return header.count <= (size - sizeof(header)) / sizeof(Section_Header);
+   }
+}
+
+static void PrintJsonString(FILE *fd, const char *string)
+{
+   fputc('"', fd);
+   for(; '\0' != *string; ++string)
+   {
+      unsigned char c = (unsigned char) *string;
+      if('"' == c || '\\' == c)
+         fprintf(fd, "\\%c", c);
+      else if(c < ' ' || c >= 0x7f)
+         fprintf(fd, "\\u%04x", c);
+      else
+         fputc(c, fd);
+   }
+   fputc('"', fd);
+}
+
+// One JSON object per line, so results from many dumps can be concatenated
+// and processed line by line
+static void PrintImage(FILE *fd, const char *dumpFile, uint32_t offset, tImageInfo *image)
+{
+   fprintf(fd, "{\"file\":");
+   PrintJsonString(fd, dumpFile);
+   fprintf(fd, ",\"offset\":%u,\"format\":\"%s\",\"length\":%u,\"entry\":\"0x%08x\",\"segments\":%u",
+      offset, ImageFormatName(image->format), image->length, image->entry, image->count);
+   if(IMAGE_FORMAT_ZBOOT == image->format)
+   {
+      time_t date = (time_t) image->date + SECONDS_BETWEEN_1970_AND_2000;
+      char text[32];
+      strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", gmtime(&date));
+      fprintf(fd, ",\"layout\":%u,\"version\":\"0x%08x\",\"date\":\"%s\",\"description\":",
+         image->layout, image->version, text);
+      PrintJsonString(fd, image->description);
+   }
+   else
+   {
+      fprintf(fd, ",\"flash_mode\":%u,\"flash_size\":%u,\"flash_clock\":%u",
+         image->flags1, image->flags2 >> 4, image->flags2 & 0xf);
+   }
+   fprintf(fd, "}\n");
+}
+
+// Scan one dump. Returns the number of valid images found, or -1 on error.
+static int32_t ScanFlashDump(const char *dumpFile, FILE *out)
+{
+   static const uint8_t binMagic[] = { BIN_MAGIC_FLASH };
+   static const uint32_t zbootMagic = ZBOOT_MAGIC;  // ztool only runs on little endian hosts
+   static const uint32_t zboot2Magic = ZBOOT_MAGIC_V2;
+   tScanMagic bin, zboot, zboot2;
+   tImageInfo image;
+   tArena *arena = NULL;
+   tArena *scratch = NULL;  // for the candidates' segment tables
+   uint8_t *data;
+   uint32_t size = 0;
+   uint32_t offset = 0;
+   int32_t found = 0;
+
+   arena = ArenaCreate(0);
+   scratch = ArenaCreate(0);
+   data = (NULL != arena && NULL != scratch) ? ReadImageFile(dumpFile, &size, arena) : NULL;
+   if(NULL == data)
+   {
+      ArenaRelease(scratch);
+      ArenaRelease(arena);
+      return -1;
+   }
+
+   TRACE_BEGIN_ARG("scan", dumpFile);
+   memset(&bin, 0, sizeof(bin));
+   bin.magic = binMagic;
+   bin.length = sizeof(binMagic);
+   memset(&zboot, 0, sizeof(zboot));
+   zboot.magic = (const uint8_t *) &zbootMagic;
+   zboot.length = sizeof(zbootMagic);
+   memset(&zboot2, 0, sizeof(zboot2));
+   zboot2.magic = (const uint8_t *) &zboot2Magic;
+   zboot2.length = sizeof(zboot2Magic);
+
+   while(offset < size)
+   {
+      uint32_t nextBin = FindMagic(data, size, offset, &bin);
+      uint32_t nextZboot = FindMagic(data, size, offset, &zboot);
+      uint32_t nextZboot2 = FindMagic(data, size, offset, &zboot2);
+      offset = (nextBin < nextZboot) ? nextBin : nextZboot;
+      offset = (nextZboot2 < offset) ? nextZboot2 : offset;
+      if(offset >= size)
+         break;
+
+      ArenaReset(scratch);
+      if(PlausibleHeader(data + offset, size - offset)
+         && ParseImage(data + offset, size - offset, &image, scratch) && image.checksumValid)
+      {
+         PrintImage(out, dumpFile, offset, &image);
+         ++found;
+         offset += image.length;  // images don't overlap
+      }
+      else
+      {
+         ++offset;
+      }
+   }
+   TRACE_END("scan");
+
+   ArenaRelease(scratch);
+   ArenaRelease(arena);
+   return found;
+}
+
+// --------------------------------------------------------------------------------
+// Operations
+
+// Scan raw flash dumps for bin, ESP32 and zboot images. Each candidate
+// header that passes PlausibleHeader is parsed with ParseImage, which
+// bounds-checks its section header chain against the dump and verifies the
+// checksum; every valid image is reported as a line of JSON.
+// Produces error message on failure (so caller doesn't need to).
+bool ScanFlashDumps(char *dumpFiles[], uint32_t dumpCount, char *outFile)
+{
+   tWriter writer;
+   uint32_t total = 0;
+   bool success = true; // optimism
+   uint32_t i;
+
+   WriterInit(&writer, NULL);
+   if(!WriterOpen(&writer, (NULL != outFile) ? outFile : "-", false))
+      return false;
+
+   for(i = 0; i < dumpCount; ++i)
+   {
+      int32_t found = ScanFlashDump(dumpFiles[i], writer.fd);
+      if(found < 0)
+      {
+         ERROR("Failed to scan '%s'\n", dumpFiles[i]);
+         success = false;
+      }
+      else
+      {
+         DEBUG("%s: %d image(s) in '%s'\n", __func__, found, dumpFiles[i]);
+         total += found;
+      }
+   }
+
+   success = WriterClose(&writer) && success;
+   PRINT("Found %u image(s) in %u dump(s)\n", total, dumpCount);
+   return success;
+}
@@ -0,0 +1,137 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <string.h>
+
+#include "ztool.h"
+#include "ztool_sha256.h"
+
+// SHA-256 (FIPS 180-4), streaming interface so an image can be hashed in
+// the same pass that writes it.
+
+static const uint32_t K[64] =
+{
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+   0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+   0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+   0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+   0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+   0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void Sha256Block(tSha256 *ctx, const uint8_t *p)
+{
+   uint32_t w[64];
+   uint32_t a, b, c, d, e, f, g, h;
+   int i;
+
+   for(i = 0; i < 16; ++i)
+      w[i] = ((uint32_t) p[i*4] << 24) | ((uint32_t) p[i*4+1] << 16) | ((uint32_t) p[i*4+2] << 8) | p[i*4+3];
+   for(i = 16; i < 64; ++i)
+   {
+      uint32_t s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+      uint32_t s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+      w[i] = w[i-16] + s0 + w[i-7] + s1;
+   }
+
+   a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+   e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+   for(i = 0; i < 64; ++i)
+   {
+      uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+      uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+   }
+   ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+   ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void Sha256Init(tSha256 *ctx)
+{
+   static const uint32_t initial[8] =
+   {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+   };
+   memcpy(ctx->state, initial, sizeof(initial));
+   ctx->length = 0;
+   ctx->used = 0;
+}
+
+void Sha256Update(tSha256 *ctx, const void *data, uint32_t length)
+{
+   const uint8_t *p = (const uint8_t *) data;
+
+   ctx->length += length;
+   if(ctx->used > 0)
+   {
+      uint32_t take = SHA256_BLOCK_SIZE - ctx->used;
+      if(take > length)
+         take = length;
+      memcpy(&ctx->block[ctx->used], p, take);
+      ctx->used += take;
+      p += take;
+      length -= take;
+      if(ctx->used < SHA256_BLOCK_SIZE)
+         return;
+      Sha256Block(ctx, ctx->block);
+      ctx->used = 0;
+   }
+   while(length >= SHA256_BLOCK_SIZE)
+   {
+      Sha256Block(ctx, p);
+      p += SHA256_BLOCK_SIZE;
+      length -= SHA256_BLOCK_SIZE;
+   }
+   memcpy(ctx->block, p, length);
+   ctx->used = length;
+}
+
+void Sha256Final(tSha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+   uint64_t bits = ctx->length * 8;
+   int i;
+
+   ctx->block[ctx->used++] = 0x80;
+   if(ctx->used > SHA256_BLOCK_SIZE - 8)
+   {
+      memset(&ctx->block[ctx->used], 0, SHA256_BLOCK_SIZE - ctx->used);
+      Sha256Block(ctx, ctx->block);
+      ctx->used = 0;
+   }
+   memset(&ctx->block[ctx->used], 0, SHA256_BLOCK_SIZE - 8 - ctx->used);
+   for(i = 0; i < 8; ++i)
+      ctx->block[SHA256_BLOCK_SIZE - 1 - i] = (uint8_t) (bits >> (i * 8));
+   Sha256Block(ctx, ctx->block);
+
+   for(i = 0; i < 8; ++i)
+   {
+      digest[i*4]   = (uint8_t) (ctx->state[i] >> 24);
+      digest[i*4+1] = (uint8_t) (ctx->state[i] >> 16);
+      digest[i*4+2] = (uint8_t) (ctx->state[i] >> 8);
+      digest[i*4+3] = (uint8_t) ctx->state[i];
+   }
+}
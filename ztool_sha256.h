@@ -0,0 +1,43 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_SHA256_H
+#define ZTOOL_SHA256_H
+
+#include "ztool.h"
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE  64
+
+typedef struct
+{
+   uint32_t state[8];
+   uint64_t length;                     // total bytes hashed
+   uint8_t  block[SHA256_BLOCK_SIZE];   // partial block
+   uint32_t used;                       // bytes in partial block
+} tSha256;
+
+void Sha256Init(tSha256 *ctx);
+void Sha256Update(tSha256 *ctx, const void *data, uint32_t length);
+void Sha256Final(tSha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif /* ZTOOL_SHA256_H */
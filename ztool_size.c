@@ -0,0 +1,393 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_elf.h"
+#include "ztool_image.h"
+#include "ztool_size.h"
+#include "ztool_write.h"
+
+typedef struct
+{
+   char     *name;
+   char     *section;
+   uint32_t  bytes;     // bytes of the section attributed to this symbol
+} tSizeEntry;
+
+typedef struct
+{
+   char     *name;
+   char     *section;
+   int32_t   delta;     // change in attributed bytes from the previous ELF
+} tSizeDelta;
+
+typedef struct
+{
+   MyElf_File  *elf;
+   tSizeEntry  *entries;
+   uint32_t     entryCount;
+   uint32_t     entryMax;      // one per symbol; each symbol is in one section
+   uint32_t     romBytes;      // total of ROM sections (one image segment)
+   uint32_t     romPadding;
+   uint32_t     otherBytes;
+   uint32_t     otherPadding;
+   uint32_t     segmentCount;
+} tSizeReport;
+
+// --------------------------------------------------------------------------------
+// Helper Functions 
+
+static uint32_t PadTo(uint32_t size, uint32_t padto)
+{
+   return (size % padto) ? padto - (size % padto) : 0;
+}
+
+// Sort by section index, then by address, largest symbol first for aliases
+static int CompareSymbolByAddress(const void *a, const void *b)
+{
+   const MyElf_Symbol *sa = *(const MyElf_Symbol **) a;
+   const MyElf_Symbol *sb = *(const MyElf_Symbol **) b;
+   if(sa->shndx != sb->shndx)
+      return (sa->shndx < sb->shndx) ? -1 : 1;
+   if(sa->value != sb->value)
+      return (sa->value < sb->value) ? -1 : 1;
+   if(sa->size != sb->size)
+      return (sa->size > sb->size) ? -1 : 1;
+   return 0;
+}
+
+static int CompareEntryByName(const void *a, const void *b)
+{
+   return strcmp(((const tSizeEntry *) a)->name, ((const tSizeEntry *) b)->name);
+}
+
+static int CompareEntryBySize(const void *a, const void *b)
+{
+   const tSizeEntry *ea = (const tSizeEntry *) a;
+   const tSizeEntry *eb = (const tSizeEntry *) b;
+   if(ea->bytes != eb->bytes)
+      return (ea->bytes > eb->bytes) ? -1 : 1;
+   return strcmp(ea->name, eb->name);
+}
+
+// Attribute every byte of one section to the symbols defined in it. Symbols
+// are walked in address order, so overlapping symbols (aliases) are counted
+// once. Bytes not covered by any symbol are reported as '(unattributed)'.
+static void AttributeSection(tSizeReport *report, MyElf_Section *section, MyElf_Symbol **sorted,
+   uint32_t first, uint32_t last, FILE *out)
+{
+   uint32_t start = section->address;
+   uint32_t end = section->address + section->size;
+   uint32_t cursor = start;
+   uint32_t unattributed = 0;
+   uint32_t entryStart = report->entryCount;
+   uint32_t i;
+
+   for(i = first; i < last; ++i)
+   {
+      MyElf_Symbol *sym = sorted[i];
+      uint32_t symStart = (sym->value > cursor) ? sym->value : cursor;
+      uint32_t symEnd = sym->value + sym->size;
+
+      if(symEnd > end)
+         symEnd = end;
+      if(symEnd <= symStart)
+         continue;  // alias of, or contained in, a previous symbol
+      if(report->entryCount == report->entryMax)
+         break;  // can't happen, as long as each section is attributed once
+
+      unattributed += (symStart > cursor) ? symStart - cursor : 0;
+      report->entries[report->entryCount].name = sym->name;
+      report->entries[report->entryCount].section = section->name;
+      report->entries[report->entryCount].bytes = symEnd - symStart;
+      report->entryCount++;
+      cursor = symEnd;
+   }
+   if(end > cursor)
+      unattributed += end - cursor;
+
+   if(NULL != out)
+   {
+      fprintf(out, "\nSection %s: %u bytes at 0x%08x, %u symbol(s), %u unattributed\n",
+         section->name, section->size, section->address, report->entryCount - entryStart, unattributed);
+      qsort(&report->entries[entryStart], report->entryCount - entryStart, sizeof(tSizeEntry),
+         CompareEntryBySize);
+      for(i = entryStart; i < report->entryCount; ++i)
+         fprintf(out, "  %10u  %s\n", report->entries[i].bytes, report->entries[i].name);
+      if(unattributed > 0)
+         fprintf(out, "  %10u  (unattributed)\n", unattributed);
+   }
+}
+
+// Attribute all selected sections of an ELF file. When 'out' is non-NULL,
+// the per-section breakdown is printed as well.
+static bool BuildSizeReport(tSizeReport *report, tArena *arena, char *inFile, char *romSectionList[],
+   uint32_t romSectionCount, char *otherSectionList[], uint32_t otherSectionCount, FILE *out)
+{
+   MyElf_Symbol **sorted = NULL;
+   bool *attributed = NULL;   // per section, so a section listed twice counts once
+   uint32_t sortedCount = 0;
+   uint32_t total = romSectionCount + otherSectionCount;
+   uint32_t i;
+
+   memset(report, 0, sizeof(*report));
+   report->elf = LoadElf(inFile, arena);
+   if(NULL == report->elf)
+   {
+      ERROR("Failed to open ELF file '%s'\n", inFile);
+      return false;
+   }
+   if(!LoadElfSymbols(report->elf))
+      return false;
+
+   sorted = (MyElf_Symbol **) ArenaAlloc(arena, (report->elf->symbolCount + 1) * sizeof(MyElf_Symbol *));
+   report->entries = (tSizeEntry *) ArenaAlloc(arena, (report->elf->symbolCount + 1) * sizeof(tSizeEntry));
+   report->entryMax = report->elf->symbolCount + 1;
+   attributed = (bool *) ArenaCalloc(arena, report->elf->header.e_shnum + 1);
+   if(NULL == sorted || NULL == report->entries || NULL == attributed)
+   {
+      ERROR("Failed to allocate memory for %u symbols\n", report->elf->symbolCount);
+      return false;
+   }
+
+   for(i = 0; i < report->elf->symbolCount; ++i)
+   {
+      MyElf_Symbol *sym = &report->elf->symbols[i];
+      if(sym->size > 0 && sym->shndx != SHN_UNDEF && sym->shndx < SHN_LORESERVE
+      && sym->type != STT_SECTION && sym->type != STT_FILE)
+         sorted[sortedCount++] = sym;
+   }
+   qsort(sorted, sortedCount, sizeof(MyElf_Symbol *), CompareSymbolByAddress);
+
+   for(i = 0; i < total; ++i)
+   {
+      bool isRom = (i < romSectionCount);
+      char *name = isRom ? romSectionList[i] : otherSectionList[i - romSectionCount];
+      MyElf_Section *section = GetElfSection(report->elf, name);
+      uint32_t index, first, last, lo, hi;
+
+      if(NULL == section)
+      {
+         ERROR("Warning: Section '%s' not found in elf file.\n", name);
+         continue;
+      }
+      index = (uint32_t) (section - report->elf->sections) + 1;
+      if(attributed[index])
+      {
+         ERROR("Warning: Section '%s' is listed more than once; counted once\n", name);
+         continue;
+      }
+      attributed[index] = true;
+
+      // Binary search for the range of symbols belonging to this section
+      lo = 0; hi = sortedCount;
+      while(lo < hi)
+      {
+         uint32_t mid = lo + (hi - lo) / 2;
+         if(sorted[mid]->shndx < index) lo = mid + 1; else hi = mid;
+      }
+      first = lo;
+      hi = sortedCount;
+      while(lo < hi)
+      {
+         uint32_t mid = lo + (hi - lo) / 2;
+         if(sorted[mid]->shndx <= index) lo = mid + 1; else hi = mid;
+      }
+      last = lo;
+
+      AttributeSection(report, section, sorted, first, last, out);
+
+      if(isRom)
+         report->romBytes += section->size;
+      else if(section->size > 0)
+      {
+         report->otherBytes += section->size;
+         report->otherPadding += PadTo(section->size, SECTION_PADDING);
+         report->segmentCount++;
+      }
+   }
+   if(report->romBytes > 0)
+   {
+      report->romPadding = PadTo(report->romBytes, SECTION_PADDING);
+      report->segmentCount++;
+   }
+
+   return true;
+}
+
+// Print the overhead added by the bin and zboot image formats
+static void PrintImageOverhead(tSizeReport *report, FILE *out)
+{
+   uint32_t payload = report->romBytes + report->otherBytes;
+   uint32_t padding = report->romPadding + report->otherPadding;
+   uint32_t headers = report->segmentCount * sizeof(Section_Header);
+   uint32_t binSize = sizeof(tImageHeader) + headers + payload + padding + sizeof(uint8_t);
+   uint32_t binPadding = PadTo(binSize, IMAGE_PADDING);
+   uint32_t zbootSize = sizeof(tzImageHeader) + headers + payload + padding + sizeof(uint32_t);
+   uint32_t table = report->segmentCount * sizeof(tzSectionEntry);
+
+   fprintf(out, "\nImage layout: %u segment(s), ROM %u bytes, other %u bytes\n",
+      report->segmentCount, report->romBytes, report->otherBytes);
+   fprintf(out, "  section padding (SECTION_PADDING %u): %u bytes (ROM %u, other %u)\n",
+      SECTION_PADDING, padding, report->romPadding, report->otherPadding);
+   fprintf(out, "  bin image:   %u bytes (header %u, section headers %u, image padding (IMAGE_PADDING %u) %u, checksum 1)\n",
+      binSize + binPadding, (uint32_t) sizeof(tImageHeader), headers, IMAGE_PADDING, binPadding);
+   fprintf(out, "  zboot image: %u bytes (header %u, section headers %u, checksum 4)\n",
+      zbootSize, (uint32_t) sizeof(tzImageHeader), headers);
+   fprintf(out, "  zboot v2:    %u bytes (header %u, section table %u, checksum 4)\n",
+      zbootSize - headers + table, (uint32_t) sizeof(tzImageHeader), table);
+}
+
+// Sort by size difference, largest growth first
+static int CompareDeltaBySize(const void *a, const void *b)
+{
+   const tSizeDelta *da = (const tSizeDelta *) a;
+   const tSizeDelta *db = (const tSizeDelta *) b;
+   if(da->delta != db->delta)
+      return (da->delta > db->delta) ? -1 : 1;
+   return strcmp(da->name, db->name);
+}
+
+// Print all symbols whose attributed size changed between two reports
+static void PrintSizeDiff(tSizeReport *current, tSizeReport *previous, tArena *arena, FILE *out)
+{
+   tSizeDelta *diff;
+   uint32_t diffCount = 0;
+   uint32_t i = 0, j = 0;
+   int64_t total = 0;
+
+   diff = (tSizeDelta *) ArenaAlloc(arena, (current->entryCount + previous->entryCount + 1) * sizeof(tSizeDelta));
+   if(NULL == diff)
+   {
+      ERROR("Failed to allocate memory for size difference\n");
+      return;
+   }
+
+   qsort(current->entries, current->entryCount, sizeof(tSizeEntry), CompareEntryByName);
+   qsort(previous->entries, previous->entryCount, sizeof(tSizeEntry), CompareEntryByName);
+
+   // Merge the two name-sorted lists, summing symbols that share a name
+   while(i < current->entryCount || j < previous->entryCount)
+   {
+      int cmp;
+      int64_t delta = 0;
+      tSizeEntry *entry;
+
+      if(i >= current->entryCount)
+         cmp = 1;
+      else if(j >= previous->entryCount)
+         cmp = -1;
+      else
+         cmp = strcmp(current->entries[i].name, previous->entries[j].name);
+
+      entry = (cmp <= 0) ? &current->entries[i] : &previous->entries[j];
+      if(cmp <= 0)
+      {
+         char *name = current->entries[i].name;
+         for(; i < current->entryCount && 0 == strcmp(current->entries[i].name, name); ++i)
+            delta += current->entries[i].bytes;
+      }
+      if(cmp >= 0)
+      {
+         char *name = previous->entries[j].name;
+         for(; j < previous->entryCount && 0 == strcmp(previous->entries[j].name, name); ++j)
+            delta -= previous->entries[j].bytes;
+      }
+      if(0 != delta)
+      {
+         diff[diffCount].name = entry->name;
+         diff[diffCount].section = entry->section;
+         diff[diffCount].delta = (int32_t) delta;
+         diffCount++;
+         total += delta;
+      }
+   }
+   qsort(diff, diffCount, sizeof(tSizeDelta), CompareDeltaBySize);
+
+   fprintf(out, "\nSymbol size changes: %u symbol(s), total %+lld bytes\n", diffCount, (long long) total);
+   for(i = 0; i < diffCount; ++i)
+      fprintf(out, "  %+10d  %s (%s)\n", diff[i].delta, diff[i].name, diff[i].section);
+}
+
+// --------------------------------------------------------------------------------
+// Operations
+
+// Produce a size report for the selected sections of an ELF file, attributing
+// every section byte to a symbol, along with the padding overhead of the image
+// formats. If prevFile is specified, the symbol size changes relative to that
+// ELF file are reported as well. Report goes to outFile, or stdout if NULL.
+// Produces error message on failure (so caller doesn't need to).
+bool CreateSizeReport(char *inFile, char *prevFile, char *outFile,
+   char *romSectionList[], uint32_t romSectionCount,
+   char *otherSectionList[], uint32_t otherSectionCount)
+{
+   tSizeReport current, previous;
+   tArena *arena = NULL;
+   tWriter writer;
+   FILE *out = stdout;
+   bool success = true; // optimism
+
+   memset(&previous, 0, sizeof(previous));
+
+   arena = ArenaCreate(0);
+   if(NULL == arena)
+      return false;
+
+   WriterInit(&writer, NULL);
+   if(NULL != outFile)
+   {
+      if(!WriterOpen(&writer, outFile, false))
+      {
+         ArenaRelease(arena);
+         return false;
+      }
+      out = writer.fd;
+   }
+
+   success = BuildSizeReport(&current, arena, inFile, romSectionList, romSectionCount,
+      otherSectionList, otherSectionCount, out);
+   if(success)
+      PrintImageOverhead(&current, out);
+
+   if(success && NULL != prevFile)
+   {
+      success = BuildSizeReport(&previous, arena, prevFile, romSectionList, romSectionCount,
+         otherSectionList, otherSectionCount, NULL);
+      if(success)
+      {
+         fprintf(out, "\nImage payload change: ROM %+d bytes, other %+d bytes\n",
+            (int32_t) (current.romBytes - previous.romBytes),
+            (int32_t) (current.otherBytes - previous.otherBytes));
+         PrintSizeDiff(&current, &previous, arena, out);
+      }
+   }
+
+   UnloadElf(current.elf);
+   UnloadElf(previous.elf);
+   ArenaRelease(arena);
+   success = WriterClose(&writer) && success;
+   return success;
+}
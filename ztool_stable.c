@@ -0,0 +1,195 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_arena.h"
+#include "ztool_image.h"
+#include "ztool_stable.h"
+#include "ztool_write.h"
+
+// --------------------------------------------------------------------------------
+// Helper Functions
+
+static char* CopyString(tArena *arena, const char *string, size_t length)
+{
+   char *copy = (char *) ArenaAlloc(arena, length + 1);
+   if(NULL != copy)
+   {
+      memcpy(copy, string, length);
+      copy[length] = '\0';
+   }
+   return copy;
+}
+
+// Parse the sidecar of the previous build into stable->previous. A sidecar
+// for another layout is ignored (with a warning), since its offsets don't
+// apply.
+// Produces error message on failure (so caller doesn't need to).
+static bool ParseSidecar(tStableLayout *stable, const char *sidecar, char *text)
+{
+   char *line = text;
+   char *next;
+   uint32_t count = 0;
+   uint32_t i;
+
+   for(i = 0; '\0' != text[i]; ++i)
+      count += ('\n' == text[i]);
+   stable->previous = (tStableEntry *) ArenaAlloc(stable->arena, (count + 1) * sizeof(tStableEntry));
+   if(NULL == stable->previous)
+      return false;
+
+   next = line + strcspn(line, "\n");
+   if('\0' != *next)
+      *next++ = '\0';
+   line[strcspn(line, "\r")] = '\0';
+   if(0 != strncmp(line, STABLE_MAGIC " ", sizeof(STABLE_MAGIC)))
+   {
+      ERROR("'%s' is not a stable layout sidecar\n", sidecar);
+      return false;
+   }
+   if(0 != strcmp(line + sizeof(STABLE_MAGIC), stable->layout))
+   {
+      ERROR("Warning: Sidecar '%s' is for layout '%s'; laying out afresh\n", sidecar, line + sizeof(STABLE_MAGIC));
+      return true;
+   }
+
+   for(line = next; '\0' != *line; line = next)
+   {
+      tStableEntry *entry = &stable->previous[stable->previousCount];
+      char *end;
+
+      next = line + strcspn(line, "\n");
+      if('\0' != *next)
+         *next++ = '\0';
+      line[strcspn(line, "\r")] = '\0';
+      if('\0' == line[0] || '#' == line[0])
+         continue;
+
+      entry->offset = (uint32_t) strtoul(line, &end, 16);
+      if(end != line && ' ' == *end)
+         entry->size = (uint32_t) strtoul(end, &end, 10);
+      if(end == line || ' ' != *end || '\0' == end[1])
+      {
+         ERROR("Bad line in sidecar '%s': %s\n", sidecar, line);
+         return false;
+      }
+      entry->name = end + 1;  // the text stays in the arena
+      stable->previousCount++;
+   }
+   return true;
+}
+
+// --------------------------------------------------------------------------------
+// Operations
+
+// Start a stable layout, from the sidecar of the previous build if there is
+// one. 'slack' is rounded up to whole words.
+// Produces error message on failure (so caller doesn't need to).
+tStableLayout* StableLoad(const char *sidecar, const char *layout, uint32_t slack, tArena *arena)
+{
+   tStableLayout *stable = (tStableLayout *) ArenaCalloc(arena, sizeof(tStableLayout));
+   FILE *fd;
+
+   if(NULL == stable)
+      return NULL;
+   stable->layout = layout;
+   stable->slack = (slack + SECTION_PADDING - 1) & ~(SECTION_PADDING - 1);
+   stable->arena = arena;
+
+   fd = fopen(sidecar, "rb");
+   if(NULL == fd)
+   {
+      DEBUG("%s: No sidecar '%s'; first stable build\n", __func__, sidecar);
+      return stable;
+   }
+   fclose(fd);
+
+   {
+      uint32_t size;
+      char *text = (char *) ReadImageFile(sidecar, &size, arena);  // zero terminated
+      if(NULL == text || !ParseSidecar(stable, sidecar, text))
+         return NULL;
+   }
+   DEBUG("%s: %u section(s) in sidecar '%s'\n", __func__, stable->previousCount, sidecar);
+   return stable;
+}
+
+// Where a section was placed in the previous build, or NULL if it wasn't.
+// Does not produce any messages.
+const tStableEntry* StableFind(const tStableLayout *stable, const char *name)
+{
+   uint32_t i;
+
+   for(i = 0; i < stable->previousCount; ++i)
+      if(0 == strcmp(stable->previous[i].name, name))
+         return &stable->previous[i];
+   return NULL;
+}
+
+// Record where a section is placed in this build, for the next sidecar.
+// Produces error message on failure (so caller doesn't need to).
+bool StableRecord(tStableLayout *stable, const char *name, uint32_t offset, uint32_t size)
+{
+   tStableEntry *entry;
+
+   if(stable->currentCount == stable->currentMax)
+   {
+      uint32_t max = (0 == stable->currentMax) ? 16 : 2 * stable->currentMax;
+      tStableEntry *larger = (tStableEntry *) ArenaAlloc(stable->arena, max * sizeof(tStableEntry));
+      if(NULL == larger)
+      {
+         ERROR("Failed to allocate memory for stable layout\n");
+         return false;
+      }
+      if(stable->currentCount > 0)
+         memcpy(larger, stable->current, stable->currentCount * sizeof(tStableEntry));
+      stable->current = larger;
+      stable->currentMax = max;
+   }
+
+   entry = &stable->current[stable->currentCount++];
+   entry->name = CopyString(stable->arena, name, strlen(name));
+   entry->offset = offset;
+   entry->size = size;
+   return NULL != entry->name;
+}
+
+// Write the sidecar for the next build: where each section was placed in
+// this one.
+// Produces error message on failure (so caller doesn't need to).
+bool StableSave(const tStableLayout *stable, const char *sidecar)
+{
+   tWriter writer;
+   uint32_t i;
+
+   WriterInit(&writer, NULL);
+   if(!WriterOpen(&writer, sidecar, false))
+      return false;
+   fprintf(writer.fd, STABLE_MAGIC " %s\n", stable->layout);
+   for(i = 0; i < stable->currentCount; ++i)
+      fprintf(writer.fd, "%08x %u %s\n", stable->current[i].offset, stable->current[i].size, stable->current[i].name);
+   return WriterClose(&writer);
+}
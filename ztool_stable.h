@@ -0,0 +1,66 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_STABLE_H
+#define ZTOOL_STABLE_H
+
+#include "ztool.h"
+#include "ztool_arena.h"
+
+// Stable image layout. Each section is placed where it was in the previous
+// build, as recorded in a sidecar file, as long as the sections before it
+// still fit; new sections get 'slack' bytes of room to grow after the
+// section before them. Unchanged sections then keep their image offsets
+// (and flash sectors) from one release to the next. The sidecar is text:
+//    ztool-stable 1 <layout>
+//    <data offset (hex)> <size> <section name(s)>   one line per segment
+
+#define STABLE_MAGIC         "ztool-stable 1"
+#define STABLE_SLACK_DEFAULT 256
+
+typedef struct
+{
+   const char *name;     // section name, or ROM section names joined with '+'
+   uint32_t    offset;   // of the section data in the image
+   uint32_t    size;
+} tStableEntry;
+
+typedef struct
+{
+   const char   *layout;          // name of the layout the offsets are for
+   uint32_t      slack;
+   tStableEntry *previous;        // from the sidecar
+   uint32_t      previousCount;
+   tStableEntry *current;         // placed in this build
+   uint32_t      currentCount;
+   uint32_t      currentMax;
+   uint32_t      kept;            // sections at their previous offset
+   uint32_t      moved;           // sections at a new offset
+   tArena       *arena;
+} tStableLayout;
+
+tStableLayout* StableLoad(const char *sidecar, const char *layout, uint32_t slack, tArena *arena);
+const tStableEntry* StableFind(const tStableLayout *stable, const char *name);
+bool StableRecord(tStableLayout *stable, const char *name, uint32_t offset, uint32_t size);
+bool StableSave(const tStableLayout *stable, const char *sidecar);
+
+#endif /* ZTOOL_STABLE_H */
@@ -0,0 +1,265 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_depend.h"
+#include "ztool_sha256.h"
+#include "ztool_store.h"
+#include "ztool_write.h"
+
+#define STORE_PATH_SIZE 1024
+#define RECIPE_LINE_SIZE 256
+#define BLOB_READ_SIZE   65536
+
+static bool StorePath(char *path, const char *storeDir, const char *key, bool create)
+{
+   if(snprintf(path, STORE_PATH_SIZE, "%s/%.2s", storeDir, key) >= STORE_PATH_SIZE)
+   {
+      ERROR("Store path too long for '%s'\n", storeDir);
+      return false;
+   }
+   if(create && 0 != mkdir(path, 0777) && EEXIST != errno)
+   {
+      ERROR("Failed to create store directory '%s'\n", path);
+      return false;
+   }
+   snprintf(path, STORE_PATH_SIZE, "%s/%.2s/%s", storeDir, key, key);
+   return true;
+}
+
+// Key of a blob: SHA-256 of the contents, then the size
+static void BlobKey(char *key, const uint8_t digest[SHA256_DIGEST_SIZE], uint32_t length)
+{
+   uint32_t i;
+
+   for(i = 0; i < SHA256_DIGEST_SIZE; ++i)
+      sprintf(key + 2 * i, "%02x", digest[i]);
+   sprintf(key + 2 * SHA256_DIGEST_SIZE, "%08x", length);
+}
+
+// Check that a stored blob has the contents its key names, and rewind it
+// for copying.
+// Produces error message on failure (so caller doesn't need to).
+static bool VerifyBlob(FILE *blob, const char *key, uint32_t length)
+{
+   char actual[STORE_KEY_SIZE];
+   uint8_t digest[SHA256_DIGEST_SIZE];
+   uint8_t *buffer;
+   uint32_t total = 0;
+   tSha256 sha;
+   size_t count;
+
+   buffer = (uint8_t *) malloc(BLOB_READ_SIZE);
+   if(NULL == buffer)
+   {
+      ERROR("Failed to allocate memory for blob '%s'\n", key);
+      return false;
+   }
+   Sha256Init(&sha);
+   while((count = fread(buffer, 1, BLOB_READ_SIZE, blob)) > 0)
+   {
+      Sha256Update(&sha, buffer, (uint32_t) count);
+      total += (uint32_t) count;
+   }
+   free(buffer);
+   Sha256Final(&sha, digest);
+   BlobKey(actual, digest, total);
+
+   if(ferror(blob) || total != length || 0 != strcmp(actual, key) || 0 != fseek(blob, 0, SEEK_SET))
+   {
+      ERROR("Blob '%s' in the store is corrupt\n", key);
+      return false;
+   }
+   return true;
+}
+
+// Store a blob (if the store doesn't already hold it) and return its key.
+// New blobs are written to a temporary file and renamed into place, so
+// concurrent ztool runs sharing a store never see partial blobs.
+// Produces error message on failure (so caller doesn't need to).
+bool StoreBlob(const char *storeDir, const void *data, uint32_t length, char *key)
+{
+   char path[STORE_PATH_SIZE];
+   char temp[STORE_PATH_SIZE + 32];
+   uint8_t digest[SHA256_DIGEST_SIZE];
+   struct stat info;
+   tSha256 sha;
+   FILE *fd;
+   bool success;
+
+   Sha256Init(&sha);
+   Sha256Update(&sha, data, length);
+   Sha256Final(&sha, digest);
+   BlobKey(key, digest, length);
+   if(!StorePath(path, storeDir, key, true))
+      return false;
+
+   if(0 == stat(path, &info) && (uint32_t) info.st_size == length)
+   {
+      DEBUG("%s: Blob %s already stored\n", __func__, key);
+      return true;
+   }
+
+   snprintf(temp, sizeof(temp), "%s.%lu.tmp", path, (unsigned long) getpid());
+   fd = fopen(temp, "wb");
+   if(NULL == fd)
+   {
+      ERROR("Failed to create blob '%s'\n", temp);
+      return false;
+   }
+   success = (fwrite(data, 1, length, fd) == length);
+   success = (0 == fclose(fd)) && success;
+   if(success)
+      success = (0 == rename(temp, path));
+   if(!success)
+   {
+      ERROR("Failed to store blob '%s'\n", path);
+      remove(temp);
+      return false;
+   }
+   DEBUG("%s: Stored blob %s\n", __func__, key);
+   return true;
+}
+
+static int HexValue(char c)
+{
+   if(c >= '0' && c <= '9') return c - '0';
+   if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+   if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+   return -1;
+}
+
+// Rebuild an image from its recipe and the blobs in the store. Blob contents
+// are copied with copy_file_range where available, which lets file systems
+// that support it share (reflink) the data instead of copying it. Each blob
+// is checked against its key first.
+// Produces error message on failure (so caller doesn't need to).
+bool MaterializeRecipe(char *recipeFile, char *storeDir, char *outFile)
+{
+   char line[RECIPE_LINE_SIZE];
+   char path[STORE_PATH_SIZE];
+   uint32_t expected = 0;
+   bool haveSize = false;
+   tWriter writer;
+   FILE *recipe;
+   bool success = true; // optimism
+
+   recipe = (0 == strcmp(recipeFile, "-")) ? stdin : fopen(recipeFile, "r");
+   if(NULL == recipe)
+   {
+      ERROR("Failed to open recipe '%s'\n", recipeFile);
+      return false;
+   }
+   DEPEND_INPUT(recipeFile);
+   if(NULL == fgets(line, sizeof(line), recipe) || 0 != strncmp(line, RECIPE_MAGIC, strlen(RECIPE_MAGIC)))
+   {
+      ERROR("'%s' is not a ztool recipe\n", recipeFile);
+      success = false;
+   }
+
+   WriterInit(&writer, NULL);
+   if(success)
+      success = WriterOpen(&writer, outFile, true);
+
+   while(success && !haveSize && NULL != fgets(line, sizeof(line), recipe))
+   {
+      if(0 == strncmp(line, "lit ", 4))
+      {
+         uint8_t bytes[RECIPE_LINE_SIZE / 2];
+         uint32_t count = 0;
+         char *p = line + 4;
+         while(HexValue(p[0]) >= 0 && HexValue(p[1]) >= 0)
+         {
+            bytes[count++] = (uint8_t) ((HexValue(p[0]) << 4) | HexValue(p[1]));
+            p += 2;
+         }
+         success = WriterWrite(&writer, bytes, count);
+      }
+      else if(0 == strncmp(line, "fill ", 5))
+      {
+         unsigned int value, count;
+         success = (2 == sscanf(line + 5, "%x %u", &value, &count))
+                && WriterFill(&writer, (uint8_t) value, count);
+      }
+      else if(0 == strncmp(line, "blob ", 5))
+      {
+         char key[STORE_KEY_SIZE];
+         unsigned int length = 0;
+         FILE *blob = NULL;
+
+         success = (1 == sscanf(line + 5, "%72s", key)) && strlen(key) == STORE_KEY_SIZE - 1
+                && (1 == sscanf(key + 2 * SHA256_DIGEST_SIZE, "%8x", &length))
+                && StorePath(path, storeDir, key, false);
+         if(success)
+         {
+            blob = fopen(path, "rb");
+            if(NULL == blob)
+            {
+               ERROR("Blob '%s' missing from store '%s'\n", key, storeDir);
+               success = false;
+            }
+            else
+            {
+               DEPEND_INPUT(path);
+            }
+         }
+         if(success)
+         {
+            success = VerifyBlob(blob, key, length) && WriterCopyFile(&writer, blob, length);
+            fclose(blob);
+         }
+      }
+      else if(0 == strncmp(line, "size ", 5))
+      {
+         haveSize = (1 == sscanf(line + 5, "%u", &expected));
+      }
+      else
+      {
+         success = false;
+      }
+      if(!success)
+         ERROR("Bad recipe line: %s", line);
+   }
+
+   if(success && (!haveSize || expected != writer.offset))
+   {
+      ERROR("Recipe '%s' is incomplete (%u of %u bytes)\n", recipeFile, writer.offset, expected);
+      success = false;
+   }
+
+   success = WriterClose(&writer) && success;
+   if(stdin != recipe)
+      fclose(recipe);
+   return success;
+}
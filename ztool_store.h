@@ -0,0 +1,43 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_STORE_H
+#define ZTOOL_STORE_H
+
+#include "ztool.h"
+
+// Content-addressed section store. Each section payload is stored once, as
+// <dir>/<first two key characters>/<key>, where the key is the SHA-256 and
+// size of the contents. Images are stored as small text recipes:
+//    ztool-recipe 2
+//    lit <hex bytes>          literal bytes (headers, checksums)
+//    fill <hex byte> <count>  repeated byte (padding)
+//    blob <key>               contents of a stored blob
+//    size <bytes>             total image size (last line)
+
+#define STORE_KEY_SIZE      73    // 64 hex digits of SHA-256, 8 of size, and terminator
+#define RECIPE_MAGIC        "ztool-recipe 2"
+
+bool StoreBlob(const char *storeDir, const void *data, uint32_t length, char *key);
+bool MaterializeRecipe(char *recipeFile, char *storeDir, char *outFile);
+
+#endif /* ZTOOL_STORE_H */
@@ -0,0 +1,186 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L  // clock_gettime
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_trace.h"
+
+#define TRACE_BUFFER_EVENTS 16384   // per thread; oldest events are overwritten
+#define TRACE_ARG_SIZE      32
+
+#ifdef WIN32
+#define THREAD_LOCAL __declspec(thread)
+static CRITICAL_SECTION traceLock;
+#define TRACE_LOCK()   EnterCriticalSection(&traceLock)
+#define TRACE_UNLOCK() LeaveCriticalSection(&traceLock)
+#else
+#define THREAD_LOCAL __thread
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+#define TRACE_LOCK()   pthread_mutex_lock(&traceLock)
+#define TRACE_UNLOCK() pthread_mutex_unlock(&traceLock)
+#endif
+
+typedef struct
+{
+   uint64_t    timestamp;              // nanoseconds
+   const char *name;                   // static string
+   char        arg[TRACE_ARG_SIZE];    // copied, so it can outlive its source
+   char        phase;                  // 'B'egin or 'E'nd
+} tTraceEvent;
+
+typedef struct tTraceBuffer
+{
+   struct tTraceBuffer *next;
+   uint32_t             tid;
+   uint32_t             count;         // total events recorded
+   tTraceEvent          events[TRACE_BUFFER_EVENTS];
+} tTraceBuffer;
+
+volatile uint8_t trace_enabled = false;
+static const char *tracePath = NULL;
+static uint64_t traceStart = 0;
+static tTraceBuffer *traceBuffers = NULL;   // all threads' buffers
+static uint32_t traceThreads = 0;
+static THREAD_LOCAL tTraceBuffer *traceBuffer = NULL;
+
+static uint64_t TraceNow(void)
+{
+#ifdef WIN32
+   LARGE_INTEGER count, frequency;
+   QueryPerformanceCounter(&count);
+   QueryPerformanceFrequency(&frequency);
+   return (uint64_t) ((double) count.QuadPart * 1e9 / (double) frequency.QuadPart);
+#else
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+#endif
+}
+
+// Enable tracing; the trace is written to 'path' at exit
+bool TraceStart(const char *path)
+{
+#ifdef WIN32
+   InitializeCriticalSection(&traceLock);
+#endif
+   tracePath = path;
+   traceStart = TraceNow();
+   if(0 != atexit(TraceFlush))
+   {
+      ERROR("Failed to register trace output\n");
+      return false;
+   }
+   trace_enabled = true;
+   return true;
+}
+
+// Record an event on the calling thread. The first event on a thread
+// allocates and registers its buffer; after that recording is lock-free.
+void TraceEvent(char phase, const char *name, const char *arg)
+{
+   tTraceEvent *event;
+
+   if(NULL == traceBuffer)
+   {
+      tTraceBuffer *buffer = (tTraceBuffer *) malloc(sizeof(tTraceBuffer));
+      if(NULL == buffer)
+         return;
+      buffer->count = 0;
+      TRACE_LOCK();
+      buffer->tid = ++traceThreads;
+      buffer->next = traceBuffers;
+      traceBuffers = buffer;
+      TRACE_UNLOCK();
+      traceBuffer = buffer;
+   }
+
+   event = &traceBuffer->events[traceBuffer->count % TRACE_BUFFER_EVENTS];
+   event->timestamp = TraceNow();
+   event->name = name;
+   event->phase = phase;
+   event->arg[0] = '\0';
+   if(NULL != arg)
+   {
+      strncpy(event->arg, arg, TRACE_ARG_SIZE - 1);
+      event->arg[TRACE_ARG_SIZE - 1] = '\0';
+   }
+   traceBuffer->count++;
+}
+
+// Write all recorded events as a Chrome trace-event JSON file. Registered
+// with atexit by TraceStart, so the trace is written however ztool exits.
+void TraceFlush(void)
+{
+   tTraceBuffer *buffer;
+   bool first = true;
+   FILE *fd;
+
+   if(!trace_enabled)
+      return;
+   trace_enabled = false;
+
+   fd = fopen(tracePath, "w");
+   if(NULL == fd)
+   {
+      ERROR("Failed to open trace file '%s'\n", tracePath);
+      return;
+   }
+
+   fprintf(fd, "{\"traceEvents\":[\n");
+   TRACE_LOCK();
+   for(buffer = traceBuffers; NULL != buffer; buffer = buffer->next)
+   {
+      uint32_t start = (buffer->count > TRACE_BUFFER_EVENTS) ? buffer->count - TRACE_BUFFER_EVENTS : 0;
+      uint32_t i;
+
+      fprintf(fd, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+         first ? "" : ",\n", buffer->tid, (1 == buffer->tid) ? "main" : "worker", buffer->tid);
+      first = false;
+      for(i = start; i < buffer->count; ++i)
+      {
+         tTraceEvent *event = &buffer->events[i % TRACE_BUFFER_EVENTS];
+         char *c;
+
+         for(c = event->arg; *c != '\0'; ++c)
+            if('"' == *c || '\\' == *c || *c < ' ') *c = '_';  // keep the JSON valid
+         fprintf(fd, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u",
+            event->name, event->phase, (double) (event->timestamp - traceStart) / 1000.0, buffer->tid);
+         if('\0' != event->arg[0])
+            fprintf(fd, ",\"args\":{\"detail\":\"%s\"}", event->arg);
+         fputc('}', fd);
+      }
+   }
+   TRACE_UNLOCK();
+   fprintf(fd, "\n]}\n");
+   fclose(fd);
+}
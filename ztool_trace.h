@@ -0,0 +1,43 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_TRACE_H
+#define ZTOOL_TRACE_H
+
+#include "ztool.h"
+
+// Timeline tracing in Chrome trace-event format (chrome://tracing, Perfetto).
+// Events are recorded into a per-thread ring buffer, without locking or
+// allocation after the first event on a thread, and written out at exit.
+// When tracing is off, each trace point costs one test of trace_enabled.
+
+extern volatile uint8_t trace_enabled;
+
+#define TRACE_BEGIN(name)          if(trace_enabled) TraceEvent('B', name, NULL)
+#define TRACE_BEGIN_ARG(name, arg) if(trace_enabled) TraceEvent('B', name, arg)
+#define TRACE_END(name)            if(trace_enabled) TraceEvent('E', name, NULL)
+
+bool TraceStart(const char *path);
+void TraceEvent(char phase, const char *name, const char *arg);
+void TraceFlush(void);
+
+#endif /* ZTOOL_TRACE_H */
@@ -0,0 +1,359 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#define _GNU_SOURCE  // copy_file_range
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "debug.h"
+#include "ztool.h"
+#include "ztool_depend.h"
+#include "ztool_store.h"
+#include "ztool_write.h"
+
+void WriterInit(tWriter *writer, FILE *fd)
+{
+   memset(writer, 0, sizeof(*writer));
+   writer->fd = fd;
+}
+
+#define RECIPE_LITERAL_LINE 64   // bytes per recipe 'lit' line
+
+static void EndRecipeLiteral(tWriter *writer)
+{
+   if(writer->literal > 0)
+      fputc('\n', writer->fd);
+   writer->literal = 0;
+}
+
+// Record literal image bytes in the recipe as hex
+static bool RecipeLiteral(tWriter *writer, const uint8_t *data, uint32_t length)
+{
+   static const char hex[] = "0123456789abcdef";
+   uint32_t i;
+
+   for(i = 0; i < length; ++i)
+   {
+      if(writer->literal == RECIPE_LITERAL_LINE)
+         EndRecipeLiteral(writer);
+      if(0 == writer->literal)
+         fputs("lit ", writer->fd);
+      fputc(hex[data[i] >> 4], writer->fd);
+      fputc(hex[data[i] & 0xf], writer->fd);
+      writer->literal++;
+   }
+   if(ferror(writer->fd))
+   {
+      ERROR("Failed to write recipe\n");
+      return false;
+   }
+   return true;
+}
+
+#define REPLACE_BUFFER_SIZE 16384
+
+// Move a newly written file ('temp') into place at 'path', unless 'path'
+// already has the same contents. Then the new file is removed and 'path'
+// left alone, keeping its modification time, so that builds depending on it
+// don't run again for nothing. A replaced file's permissions (and owner,
+// where allowed) are kept.
+// Does not produce any messages.
+bool ReplaceIfChanged(const char *temp, const char *path)
+{
+   uint8_t current[REPLACE_BUFFER_SIZE];
+   uint8_t replacement[REPLACE_BUFFER_SIZE];
+   struct stat tempInfo, pathInfo;
+   bool exists = (0 == stat(path, &pathInfo));
+   bool same = false;
+
+   if(exists && 0 == stat(temp, &tempInfo) && tempInfo.st_size == pathInfo.st_size)
+   {
+      FILE *a = fopen(temp, "rb");
+      FILE *b = fopen(path, "rb");
+      size_t count;
+
+      same = (NULL != a && NULL != b);
+      while(same && (count = fread(replacement, 1, sizeof(replacement), a)) > 0)
+         same = (fread(current, 1, count, b) == count) && 0 == memcmp(current, replacement, count);
+      same = same && !ferror(a);
+      if(NULL != a)
+         fclose(a);
+      if(NULL != b)
+         fclose(b);
+   }
+   if(same)
+      return 0 == remove(temp);
+#ifdef WIN32
+   remove(path);  // rename doesn't replace files on Windows
+#else
+   if(exists)
+   {
+      // Without the owner, setuid and setgid bits aren't kept either
+      bool owned = (0 == chown(temp, pathInfo.st_uid, pathInfo.st_gid));
+      chmod(temp, pathInfo.st_mode & (owned ? 07777 : 0777));
+   }
+#endif
+   return 0 == rename(temp, path);
+}
+
+// Open an output file ("-" for standard output) and initialise the writer.
+// Regular files are written under a temporary name and moved into place by
+// WriterClose, only if their contents changed (see ReplaceIfChanged).
+// Anything else (/dev/null, a FIFO, a device) is written directly.
+// Produces error message on failure (so caller doesn't need to).
+bool WriterOpen(tWriter *writer, const char *path, bool binary)
+{
+   char temp[WRITER_PATH_SIZE];
+   struct stat info;
+   bool direct = false;
+   FILE *fd;
+
+   if(0 == strcmp(path, "-"))
+   {
+      fd = stdout;
+#ifdef WIN32
+      if(binary)
+         _setmode(_fileno(stdout), _O_BINARY);
+#endif
+   }
+   else
+   {
+      direct = (0 == stat(path, &info) && !S_ISREG(info.st_mode));
+      if(direct)
+         fd = fopen(path, binary ? "wb" : "w");
+      else if(snprintf(temp, sizeof(temp), "%s.%lu.tmp", path, (unsigned long) getpid()) >= (int) sizeof(temp))
+         fd = NULL;
+      else
+         fd = fopen(temp, binary ? "wb" : "w");
+      if(NULL == fd)
+      {
+         ERROR("Failed to open output file '%s'\n", path);
+         return false;
+      }
+      if(!direct)
+         DEPEND_OUTPUT(path);
+   }
+   WriterInit(writer, fd);
+   if(stdout != fd && !direct)
+   {
+      writer->path = path;
+      strcpy(writer->temp, temp);
+   }
+   return true;
+}
+
+// Close the output opened by WriterOpen (standard output is only flushed)
+// and move it into place
+bool WriterClose(tWriter *writer)
+{
+   bool success = true;
+
+   if(NULL == writer->fd)
+      return true;
+   if(NULL != writer->storeDir)
+   {
+      if(writer->literal > 0)
+         fputc('\n', writer->fd);
+      fprintf(writer->fd, "size %u\n", writer->offset);
+   }
+   if(HEX_FORMAT_NONE != writer->hex.format)
+      success = HexEnd(&writer->hex, writer->fd);
+   if(stdout == writer->fd)
+      success = (0 == fflush(writer->fd)) && success;
+   else
+      success = (0 == fclose(writer->fd)) && success;
+   if(NULL != writer->path)
+   {
+      if(success)
+         success = ReplaceIfChanged(writer->temp, writer->path);
+      if(!success)
+         remove(writer->temp);  // the previous output, if any, is kept
+   }
+   if(!success)
+      ERROR("Failed to complete output file\n");
+   writer->fd = NULL;
+   writer->path = NULL;
+   return success;
+}
+
+// Write data to the output, updating the offset and hash.
+// Produces error message on failure (so caller doesn't need to).
+bool WriterWrite(tWriter *writer, const void *data, uint32_t length)
+{
+   if(0 == length)
+      return true;
+   if(NULL != writer->storeDir)
+   {
+      if(!RecipeLiteral(writer, (const uint8_t *) data, length))
+         return false;
+   }
+   else if(HEX_FORMAT_NONE != writer->hex.format)
+   {
+      if(!HexWrite(&writer->hex, writer->fd, writer->base + writer->offset, (const uint8_t *) data, length))
+         return false;
+   }
+   else if(fwrite(data, 1, length, writer->fd) != length)
+   {
+      ERROR("Failed to write %u bytes at offset 0x%x\n", length, writer->offset);
+      return false;
+   }
+   if(NULL != writer->sha)
+      Sha256Update(writer->sha, data, length);
+   writer->offset += length;
+   return true;
+}
+
+// Write 'length' bytes of the same value
+bool WriterFill(tWriter *writer, uint8_t value, uint32_t length)
+{
+   uint8_t buffer[256];
+
+   if(NULL != writer->storeDir && length > RECIPE_LITERAL_LINE)
+   {
+      EndRecipeLiteral(writer);
+      if(fprintf(writer->fd, "fill %02x %u\n", value, length) < 0)
+         return false;
+      if(NULL != writer->sha)
+      {
+         memset(buffer, value, sizeof(buffer));
+         for(uint32_t i = 0; i < length; i += sizeof(buffer))
+            Sha256Update(writer->sha, buffer, (length - i < sizeof(buffer)) ? length - i : sizeof(buffer));
+      }
+      writer->offset += length;
+      return true;
+   }
+
+   // Erased flash is left out of hex output altogether
+   if(HEX_FORMAT_NONE != writer->hex.format && 0xff == value && NULL == writer->sha)
+   {
+      writer->offset += length;
+      return true;
+   }
+
+   memset(buffer, value, (length < sizeof(buffer)) ? length : sizeof(buffer));
+   while(length > 0)
+   {
+      uint32_t count = (length < sizeof(buffer)) ? length : sizeof(buffer);
+      if(!WriterWrite(writer, buffer, count))
+         return false;
+      length -= count;
+   }
+   return true;
+}
+
+// Write a payload (section contents). In store mode the payload is put in
+// the content-addressed store, and the recipe refers to it by key.
+bool WriterWriteBlob(tWriter *writer, const void *data, uint32_t length)
+{
+   char key[STORE_KEY_SIZE];
+
+   if(NULL == writer->storeDir || 0 == length)
+      return WriterWrite(writer, data, length);
+
+   if(!StoreBlob(writer->storeDir, data, length, key))
+      return false;
+   EndRecipeLiteral(writer);
+   if(fprintf(writer->fd, "blob %s\n", key) < 0)
+   {
+      ERROR("Failed to write recipe\n");
+      return false;
+   }
+   if(NULL != writer->sha)
+      Sha256Update(writer->sha, data, length);
+   writer->offset += length;
+   return true;
+}
+
+// Switch the writer to store mode; the output becomes a recipe
+bool WriterStartRecipe(tWriter *writer, const char *storeDir)
+{
+   writer->storeDir = storeDir;
+   writer->literal = 0;
+   if(fprintf(writer->fd, "%s\n", RECIPE_MAGIC) < 0)
+   {
+      ERROR("Failed to write recipe\n");
+      return false;
+   }
+   return true;
+}
+
+// Switch the writer to hex output, with image offset zero at output->base
+bool WriterStartHex(tWriter *writer, const tHexOutput *output)
+{
+   writer->base = output->base;
+   return HexStart(&writer->hex, writer->fd, output->format);
+}
+
+// Place the next byte written at a flash address, for hex output of data
+// that isn't a contiguous image (such as ELF sections at their own addresses)
+void WriterSetAddress(tWriter *writer, uint32_t address)
+{
+   writer->base = address - writer->offset;
+}
+
+// Copy 'length' bytes from an open file to the output. On Linux this uses
+// copy_file_range, so the kernel can clone (reflink) or copy the data without
+// it passing through user space; otherwise (or if that isn't possible, e.g.
+// the output is a pipe) the data is copied through a buffer.
+bool WriterCopyFile(tWriter *writer, FILE *in, uint32_t length)
+{
+   uint8_t buffer[64 * 1024];
+   uint32_t remaining = length;
+
+#if defined(__linux__)
+   if(NULL == writer->sha && NULL == writer->storeDir && HEX_FORMAT_NONE == writer->hex.format
+      && 0 == fflush(writer->fd))
+   {
+      off_t inOffset = ftell(in);
+      while(remaining > 0)
+      {
+         ssize_t count = copy_file_range(fileno(in), &inOffset, fileno(writer->fd), NULL, remaining, 0);
+         if(count <= 0)
+            break;
+         remaining -= (uint32_t) count;
+         writer->offset += (uint32_t) count;
+      }
+      if(0 != fseek(in, inOffset, SEEK_SET))
+         return false;
+   }
+#endif
+
+   while(remaining > 0)
+   {
+      uint32_t count = (remaining < sizeof(buffer)) ? remaining : sizeof(buffer);
+      if(fread(buffer, 1, count, in) != count)
+      {
+         ERROR("Failed to read %u bytes for copy\n", count);
+         return false;
+      }
+      if(!WriterWrite(writer, buffer, count))
+         return false;
+      remaining -= count;
+   }
+   return true;
+}
@@ -0,0 +1,73 @@
+/**********************************************************************************
+*
+*    Copyright 2018 Zorxx Software <zorxx@zorxx.com> 
+*    Copyright (c) 2015 Richard A Burton <richardaburton@gmail.com>
+*
+*    This file is part of ztool, based on esptool2.
+*
+*    ztool is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    ztool is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with ztool.  If not, see <http://www.gnu.org/licenses/>.
+*
+**********************************************************************************/
+
+#ifndef ZTOOL_WRITE_H
+#define ZTOOL_WRITE_H
+
+#include <stdio.h>
+#include "ztool.h"
+#include "ztool_hex.h"
+#include "ztool_sha256.h"
+
+#define WRITER_PATH_SIZE 1056   // output path, plus temporary suffix
+
+// Output stream used when building images. The path "-" selects standard
+// output, so images can be produced in the middle of a pipeline. Everything written to an image
+// goes through WriterWrite, so the writer always knows the image offset and
+// can hash the output in the same pass as it is written. The offset is
+// tracked here rather than with ftell, which does not work on pipes.
+//
+// When a store directory is set, the output file receives a recipe instead
+// of the image: payloads written with WriterWriteBlob go to the content-
+// addressed store, everything else is recorded inline (see ztool_store.h).
+//
+// Output files are written under a temporary name, and only replace the
+// file at 'path' when their contents differ from it.
+//
+// When hex output is selected, the image is written as Intel HEX or
+// S-records instead, with image offset zero at flash address 'base'.
+typedef struct
+{
+   FILE       *fd;
+   uint32_t    offset;     // bytes written so far (of the image, in store mode)
+   tSha256    *sha;        // optional; updated with every byte written
+   const char *storeDir;   // optional; write a recipe and store blobs
+   uint32_t    literal;    // bytes on the current recipe 'lit' line
+   tHexSink    hex;        // hex.format is HEX_FORMAT_NONE for binary output
+   uint32_t    base;       // flash address of image offset zero (hex output)
+   const char *path;       // output file, or NULL for standard output
+   char        temp[WRITER_PATH_SIZE];   // where it is written until closed
+} tWriter;
+
+void WriterInit(tWriter *writer, FILE *fd);
+bool WriterOpen(tWriter *writer, const char *path, bool binary);
+bool WriterClose(tWriter *writer);
+bool WriterWrite(tWriter *writer, const void *data, uint32_t length);
+bool WriterFill(tWriter *writer, uint8_t value, uint32_t length);
+bool WriterWriteBlob(tWriter *writer, const void *data, uint32_t length);
+bool WriterCopyFile(tWriter *writer, FILE *in, uint32_t length);
+bool WriterStartRecipe(tWriter *writer, const char *storeDir);
+bool WriterStartHex(tWriter *writer, const tHexOutput *output);
+void WriterSetAddress(tWriter *writer, uint32_t address);
+bool ReplaceIfChanged(const char *temp, const char *path);
+
+#endif /* ZTOOL_WRITE_H */